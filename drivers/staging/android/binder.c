@@ -28,6 +28,7 @@
 #include <linux/poll.h>
 #include <linux/debugfs.h>
 #include <linux/rbtree.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/seq_file.h>
 #include <linux/slab.h>
@@ -35,19 +36,56 @@
 #include <linux/vmalloc.h>
 
 #include "binder.h"
+#include "binder_trace.h"
 
-static DEFINE_MUTEX(binder_lock);
+/*
+ * Locking:
+ *
+ * binder_lock is taken shared by every ioctl, poll and read path.  It is
+ * only taken exclusive to add or remove a proc (open and the deferred
+ * release work), for thread exit and context manager setup, for debugfs
+ * dumps, and as the fallback described below.
+ *
+ * While binder_lock is held shared, each binder_proc is protected by its
+ * own proc->lock.  The proc lock covers the proc's thread, node and ref
+ * trees, so threads and nodes are created under it alone.  It also covers
+ * its buffers, the todo lists of the proc and its threads, the
+ * transaction stacks of its threads and all state of the nodes the proc
+ * owns.  An ioctl starts out holding the lock of the calling proc.
+ *
+ * A command that touches other procs (a transaction touches the target
+ * and the owner of every node passed by handle) takes their locks with
+ * binder_lock_proc(): a lock above all held ones in address order is
+ * simply taken, any other one is trylocked.  If the trylock fails the
+ * command returns -EAGAIN, having undone anything it changed, and
+ * binder_relock() drops all proc locks and takes them again together
+ * with the missing one in ascending address order before the command is
+ * restarted.  If the set grows beyond BINDER_MAX_LOCKED_PROCS, the
+ * restarts exceed BINDER_MAX_LOCK_RETRIES, or the command has to walk
+ * state owned by an unknown number of procs (failing a reply to a dead
+ * thread, a node whose proc is gone), the command is restarted with
+ * binder_lock held exclusive, where proc locks are not taken at all.
+ *
+ * Lock order: binder_lock -> proc->lock (ascending address) ->
+ * mm->mmap_sem -> binder_deferred_lock.  binder_page_lru_lock is a leaf
+ * lock; binder_shrink() only trylocks the locks above it.
+ */
+static DECLARE_RWSEM(binder_lock);
 static DEFINE_MUTEX(binder_deferred_lock);
 
 static HLIST_HEAD(binder_procs);
 static HLIST_HEAD(binder_deferred_list);
 static HLIST_HEAD(binder_dead_nodes);
 
+static DEFINE_SPINLOCK(binder_page_lru_lock);
+static LIST_HEAD(binder_page_lru);
+static unsigned long binder_page_lru_count;
+
 static struct dentry *binder_debugfs_dir_entry_root;
 static struct dentry *binder_debugfs_dir_entry_proc;
 static struct binder_node *binder_context_mgr_node;
 static uid_t binder_context_mgr_uid = -1;
-static int binder_last_id;
+static atomic_t binder_last_id;
 static struct workqueue_struct *binder_deferred_workqueue;
 
 #define BINDER_DEBUG_ENTRY(name) \
@@ -145,23 +183,33 @@ enum binder_stat_types {
 	BINDER_STAT_COUNT
 };
 
+enum binder_lock_stat_types {
+	BINDER_LOCK_STAT_GLOBAL_SHARED,
+	BINDER_LOCK_STAT_GLOBAL_EXCLUSIVE,
+	BINDER_LOCK_STAT_PROC,
+	BINDER_LOCK_STAT_RETRY,
+	BINDER_LOCK_STAT_FALLBACK,
+	BINDER_LOCK_STAT_COUNT
+};
+
 struct binder_stats {
-	int br[_IOC_NR(BR_FAILED_REPLY) + 1];
-	int bc[_IOC_NR(BC_DEAD_BINDER_DONE) + 1];
-	int obj_created[BINDER_STAT_COUNT];
-	int obj_deleted[BINDER_STAT_COUNT];
+	atomic_t br[_IOC_NR(BR_FAILED_REPLY) + 1];
+	atomic_t bc[_IOC_NR(BC_REPLY_SG) + 1];
+	atomic_t obj_created[BINDER_STAT_COUNT];
+	atomic_t obj_deleted[BINDER_STAT_COUNT];
+	atomic_t lock_contended[BINDER_LOCK_STAT_COUNT];
 };
 
 static struct binder_stats binder_stats;
 
 static inline void binder_stats_deleted(enum binder_stat_types type)
 {
-	binder_stats.obj_deleted[type]++;
+	atomic_inc(&binder_stats.obj_deleted[type]);
 }
 
 static inline void binder_stats_created(enum binder_stat_types type)
 {
-	binder_stats.obj_created[type]++;
+	atomic_inc(&binder_stats.obj_created[type]);
 }
 
 struct binder_transaction_log_entry {
@@ -183,19 +231,19 @@ struct binder_transaction_log {
 };
 static struct binder_transaction_log binder_transaction_log;
 static struct binder_transaction_log binder_transaction_log_failed;
+static DEFINE_SPINLOCK(binder_transaction_log_lock);
 
-static struct binder_transaction_log_entry *binder_transaction_log_add(
-	struct binder_transaction_log *log)
+static void binder_transaction_log_add(struct binder_transaction_log *log,
+				       struct binder_transaction_log_entry *e)
 {
-	struct binder_transaction_log_entry *e;
-	e = &log->entry[log->next];
-	memset(e, 0, sizeof(*e));
+	spin_lock(&binder_transaction_log_lock);
+	log->entry[log->next] = *e;
 	log->next++;
 	if (log->next == ARRAY_SIZE(log->entry)) {
 		log->next = 0;
 		log->full = 1;
 	}
-	return e;
+	spin_unlock(&binder_transaction_log_lock);
 }
 
 struct binder_work {
@@ -210,6 +258,16 @@ struct binder_work {
 	} type;
 };
 
+/*
+ * A scheduling policy and priority.  prio is the nice value for
+ * SCHED_NORMAL and SCHED_BATCH and the rt priority for SCHED_FIFO and
+ * SCHED_RR.
+ */
+struct binder_priority {
+	unsigned int sched_policy;
+	int prio;
+};
+
 struct binder_node {
 	int debug_id;
 	struct binder_work work;
@@ -230,7 +288,7 @@ struct binder_node {
 	unsigned pending_weak_ref:1;
 	unsigned has_async_transaction:1;
 	unsigned accept_fds:1;
-	unsigned min_priority:8;
+	struct binder_priority min_priority;
 	struct list_head async_todo;
 };
 
@@ -258,8 +316,10 @@ struct binder_ref {
 
 struct binder_buffer {
 	struct list_head entry; /* free and allocated entries by addesss */
-	struct rb_node rb_node; /* free entry by size or allocated entry */
-				/* by address */
+	union {
+		struct rb_node rb_node; /* allocated entry by address */
+		struct list_head free_entry; /* free entry by size class */
+	};
 	unsigned free:1;
 	unsigned allow_user_free:1;
 	unsigned async_transaction:1;
@@ -270,9 +330,48 @@ struct binder_buffer {
 	struct binder_node *target_node;
 	size_t data_size;
 	size_t offsets_size;
+	size_t extra_buffers_size;
 	uint8_t data[0];
 };
 
+/*
+ * Free buffers are kept on segregated lists, list n holding the buffers
+ * whose size has its highest set bit at n - 1.  Every buffer on a list
+ * above the class of a request is large enough for it, so only the
+ * request's own class ever has to be searched.
+ */
+#define BINDER_FREE_CLASSES 24
+
+/*
+ * Pages of the mmap'd buffer area.  A page that is no longer used by any
+ * buffer stays mapped in the kernel and in userspace and is put on
+ * binder_page_lru, so the next allocation that covers it does not have to
+ * allocate and map it again.  binder_shrink() unmaps and frees pages from
+ * the lru under memory pressure.
+ */
+struct binder_lru_page {
+	struct list_head lru;
+	struct page *page_ptr;
+	struct binder_proc *proc;
+};
+
+/*
+ * Round trip latency of two-way transactions, from BC_TRANSACTION to the
+ * matching BC_REPLY, accounted to the proc that replied.  Bucket i counts
+ * replies that took less than 2^i microseconds, the last bucket counts
+ * everything slower.  Transactions are split into bands by the priority
+ * of the caller.
+ */
+#define BINDER_LATENCY_BUCKETS 16
+
+enum binder_latency_bands {
+	BINDER_LATENCY_BAND_RT,
+	BINDER_LATENCY_BAND_HIGH,
+	BINDER_LATENCY_BAND_NORMAL,
+	BINDER_LATENCY_BAND_BACKGROUND,
+	BINDER_LATENCY_BAND_COUNT
+};
+
 enum binder_deferred_state {
 	BINDER_DEFERRED_PUT_FILES    = 0x01,
 	BINDER_DEFERRED_FLUSH        = 0x02,
@@ -281,6 +380,7 @@ enum binder_deferred_state {
 
 struct binder_proc {
 	struct hlist_node proc_node;
+	struct mutex lock;
 	struct rb_root threads;
 	struct rb_root nodes;
 	struct rb_root refs_by_desc;
@@ -295,23 +395,27 @@ struct binder_proc {
 	ptrdiff_t user_buffer_offset;
 
 	struct list_head buffers;
-	struct rb_root free_buffers;
+	struct list_head free_buffers[BINDER_FREE_CLASSES];
+	unsigned long free_classes;
 	struct rb_root allocated_buffers;
 	size_t free_async_space;
 
-	struct page **pages;
+	struct binder_lru_page *pages;
 	size_t buffer_size;
 	uint32_t buffer_free;
 	struct list_head todo;
 	wait_queue_head_t wait;
+	struct list_head waiting_threads;
 	struct binder_stats stats;
 	struct list_head delivered_death;
 	int max_threads;
 	int requested_threads;
 	int requested_threads_started;
 	int ready_threads;
-	long default_priority;
+	struct binder_priority default_priority;
 	struct dentry *debugfs_entry;
+	unsigned long latency[BINDER_LATENCY_BAND_COUNT]
+			     [BINDER_LATENCY_BUCKETS];
 };
 
 enum {
@@ -335,6 +439,7 @@ struct binder_thread {
 		/* buffer. Used when sending a reply to a dead process that */
 		/* we are also waiting on */
 	wait_queue_head_t wait;
+	struct list_head waiting_thread_node; /* idle on proc->waiting_threads */
 	struct binder_stats stats;
 };
 
@@ -352,14 +457,226 @@ struct binder_transaction {
 	struct binder_buffer *buffer;
 	unsigned int	code;
 	unsigned int	flags;
-	long	priority;
-	long	saved_priority;
+	struct binder_priority	priority;
+	struct binder_priority	saved_priority;
 	uid_t	sender_euid;
+	ktime_t	start_time;
+	int	latency_band;
+};
+
+#define BINDER_MAX_LOCKED_PROCS 8
+#define BINDER_MAX_LOCK_RETRIES 4
+
+/*
+ * Locks held by one ioctl, see the locking comment at the top of the file.
+ * procs[] holds the proc locks currently taken, pending[] the procs that
+ * could not be locked in order and have to be taken on the next attempt.
+ */
+struct binder_locks {
+	int exclusive;
+	int need_exclusive;
+	int retries;
+	int count;
+	int pending_count;
+	struct binder_proc *procs[BINDER_MAX_LOCKED_PROCS];
+	struct binder_proc *pending[BINDER_MAX_LOCKED_PROCS];
 };
 
 static void
 binder_defer_work(struct binder_proc *proc, enum binder_deferred_state defer);
 
+static void binder_lock_contended(struct binder_proc *proc,
+				  enum binder_lock_stat_types type)
+{
+	atomic_inc(&binder_stats.lock_contended[type]);
+	if (proc)
+		atomic_inc(&proc->stats.lock_contended[type]);
+}
+
+static void binder_lock_init(struct binder_locks *locks)
+{
+	memset(locks, 0, sizeof(*locks));
+}
+
+static void binder_unlock_procs(struct binder_locks *locks)
+{
+	while (locks->count)
+		mutex_unlock(&locks->procs[--locks->count]->lock);
+}
+
+static void binder_unlock(struct binder_locks *locks)
+{
+	binder_unlock_procs(locks);
+	if (locks->exclusive)
+		up_write(&binder_lock);
+	else
+		up_read(&binder_lock);
+	locks->exclusive = 0;
+}
+
+static void binder_lock_proc_in_order(struct binder_locks *locks,
+				      struct binder_proc *proc)
+{
+	if (!mutex_trylock(&proc->lock)) {
+		ktime_t start = ktime_get();
+
+		binder_lock_contended(proc, BINDER_LOCK_STAT_PROC);
+		mutex_lock_nested(&proc->lock, locks->count);
+		trace_binder_lock_wait(proc, BINDER_LOCK_STAT_PROC,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	}
+	locks->procs[locks->count++] = proc;
+}
+
+/*
+ * Take binder_lock shared and the lock of the calling proc.
+ */
+static void binder_lock_shared(struct binder_locks *locks,
+			       struct binder_proc *proc)
+{
+	if (!down_read_trylock(&binder_lock)) {
+		ktime_t start = ktime_get();
+
+		binder_lock_contended(proc, BINDER_LOCK_STAT_GLOBAL_SHARED);
+		down_read(&binder_lock);
+		trace_binder_lock_wait(proc, BINDER_LOCK_STAT_GLOBAL_SHARED,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	}
+	locks->exclusive = 0;
+	locks->need_exclusive = 0;
+	locks->retries = 0;
+	locks->pending_count = 0;
+	binder_lock_proc_in_order(locks, proc);
+}
+
+/*
+ * Take binder_lock exclusive, no proc locks are needed then.
+ */
+static void binder_lock_global(struct binder_locks *locks,
+			       struct binder_proc *proc)
+{
+	if (!down_write_trylock(&binder_lock)) {
+		ktime_t start = ktime_get();
+
+		binder_lock_contended(proc, BINDER_LOCK_STAT_GLOBAL_EXCLUSIVE);
+		down_write(&binder_lock);
+		trace_binder_lock_wait(proc, BINDER_LOCK_STAT_GLOBAL_EXCLUSIVE,
+			ktime_to_ns(ktime_sub(ktime_get(), start)));
+	}
+	locks->exclusive = 1;
+	locks->need_exclusive = 0;
+	locks->pending_count = 0;
+}
+
+/*
+ * Switch to holding binder_lock exclusive.  Everything that was looked up
+ * under the previous locks must be looked up again.
+ */
+static void binder_lock_exclusive(struct binder_locks *locks,
+				  struct binder_proc *proc)
+{
+	if (locks->exclusive)
+		return;
+	binder_unlock(locks);
+	binder_lock_global(locks, proc);
+}
+
+static int binder_proc_locked(struct binder_locks *locks,
+			      struct binder_proc *proc)
+{
+	int i;
+
+	for (i = 0; i < locks->count; i++)
+		if (locks->procs[i] == proc)
+			return 1;
+	return 0;
+}
+
+/*
+ * Make sure the lock of proc is held.  Returns -EAGAIN if the caller must
+ * back out without changing any state and let binder_relock() take the
+ * locks it needs.
+ */
+static int binder_lock_proc(struct binder_locks *locks,
+			    struct binder_proc *proc)
+{
+	int i;
+
+	if (locks->exclusive || binder_proc_locked(locks, proc))
+		return 0;
+	if (locks->count == BINDER_MAX_LOCKED_PROCS) {
+		locks->need_exclusive = 1;
+		return -EAGAIN;
+	}
+	for (i = 0; i < locks->count; i++)
+		if (locks->procs[i] > proc)
+			break;
+	if (i == locks->count) {
+		binder_lock_proc_in_order(locks, proc);
+		return 0;
+	}
+	if (mutex_trylock(&proc->lock)) {
+		locks->procs[locks->count++] = proc;
+		return 0;
+	}
+	binder_lock_contended(proc, BINDER_LOCK_STAT_RETRY);
+	if (locks->pending_count == BINDER_MAX_LOCKED_PROCS)
+		locks->need_exclusive = 1;
+	else
+		locks->pending[locks->pending_count++] = proc;
+	return -EAGAIN;
+}
+
+/*
+ * Request a retry with binder_lock held exclusive.
+ */
+static int binder_need_exclusive(struct binder_locks *locks)
+{
+	if (locks->exclusive)
+		return 0;
+	locks->need_exclusive = 1;
+	return -EAGAIN;
+}
+
+/*
+ * Called after a command returned -EAGAIN.  Drops the proc locks and takes
+ * them again together with the pending ones in ascending address order,
+ * or switches to exclusive mode if that is not possible.  binder_lock is
+ * never released in shared mode, so no proc can go away in between.
+ */
+static void binder_relock(struct binder_locks *locks, struct binder_proc *proc)
+{
+	struct binder_proc *want[BINDER_MAX_LOCKED_PROCS * 2];
+	int count = 0;
+	int i, j;
+
+	if (locks->exclusive)
+		return;
+	if (locks->need_exclusive ||
+	    ++locks->retries > BINDER_MAX_LOCK_RETRIES ||
+	    locks->count + locks->pending_count > BINDER_MAX_LOCKED_PROCS) {
+		binder_lock_contended(proc, BINDER_LOCK_STAT_FALLBACK);
+		binder_lock_exclusive(locks, proc);
+		return;
+	}
+	for (i = 0; i < locks->count; i++)
+		want[count++] = locks->procs[i];
+	for (i = 0; i < locks->pending_count; i++)
+		want[count++] = locks->pending[i];
+	locks->pending_count = 0;
+	binder_unlock_procs(locks);
+
+	for (i = 1; i < count; i++) {
+		struct binder_proc *tmp = want[i];
+		for (j = i; j > 0 && want[j - 1] > tmp; j--)
+			want[j] = want[j - 1];
+		want[j] = tmp;
+	}
+	for (i = 0; i < count; i++)
+		if (i == 0 || want[i] != want[i - 1])
+			binder_lock_proc_in_order(locks, want[i]);
+}
+
 /*
  * copied from get_unused_fd_flags
  */
@@ -498,6 +815,53 @@ out_unlock:
 	return -EBADF;
 }
 
+static int binder_is_rt_policy(unsigned int policy)
+{
+	return policy == SCHED_FIFO || policy == SCHED_RR;
+}
+
+static struct binder_priority binder_get_priority(struct task_struct *task)
+{
+	struct binder_priority p;
+
+	p.sched_policy = task->policy;
+	if (binder_is_rt_policy(p.sched_policy))
+		p.prio = task->rt_priority;
+	else
+		p.prio = task_nice(task);
+	return p;
+}
+
+/*
+ * Returns true if a runs ahead of b: any rt policy beats the fair
+ * policies, a higher rt priority beats a lower one and a lower nice value
+ * beats a higher one.
+ */
+static bool binder_priority_higher(struct binder_priority a,
+				   struct binder_priority b)
+{
+	if (binder_is_rt_policy(a.sched_policy) !=
+	    binder_is_rt_policy(b.sched_policy))
+		return binder_is_rt_policy(a.sched_policy);
+	if (binder_is_rt_policy(a.sched_policy))
+		return a.prio > b.prio;
+	return a.prio < b.prio;
+}
+
+static struct binder_priority binder_node_min_priority(unsigned long flags)
+{
+	struct binder_priority p;
+	int prio = flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+
+	p.sched_policy = (flags & FLAT_BINDER_FLAG_SCHED_POLICY_MASK) >>
+			 FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT;
+	if (binder_is_rt_policy(p.sched_policy))
+		p.prio = clamp(prio, 1, MAX_USER_RT_PRIO - 1);
+	else
+		p.prio = clamp((int)(signed char)prio, -20, 19);
+	return p;
+}
+
 static void binder_set_nice(long nice)
 {
 	long min_nice;
@@ -515,6 +879,53 @@ static void binder_set_nice(long nice)
 	binder_user_error("binder: %d RLIMIT_NICE not set\n", current->pid);
 }
 
+/*
+ * Switch current to the policy and priority in p.  An rt priority
+ * inherited from a caller, or restored after a reply, is applied as is:
+ * the caller was allowed to run at it and the thread only keeps it for
+ * the duration of the transaction.  Any other rt priority is capped by
+ * RLIMIT_RTPRIO unless the thread has CAP_SYS_NICE.  Nice values are
+ * always capped by RLIMIT_NICE.
+ */
+static void binder_set_priority(struct binder_priority p, bool inherited)
+{
+	struct sched_param param = { .sched_priority = 0 };
+	unsigned int policy = p.sched_policy;
+
+	if (binder_is_rt_policy(policy) && !inherited &&
+	    !capable(CAP_SYS_NICE)) {
+		unsigned long max_rtprio = rlimit(RLIMIT_RTPRIO);
+
+		if (max_rtprio == 0) {
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: rt priority %d not allowed "
+				     "use nice -20 instead\n",
+				     current->pid, p.prio);
+			policy = SCHED_NORMAL;
+			p.prio = -20;
+		} else if (p.prio > max_rtprio) {
+			binder_debug(BINDER_DEBUG_PRIORITY_CAP,
+				     "binder: %d: rt priority %d not allowed "
+				     "use %lu instead\n",
+				     current->pid, p.prio, max_rtprio);
+			p.prio = max_rtprio;
+		}
+	}
+
+	if (binder_is_rt_policy(policy)) {
+		if (current->policy == policy && current->rt_priority == p.prio)
+			return;
+		param.sched_priority = p.prio;
+		sched_setscheduler_nocheck(current,
+					   policy | SCHED_RESET_ON_FORK, &param);
+		return;
+	}
+	if (current->policy != policy)
+		sched_setscheduler_nocheck(current,
+					   policy | SCHED_RESET_ON_FORK, &param);
+	binder_set_nice(p.prio);
+}
+
 static size_t binder_buffer_size(struct binder_proc *proc,
 				 struct binder_buffer *buffer)
 {
@@ -525,14 +936,18 @@ static size_t binder_buffer_size(struct binder_proc *proc,
 			struct binder_buffer, entry) - (size_t)buffer->data;
 }
 
+static int binder_free_class(size_t size)
+{
+	int class = fls(size);
+
+	return min(class, BINDER_FREE_CLASSES - 1);
+}
+
 static void binder_insert_free_buffer(struct binder_proc *proc,
 				      struct binder_buffer *new_buffer)
 {
-	struct rb_node **p = &proc->free_buffers.rb_node;
-	struct rb_node *parent = NULL;
-	struct binder_buffer *buffer;
-	size_t buffer_size;
 	size_t new_buffer_size;
+	int class;
 
 	BUG_ON(!new_buffer->free);
 
@@ -542,20 +957,53 @@ static void binder_insert_free_buffer(struct binder_proc *proc,
 		     "binder: %d: add free buffer, size %zd, "
 		     "at %p\n", proc->pid, new_buffer_size, new_buffer);
 
-	while (*p) {
-		parent = *p;
-		buffer = rb_entry(parent, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
+	class = binder_free_class(new_buffer_size);
+	list_add(&new_buffer->free_entry, &proc->free_buffers[class]);
+	__set_bit(class, &proc->free_classes);
+}
 
-		buffer_size = binder_buffer_size(proc, buffer);
+/*
+ * The size of a free buffer does not change while it is on a free list,
+ * so it still selects the list the buffer was added to.
+ */
+static void binder_erase_free_buffer(struct binder_proc *proc,
+				     struct binder_buffer *buffer)
+{
+	int class = binder_free_class(binder_buffer_size(proc, buffer));
 
-		if (new_buffer_size < buffer_size)
-			p = &parent->rb_left;
-		else
-			p = &parent->rb_right;
+	BUG_ON(!buffer->free);
+	list_del(&buffer->free_entry);
+	if (list_empty(&proc->free_buffers[class]))
+		__clear_bit(class, &proc->free_classes);
+}
+
+static struct binder_buffer *binder_find_free_buffer(struct binder_proc *proc,
+						     size_t size)
+{
+	struct binder_buffer *buffer, *best_fit = NULL;
+	size_t buffer_size, best_fit_size = 0;
+	int class = binder_free_class(size);
+
+	list_for_each_entry(buffer, &proc->free_buffers[class], free_entry) {
+		buffer_size = binder_buffer_size(proc, buffer);
+		if (buffer_size < size)
+			continue;
+		if (buffer_size == size)
+			return buffer;
+		if (best_fit == NULL || buffer_size < best_fit_size) {
+			best_fit = buffer;
+			best_fit_size = buffer_size;
+		}
 	}
-	rb_link_node(&new_buffer->rb_node, parent, p);
-	rb_insert_color(&new_buffer->rb_node, &proc->free_buffers);
+	if (best_fit)
+		return best_fit;
+
+	class = find_next_bit(&proc->free_classes, BINDER_FREE_CLASSES,
+			      class + 1);
+	if (class >= BINDER_FREE_CLASSES)
+		return NULL;
+	return list_first_entry(&proc->free_buffers[class],
+				struct binder_buffer, free_entry);
 }
 
 static void binder_insert_allocated_buffer(struct binder_proc *proc,
@@ -607,6 +1055,23 @@ static struct binder_buffer *binder_buffer_lookup(struct binder_proc *proc,
 	return NULL;
 }
 
+static void binder_lru_add_pages(struct binder_proc *proc,
+				 void *start, void *end)
+{
+	void *page_addr;
+	struct binder_lru_page *page;
+
+	spin_lock(&binder_page_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		BUG_ON(!page->page_ptr);
+		BUG_ON(!list_empty(&page->lru));
+		list_add_tail(&page->lru, &binder_page_lru);
+		binder_page_lru_count++;
+	}
+	spin_unlock(&binder_page_lru_lock);
+}
+
 static int binder_update_page_range(struct binder_proc *proc, int allocate,
 				    void *start, void *end,
 				    struct vm_area_struct *vma)
@@ -614,8 +1079,9 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	void *page_addr;
 	unsigned long user_page_addr;
 	struct vm_struct tmp_area;
-	struct page **page;
-	struct mm_struct *mm;
+	struct binder_lru_page *page;
+	struct mm_struct *mm = NULL;
+	int need_mm = 0;
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: %s pages %p-%p\n", proc->pid,
@@ -624,9 +1090,32 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	if (end <= start)
 		return 0;
 
-	if (vma)
-		mm = NULL;
-	else
+	if (allocate == 0) {
+		/*
+		 * Keep the pages mapped and let binder_shrink give them
+		 * back when the system needs the memory.
+		 */
+		binder_lru_add_pages(proc, start, end);
+		return 0;
+	}
+
+	spin_lock(&binder_page_lru_lock);
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (!page->page_ptr) {
+			need_mm = 1;
+			continue;
+		}
+		BUG_ON(list_empty(&page->lru));
+		list_del_init(&page->lru);
+		binder_page_lru_count--;
+	}
+	spin_unlock(&binder_page_lru_lock);
+
+	if (!need_mm)
+		return 0;
+
+	if (!vma)
 		mm = get_task_mm(proc->tsk);
 
 	if (mm) {
@@ -634,9 +1123,6 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		vma = proc->vma;
 	}
 
-	if (allocate == 0)
-		goto free_range;
-
 	if (vma == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf failed to "
 		       "map pages in userspace, no vma\n", proc->pid);
@@ -648,16 +1134,17 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		struct page **page_array_ptr;
 		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
 
-		BUG_ON(*page);
-		*page = alloc_page(GFP_KERNEL | __GFP_ZERO);
-		if (*page == NULL) {
+		if (page->page_ptr)
+			continue;
+		page->page_ptr = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (page->page_ptr == NULL) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "for page at %p\n", proc->pid, page_addr);
 			goto err_alloc_page_failed;
 		}
 		tmp_area.addr = page_addr;
 		tmp_area.size = PAGE_SIZE + PAGE_SIZE /* guard page? */;
-		page_array_ptr = page;
+		page_array_ptr = &page->page_ptr;
 		ret = map_vm_area(&tmp_area, PAGE_KERNEL, &page_array_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
@@ -667,7 +1154,7 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 		}
 		user_page_addr =
 			(uintptr_t)page_addr + proc->user_buffer_offset;
-		ret = vm_insert_page(vma, user_page_addr, page[0]);
+		ret = vm_insert_page(vma, user_page_addr, page->page_ptr);
 		if (ret) {
 			printk(KERN_ERR "binder: %d: binder_alloc_buf failed "
 			       "to map page at %lx in userspace\n",
@@ -682,37 +1169,104 @@ static int binder_update_page_range(struct binder_proc *proc, int allocate,
 	}
 	return 0;
 
-free_range:
-	for (page_addr = end - PAGE_SIZE; page_addr >= start;
-	     page_addr -= PAGE_SIZE) {
-		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
-		if (vma)
-			zap_page_range(vma, (uintptr_t)page_addr +
-				proc->user_buffer_offset, PAGE_SIZE, NULL);
 err_vm_insert_page_failed:
-		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+	unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
 err_map_kernel_failed:
-		__free_page(*page);
-		*page = NULL;
+	__free_page(page->page_ptr);
+	page->page_ptr = NULL;
 err_alloc_page_failed:
-		;
-	}
 err_no_vma:
 	if (mm) {
 		up_write(&mm->mmap_sem);
 		mmput(mm);
 	}
+	/* Give the pages that are still mapped back to the cache */
+	for (page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
+		page = &proc->pages[(page_addr - proc->buffer) / PAGE_SIZE];
+		if (page->page_ptr)
+			binder_lru_add_pages(proc, page_addr,
+					     page_addr + PAGE_SIZE);
+	}
 	return -ENOMEM;
 }
 
+static int binder_shrink(struct shrinker *shrinker, struct shrink_control *sc)
+{
+	struct binder_lru_page *page;
+	struct binder_proc *proc;
+	struct mm_struct *mm;
+	void *page_addr;
+	int nr_to_scan = sc->nr_to_scan;
+	int count;
+
+	if (nr_to_scan == 0)
+		return binder_page_lru_count;
+
+	if (!down_read_trylock(&binder_lock))
+		return -1;
+
+	spin_lock(&binder_page_lru_lock);
+	while (nr_to_scan-- > 0 && !list_empty(&binder_page_lru)) {
+		page = list_first_entry(&binder_page_lru,
+					struct binder_lru_page, lru);
+		proc = page->proc;
+		if (!mutex_trylock(&proc->lock)) {
+			list_move_tail(&page->lru, &binder_page_lru);
+			continue;
+		}
+		list_del_init(&page->lru);
+		binder_page_lru_count--;
+		spin_unlock(&binder_page_lru_lock);
+
+		page_addr = proc->buffer +
+			(page - proc->pages) * PAGE_SIZE;
+		mm = get_task_mm(proc->tsk);
+		if (mm && !down_read_trylock(&mm->mmap_sem)) {
+			mmput(mm);
+			mutex_unlock(&proc->lock);
+			spin_lock(&binder_page_lru_lock);
+			list_add_tail(&page->lru, &binder_page_lru);
+			binder_page_lru_count++;
+			continue;
+		}
+		if (mm && proc->vma)
+			zap_page_range(proc->vma, (uintptr_t)page_addr +
+				       proc->user_buffer_offset, PAGE_SIZE,
+				       NULL);
+		if (mm) {
+			up_read(&mm->mmap_sem);
+			mmput(mm);
+		}
+		unmap_kernel_range((unsigned long)page_addr, PAGE_SIZE);
+		__free_page(page->page_ptr);
+		page->page_ptr = NULL;
+		mutex_unlock(&proc->lock);
+
+		binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+			     "binder: %d: shrink page at %p\n",
+			     proc->pid, page_addr);
+		spin_lock(&binder_page_lru_lock);
+	}
+	count = binder_page_lru_count;
+	spin_unlock(&binder_page_lru_lock);
+	up_read(&binder_lock);
+
+	return count;
+}
+
+static struct shrinker binder_shrinker = {
+	.shrink = binder_shrink,
+	.seeks = DEFAULT_SEEKS,
+};
+
 static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 					      size_t data_size,
-					      size_t offsets_size, int is_async)
+					      size_t offsets_size,
+					      size_t extra_buffers_size,
+					      int is_async)
 {
-	struct rb_node *n = proc->free_buffers.rb_node;
 	struct binder_buffer *buffer;
 	size_t buffer_size;
-	struct rb_node *best_fit = NULL;
 	void *has_page_addr;
 	void *end_page_addr;
 	size_t size;
@@ -731,6 +1285,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 			"size %zd-%zd\n", proc->pid, data_size, offsets_size);
 		return NULL;
 	}
+	size += ALIGN(extra_buffers_size, sizeof(void *));
+	if (size < extra_buffers_size) {
+		binder_user_error("binder: %d: got transaction with invalid "
+			"extra buffers size %zd\n", proc->pid,
+			extra_buffers_size);
+		return NULL;
+	}
 
 	if (is_async &&
 	    proc->free_async_space < size + sizeof(struct binder_buffer)) {
@@ -740,30 +1301,13 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		return NULL;
 	}
 
-	while (n) {
-		buffer = rb_entry(n, struct binder_buffer, rb_node);
-		BUG_ON(!buffer->free);
-		buffer_size = binder_buffer_size(proc, buffer);
-
-		if (size < buffer_size) {
-			best_fit = n;
-			n = n->rb_left;
-		} else if (size > buffer_size)
-			n = n->rb_right;
-		else {
-			best_fit = n;
-			break;
-		}
-	}
-	if (best_fit == NULL) {
+	buffer = binder_find_free_buffer(proc, size);
+	if (buffer == NULL) {
 		printk(KERN_ERR "binder: %d: binder_alloc_buf size %zd failed, "
 		       "no address space\n", proc->pid, size);
 		return NULL;
 	}
-	if (n == NULL) {
-		buffer = rb_entry(best_fit, struct binder_buffer, rb_node);
-		buffer_size = binder_buffer_size(proc, buffer);
-	}
+	buffer_size = binder_buffer_size(proc, buffer);
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_alloc_buf size %zd got buff"
@@ -771,7 +1315,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 
 	has_page_addr =
 		(void *)(((uintptr_t)buffer->data + buffer_size) & PAGE_MASK);
-	if (n == NULL) {
+	if (buffer_size != size) {
 		if (size + sizeof(struct binder_buffer) + 4 >= buffer_size)
 			buffer_size = size; /* no room for other buffers */
 		else
@@ -785,7 +1329,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 	    (void *)PAGE_ALIGN((uintptr_t)buffer->data), end_page_addr, NULL))
 		return NULL;
 
-	rb_erase(best_fit, &proc->free_buffers);
+	binder_erase_free_buffer(proc, buffer);
 	buffer->free = 0;
 	binder_insert_allocated_buffer(proc, buffer);
 	if (buffer_size != size) {
@@ -799,6 +1343,7 @@ static struct binder_buffer *binder_alloc_buf(struct binder_proc *proc,
 		     "%p\n", proc->pid, size, buffer);
 	buffer->data_size = data_size;
 	buffer->offsets_size = offsets_size;
+	buffer->extra_buffers_size = extra_buffers_size;
 	buffer->async_transaction = is_async;
 	if (is_async) {
 		proc->free_async_space -= size + sizeof(struct binder_buffer);
@@ -876,7 +1421,8 @@ static void binder_free_buf(struct binder_proc *proc,
 	buffer_size = binder_buffer_size(proc, buffer);
 
 	size = ALIGN(buffer->data_size, sizeof(void *)) +
-		ALIGN(buffer->offsets_size, sizeof(void *));
+		ALIGN(buffer->offsets_size, sizeof(void *)) +
+		ALIGN(buffer->extra_buffers_size, sizeof(void *));
 
 	binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
 		     "binder: %d: binder_free_buf %p size %zd buffer"
@@ -907,7 +1453,7 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *next = list_entry(buffer->entry.next,
 						struct binder_buffer, entry);
 		if (next->free) {
-			rb_erase(&next->rb_node, &proc->free_buffers);
+			binder_erase_free_buffer(proc, next);
 			binder_delete_free_buffer(proc, next);
 		}
 	}
@@ -915,14 +1461,49 @@ static void binder_free_buf(struct binder_proc *proc,
 		struct binder_buffer *prev = list_entry(buffer->entry.prev,
 						struct binder_buffer, entry);
 		if (prev->free) {
+			binder_erase_free_buffer(proc, prev);
 			binder_delete_free_buffer(proc, buffer);
-			rb_erase(&prev->rb_node, &proc->free_buffers);
 			buffer = prev;
 		}
 	}
 	binder_insert_free_buffer(proc, buffer);
 }
 
+/*
+ * Threads blocked waiting for process work sleep on their own wait queue
+ * and sit on proc->waiting_threads, most recently idle first.  Waking the
+ * proc wakes exactly one of them; proc->wait is only used by poll.
+ */
+static struct binder_thread *binder_select_thread(struct binder_proc *proc)
+{
+	struct binder_thread *thread;
+
+	if (list_empty(&proc->waiting_threads))
+		return NULL;
+	thread = list_first_entry(&proc->waiting_threads,
+				  struct binder_thread, waiting_thread_node);
+	list_del_init(&thread->waiting_thread_node);
+	return thread;
+}
+
+static void binder_wakeup_thread(struct binder_thread *thread, bool sync)
+{
+	if (sync)
+		wake_up_interruptible_sync(&thread->wait);
+	else
+		wake_up_interruptible(&thread->wait);
+}
+
+static void binder_wakeup_proc(struct binder_proc *proc, bool sync)
+{
+	struct binder_thread *thread = binder_select_thread(proc);
+
+	if (thread)
+		binder_wakeup_thread(thread, sync);
+	if (waitqueue_active(&proc->wait))
+		wake_up_interruptible(&proc->wait);
+}
+
 static struct binder_node *binder_get_node(struct binder_proc *proc,
 					   void __user *ptr)
 {
@@ -968,7 +1549,7 @@ static struct binder_node *binder_new_node(struct binder_proc *proc,
 	binder_stats_created(BINDER_STAT_NODE);
 	rb_link_node(&node->rb_node, parent, p);
 	rb_insert_color(&node->rb_node, &proc->nodes);
-	node->debug_id = ++binder_last_id;
+	node->debug_id = atomic_inc_return(&binder_last_id);
 	node->proc = proc;
 	node->ptr = ptr;
 	node->cookie = cookie;
@@ -1035,7 +1616,7 @@ static int binder_dec_node(struct binder_node *node, int strong, int internal)
 	if (node->proc && (node->has_strong_ref || node->has_weak_ref)) {
 		if (list_empty(&node->work.entry)) {
 			list_add_tail(&node->work.entry, &node->proc->todo);
-			wake_up_interruptible(&node->proc->wait);
+			binder_wakeup_proc(node->proc, false);
 		}
 	} else {
 		if (hlist_empty(&node->refs) && !node->local_strong_refs &&
@@ -1103,7 +1684,7 @@ static struct binder_ref *binder_get_ref_for_node(struct binder_proc *proc,
 	if (new_ref == NULL)
 		return NULL;
 	binder_stats_created(BINDER_STAT_REF);
-	new_ref->debug_id = ++binder_last_id;
+	new_ref->debug_id = atomic_inc_return(&binder_last_id);
 	new_ref->proc = proc;
 	new_ref->node = node;
 	rb_link_node(&new_ref->rb_node_node, parent, p);
@@ -1228,6 +1809,30 @@ static int binder_dec_ref(struct binder_ref *ref, int strong)
 	return 0;
 }
 
+static int binder_latency_band(struct binder_priority p)
+{
+	if (binder_is_rt_policy(p.sched_policy))
+		return BINDER_LATENCY_BAND_RT;
+	if (p.prio < 0)
+		return BINDER_LATENCY_BAND_HIGH;
+	if (p.prio == 0)
+		return BINDER_LATENCY_BAND_NORMAL;
+	return BINDER_LATENCY_BAND_BACKGROUND;
+}
+
+static void binder_account_latency(struct binder_proc *proc,
+				   struct binder_transaction *t)
+{
+	u64 latency_ns = ktime_to_ns(ktime_sub(ktime_get(), t->start_time));
+	u64 usecs = latency_ns;
+	int bucket;
+
+	do_div(usecs, NSEC_PER_USEC);
+	bucket = min_t(int, fls64(usecs), BINDER_LATENCY_BUCKETS - 1);
+	proc->latency[t->latency_band][bucket]++;
+	trace_binder_transaction_reply(proc, t, latency_ns);
+}
+
 static void binder_pop_transaction(struct binder_thread *target_thread,
 				   struct binder_transaction *t)
 {
@@ -1300,6 +1905,43 @@ static void binder_send_failed_reply(struct binder_transaction *t,
 	}
 }
 
+/*
+ * Returns the size of the object at offset in the data of buffer, or 0 if
+ * the offset is misaligned, the type is unknown or the object does not fit
+ * in the data.
+ */
+static size_t binder_validate_object(struct binder_buffer *buffer,
+				     size_t offset)
+{
+	unsigned long type;
+	size_t object_size;
+
+	if (buffer->data_size < sizeof(type) ||
+	    offset > buffer->data_size - sizeof(type) ||
+	    !IS_ALIGNED(offset, sizeof(void *)))
+		return 0;
+
+	type = *(unsigned long *)(buffer->data + offset);
+	switch (type) {
+	case BINDER_TYPE_BINDER:
+	case BINDER_TYPE_WEAK_BINDER:
+	case BINDER_TYPE_HANDLE:
+	case BINDER_TYPE_WEAK_HANDLE:
+	case BINDER_TYPE_FD:
+		object_size = sizeof(struct flat_binder_object);
+		break;
+	case BINDER_TYPE_PTR:
+		object_size = sizeof(struct binder_buffer_object);
+		break;
+	default:
+		return 0;
+	}
+	if (offset > buffer->data_size - object_size ||
+	    buffer->data_size < object_size)
+		return 0;
+	return object_size;
+}
+
 static void binder_transaction_buffer_release(struct binder_proc *proc,
 					      struct binder_buffer *buffer,
 					      size_t *failed_at)
@@ -1322,9 +1964,7 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 		off_end = (void *)offp + buffer->offsets_size;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
-		if (*offp > buffer->data_size - sizeof(*fp) ||
-		    buffer->data_size < sizeof(*fp) ||
-		    !IS_ALIGNED(*offp, sizeof(void *))) {
+		if (!binder_validate_object(buffer, *offp)) {
 			printk(KERN_ERR "binder: transaction release %d bad"
 					"offset %zd, size %zd\n", debug_id,
 					*offp, buffer->data_size);
@@ -1367,6 +2007,13 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 				task_close_fd(proc, fp->handle);
 			break;
 
+		case BINDER_TYPE_PTR:
+			/*
+			 * Nothing to do here, the buffer was copied into this
+			 * transaction buffer and goes away with it.
+			 */
+			break;
+
 		default:
 			printk(KERN_ERR "binder: transaction release %d bad "
 			       "object type %lx\n", debug_id, fp->type);
@@ -1375,23 +2022,73 @@ static void binder_transaction_buffer_release(struct binder_proc *proc,
 	}
 }
 
-static void binder_transaction(struct binder_proc *proc,
-			       struct binder_thread *thread,
-			       struct binder_transaction_data *tr, int reply)
+/*
+ * Lock the owners of all nodes that the objects in buffer reference by
+ * handle of proc.  Only reads the buffer, so the caller can back out if
+ * this returns -EAGAIN.
+ */
+static int binder_lock_buffer_nodes(struct binder_locks *locks,
+				    struct binder_proc *proc,
+				    struct binder_buffer *buffer)
+{
+	size_t *offp, *off_end;
+	int ret;
+
+	if (locks->exclusive)
+		return 0;
+
+	offp = (size_t *)(buffer->data + ALIGN(buffer->data_size, sizeof(void *)));
+	off_end = (void *)offp + buffer->offsets_size;
+	for (; offp < off_end; offp++) {
+		struct flat_binder_object *fp;
+		struct binder_ref *ref;
+
+		if (!binder_validate_object(buffer, *offp))
+			continue;
+		fp = (struct flat_binder_object *)(buffer->data + *offp);
+		if (fp->type != BINDER_TYPE_HANDLE &&
+		    fp->type != BINDER_TYPE_WEAK_HANDLE)
+			continue;
+		ref = binder_get_ref(proc, fp->handle);
+		if (ref == NULL)
+			continue;
+		if (ref->node->proc == NULL)
+			return binder_need_exclusive(locks);
+		ret = binder_lock_proc(locks, ref->node->proc);
+		if (ret)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Returns -EAGAIN if the locks needed for the transaction could not be
+ * taken, in which case nothing has been changed and the command must be
+ * retried after binder_relock().  Other failures are reported through
+ * thread->return_error.
+ */
+static int binder_transaction(struct binder_proc *proc,
+			      struct binder_thread *thread,
+			      struct binder_transaction_data *tr, int reply,
+			      size_t extra_buffers_size,
+			      struct binder_locks *locks)
 {
 	struct binder_transaction *t;
 	struct binder_work *tcomplete;
-	size_t *offp, *off_end;
+	size_t *offp, *off_start, *off_end;
+	uint8_t *sg_buf_start, *sg_bufp, *sg_buf_end;
 	struct binder_proc *target_proc;
 	struct binder_thread *target_thread = NULL;
 	struct binder_node *target_node = NULL;
 	struct list_head *target_list;
 	wait_queue_head_t *target_wait;
 	struct binder_transaction *in_reply_to = NULL;
-	struct binder_transaction_log_entry *e;
+	struct binder_priority reply_priority;
+	struct binder_transaction_log_entry log_entry, *e = &log_entry;
 	uint32_t return_error;
+	int ret = 0;
 
-	e = binder_transaction_log_add(&binder_transaction_log);
+	memset(e, 0, sizeof(*e));
 	e->call_type = reply ? 2 : !!(tr->flags & TF_ONE_WAY);
 	e->from_proc = proc->pid;
 	e->from_thread = thread->pid;
@@ -1408,7 +2105,9 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_FAILED_REPLY;
 			goto err_empty_call_stack;
 		}
-		binder_set_nice(in_reply_to->saved_priority);
+		/* restored if the transaction has to back out with -EAGAIN */
+		reply_priority = binder_get_priority(current);
+		binder_set_priority(in_reply_to->saved_priority, true);
 		if (in_reply_to->to_thread != thread) {
 			binder_user_error("binder: %d:%d got reply transaction "
 				"with bad transaction stack,"
@@ -1422,8 +2121,20 @@ static void binder_transaction(struct binder_proc *proc,
 			in_reply_to = NULL;
 			goto err_bad_call_stack;
 		}
-		thread->transaction_stack = in_reply_to->to_parent;
 		target_thread = in_reply_to->from;
+		/*
+		 * Failing a reply to a dead thread walks the transaction
+		 * stack through any number of procs.
+		 */
+		if (target_thread == NULL)
+			ret = binder_need_exclusive(locks);
+		else
+			ret = binder_lock_proc(locks, target_thread->proc);
+		if (ret) {
+			binder_set_priority(reply_priority, true);
+			return ret;
+		}
+		thread->transaction_stack = in_reply_to->to_parent;
 		if (target_thread == NULL) {
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
@@ -1467,6 +2178,9 @@ static void binder_transaction(struct binder_proc *proc,
 			return_error = BR_DEAD_REPLY;
 			goto err_dead_binder;
 		}
+		ret = binder_lock_proc(locks, target_proc);
+		if (ret)
+			return ret;
 		if (!(tr->flags & TF_ONE_WAY) && thread->transaction_stack) {
 			struct binder_transaction *tmp;
 			tmp = thread->transaction_stack;
@@ -1513,7 +2227,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	binder_stats_created(BINDER_STAT_TRANSACTION_COMPLETE);
 
-	t->debug_id = ++binder_last_id;
+	t->debug_id = atomic_inc_return(&binder_last_id);
 	e->debug_id = t->debug_id;
 
 	if (reply)
@@ -1542,9 +2256,13 @@ static void binder_transaction(struct binder_proc *proc,
 	t->to_thread = target_thread;
 	t->code = tr->code;
 	t->flags = tr->flags;
-	t->priority = task_nice(current);
+	t->priority = binder_get_priority(current);
+	t->start_time = ktime_get();
+	t->latency_band = binder_latency_band(t->priority);
+	trace_binder_transaction(reply, t, target_node);
 	t->buffer = binder_alloc_buf(target_proc, tr->data_size,
-		tr->offsets_size, !reply && (t->flags & TF_ONE_WAY));
+		tr->offsets_size, extra_buffers_size,
+		!reply && (t->flags & TF_ONE_WAY));
 	if (t->buffer == NULL) {
 		return_error = BR_FAILED_REPLY;
 		goto err_binder_alloc_buf_failed;
@@ -1553,10 +2271,13 @@ static void binder_transaction(struct binder_proc *proc,
 	t->buffer->debug_id = t->debug_id;
 	t->buffer->transaction = t;
 	t->buffer->target_node = target_node;
+	trace_binder_transaction_alloc_buf(t->buffer);
 	if (target_node)
 		binder_inc_node(target_node, 1, 0, NULL);
 
-	offp = (size_t *)(t->buffer->data + ALIGN(tr->data_size, sizeof(void *)));
+	off_start = (size_t *)(t->buffer->data +
+			       ALIGN(tr->data_size, sizeof(void *)));
+	offp = off_start;
 
 	if (copy_from_user(t->buffer->data, tr->data.ptr.buffer, tr->data_size)) {
 		binder_user_error("binder: %d:%d got transaction with invalid "
@@ -1577,12 +2298,25 @@ static void binder_transaction(struct binder_proc *proc,
 		return_error = BR_FAILED_REPLY;
 		goto err_bad_offset;
 	}
+	/* keeps every ALIGN()ed scatter-gather copy within the buffer */
+	if (!IS_ALIGNED(extra_buffers_size, sizeof(void *))) {
+		binder_user_error("binder: %d:%d got transaction with "
+			"unaligned buffers size, %zd\n",
+			proc->pid, thread->pid, extra_buffers_size);
+		return_error = BR_FAILED_REPLY;
+		goto err_bad_offset;
+	}
+	ret = binder_lock_buffer_nodes(locks, proc, t->buffer);
+	if (ret)
+		goto err_lock_buffer_nodes;
 	off_end = (void *)offp + tr->offsets_size;
+	sg_buf_start = (uint8_t *)off_start +
+		ALIGN(tr->offsets_size, sizeof(void *));
+	sg_bufp = sg_buf_start;
+	sg_buf_end = sg_buf_start + extra_buffers_size;
 	for (; offp < off_end; offp++) {
 		struct flat_binder_object *fp;
-		if (*offp > t->buffer->data_size - sizeof(*fp) ||
-		    t->buffer->data_size < sizeof(*fp) ||
-		    !IS_ALIGNED(*offp, sizeof(void *))) {
+		if (!binder_validate_object(t->buffer, *offp)) {
 			binder_user_error("binder: %d:%d got transaction with "
 				"invalid offset, %zd\n",
 				proc->pid, thread->pid, *offp);
@@ -1601,7 +2335,7 @@ static void binder_transaction(struct binder_proc *proc,
 					return_error = BR_FAILED_REPLY;
 					goto err_binder_new_node_failed;
 				}
-				node->min_priority = fp->flags & FLAT_BINDER_FLAG_PRIORITY_MASK;
+				node->min_priority = binder_node_min_priority(fp->flags);
 				node->accept_fds = !!(fp->flags & FLAT_BINDER_FLAG_ACCEPTS_FDS);
 			}
 			if (fp->cookie != node->cookie) {
@@ -1707,6 +2441,65 @@ static void binder_transaction(struct binder_proc *proc,
 			fp->handle = target_fd;
 		} break;
 
+		case BINDER_TYPE_PTR: {
+			struct binder_buffer_object *bp, *parent;
+			size_t buf_left = sg_buf_end - sg_bufp;
+			uint8_t *parent_buf;
+
+			bp = (struct binder_buffer_object *)fp;
+			if (bp->length > buf_left) {
+				binder_user_error("binder: %d:%d got transaction with too large buffer, %zd > %zd\n",
+					proc->pid, thread->pid, bp->length, buf_left);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_buffer_object;
+			}
+			if (copy_from_user(sg_bufp, bp->buffer, bp->length)) {
+				binder_user_error("binder: %d:%d got transaction with invalid buffer ptr\n",
+					proc->pid, thread->pid);
+				return_error = BR_FAILED_REPLY;
+				goto err_bad_buffer_object;
+			}
+			bp->buffer = sg_bufp + target_proc->user_buffer_offset;
+			sg_bufp += ALIGN(bp->length, sizeof(void *));
+
+			if (bp->flags & BINDER_BUFFER_FLAG_HAS_PARENT) {
+				/*
+				 * The parent must be a buffer object that was
+				 * already copied, so its pointer has been fixed
+				 * up and it lies within this transaction buffer.
+				 */
+				if (bp->parent >= offp - off_start ||
+				    binder_validate_object(t->buffer, off_start[bp->parent]) !=
+				    sizeof(*parent)) {
+					binder_user_error("binder: %d:%d got transaction with invalid parent, %zd\n",
+						proc->pid, thread->pid, bp->parent);
+					return_error = BR_FAILED_REPLY;
+					goto err_bad_buffer_object;
+				}
+				parent = (struct binder_buffer_object *)
+					(t->buffer->data + off_start[bp->parent]);
+				parent_buf = (uint8_t *)parent->buffer -
+					target_proc->user_buffer_offset;
+				if (parent->type != BINDER_TYPE_PTR ||
+				    parent_buf < sg_buf_start ||
+				    parent_buf > sg_bufp ||
+				    parent->length > sg_bufp - parent_buf ||
+				    parent->length < sizeof(void *) ||
+				    bp->parent_offset > parent->length - sizeof(void *) ||
+				    !IS_ALIGNED(bp->parent_offset, sizeof(void *))) {
+					binder_user_error("binder: %d:%d got transaction with invalid parent offset, %zd\n",
+						proc->pid, thread->pid, bp->parent_offset);
+					return_error = BR_FAILED_REPLY;
+					goto err_bad_buffer_object;
+				}
+				*(void **)(parent_buf + bp->parent_offset) =
+					bp->buffer;
+			}
+			binder_debug(BINDER_DEBUG_TRANSACTION,
+				     "        buffer %zd bytes -> %p\n",
+				     bp->length, bp->buffer);
+		} break;
+
 		default:
 			binder_user_error("binder: %d:%d got transactio"
 				"n with invalid object type, %lx\n",
@@ -1717,6 +2510,7 @@ static void binder_transaction(struct binder_proc *proc,
 	}
 	if (reply) {
 		BUG_ON(t->buffer->async_transaction != 0);
+		binder_account_latency(proc, in_reply_to);
 		binder_pop_transaction(target_thread, in_reply_to);
 	} else if (!(t->flags & TF_ONE_WAY)) {
 		BUG_ON(t->buffer->async_transaction != 0);
@@ -1732,13 +2526,30 @@ static void binder_transaction(struct binder_proc *proc,
 		} else
 			target_node->has_async_transaction = 1;
 	}
+	if (!target_thread && !(t->flags & TF_ONE_WAY) &&
+	    list_empty(&target_proc->todo)) {
+		/*
+		 * Hand a synchronous transaction straight to an idle thread
+		 * instead of queueing it on the proc, the caller is about to
+		 * block waiting for the reply.
+		 */
+		target_thread = binder_select_thread(target_proc);
+		if (target_thread) {
+			target_list = &target_thread->todo;
+			target_wait = &target_thread->wait;
+		}
+	}
 	t->work.type = BINDER_WORK_TRANSACTION;
 	list_add_tail(&t->work.entry, target_list);
 	tcomplete->type = BINDER_WORK_TRANSACTION_COMPLETE;
 	list_add_tail(&tcomplete->entry, &thread->todo);
-	if (target_wait)
-		wake_up_interruptible(target_wait);
-	return;
+	if (target_wait == &target_proc->wait)
+		binder_wakeup_proc(target_proc, !(t->flags & TF_ONE_WAY));
+	else if (target_wait)
+		binder_wakeup_thread(target_thread,
+				     reply || !(t->flags & TF_ONE_WAY));
+	binder_transaction_log_add(&binder_transaction_log, e);
+	return 0;
 
 err_get_unused_fd_failed:
 err_fget_failed:
@@ -1747,6 +2558,8 @@ err_binder_get_ref_for_node_failed:
 err_binder_get_ref_failed:
 err_binder_new_node_failed:
 err_bad_object_type:
+err_lock_buffer_nodes:
+err_bad_buffer_object:
 err_bad_offset:
 err_copy_data_failed:
 	binder_transaction_buffer_release(target_proc, t->buffer, offp);
@@ -1759,6 +2572,18 @@ err_alloc_tcomplete_failed:
 	kfree(t);
 	binder_stats_deleted(BINDER_STAT_TRANSACTION);
 err_alloc_t_failed:
+	if (ret) {
+		/*
+		 * Only binder_lock_buffer_nodes() gets here with -EAGAIN; undo
+		 * the reply bookkeeping so the retry finds the transaction
+		 * it replies to.
+		 */
+		if (reply) {
+			thread->transaction_stack = in_reply_to;
+			binder_set_priority(reply_priority, true);
+		}
+		return ret;
+	}
 err_bad_call_stack:
 err_empty_call_stack:
 err_dead_binder:
@@ -1769,11 +2594,8 @@ err_no_context_mgr_node:
 		     proc->pid, thread->pid, return_error,
 		     tr->data_size, tr->offsets_size);
 
-	{
-		struct binder_transaction_log_entry *fe;
-		fe = binder_transaction_log_add(&binder_transaction_log_failed);
-		*fe = *e;
-	}
+	binder_transaction_log_add(&binder_transaction_log, e);
+	binder_transaction_log_add(&binder_transaction_log_failed, e);
 
 	BUG_ON(thread->return_error != BR_OK);
 	if (in_reply_to) {
@@ -1781,24 +2603,26 @@ err_no_context_mgr_node:
 		binder_send_failed_reply(in_reply_to, return_error);
 	} else
 		thread->return_error = return_error;
+	return 0;
 }
 
+/*
+ * Returns -EAGAIN without consuming the current command if it needs
+ * locks that could not be taken, see binder_relock().
+ */
 int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
-			void __user *buffer, int size, signed long *consumed)
+			void __user *buffer, int size, signed long *consumed,
+			struct binder_locks *locks)
 {
 	uint32_t cmd;
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
+	int ret;
 
 	while (ptr < end && thread->return_error == BR_OK) {
 		if (get_user(cmd, (uint32_t __user *)ptr))
 			return -EFAULT;
 		ptr += sizeof(uint32_t);
-		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
-			binder_stats.bc[_IOC_NR(cmd)]++;
-			proc->stats.bc[_IOC_NR(cmd)]++;
-			thread->stats.bc[_IOC_NR(cmd)]++;
-		}
 		switch (cmd) {
 		case BC_INCREFS:
 		case BC_ACQUIRE:
@@ -1813,6 +2637,10 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			ptr += sizeof(uint32_t);
 			if (target == 0 && binder_context_mgr_node &&
 			    (cmd == BC_INCREFS || cmd == BC_ACQUIRE)) {
+				ret = binder_lock_proc(locks,
+					binder_context_mgr_node->proc);
+				if (ret)
+					return ret;
 				ref = binder_get_ref_for_node(proc,
 					       binder_context_mgr_node);
 				if (ref->desc != target) {
@@ -1831,6 +2659,12 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid, target);
 				break;
 			}
+			if (ref->node->proc == NULL)
+				ret = binder_need_exclusive(locks);
+			else
+				ret = binder_lock_proc(locks, ref->node->proc);
+			if (ret)
+				return ret;
 			switch (cmd) {
 			case BC_INCREFS:
 				debug_string = "IncRefs";
@@ -1947,6 +2781,9 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					proc->pid, thread->pid, data_ptr);
 				break;
 			}
+			ret = binder_lock_buffer_nodes(locks, proc, buffer);
+			if (ret)
+				return ret;
 			binder_debug(BINDER_DEBUG_FREE_BUFFER,
 				     "binder: %d:%d BC_FREE_BUFFER u%p found buffer %d for %s transaction\n",
 				     proc->pid, thread->pid, data_ptr, buffer->debug_id,
@@ -1975,7 +2812,26 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			if (copy_from_user(&tr, ptr, sizeof(tr)))
 				return -EFAULT;
 			ptr += sizeof(tr);
-			binder_transaction(proc, thread, &tr, cmd == BC_REPLY);
+			ret = binder_transaction(proc, thread, &tr,
+						 cmd == BC_REPLY, 0, locks);
+			if (ret)
+				return ret;
+			break;
+		}
+
+		case BC_TRANSACTION_SG:
+		case BC_REPLY_SG: {
+			struct binder_transaction_data_sg tr;
+
+			if (copy_from_user(&tr, ptr, sizeof(tr)))
+				return -EFAULT;
+			ptr += sizeof(tr);
+			ret = binder_transaction(proc, thread,
+						 &tr.transaction_data,
+						 cmd == BC_REPLY_SG,
+						 tr.buffers_size, locks);
+			if (ret)
+				return ret;
 			break;
 		}
 
@@ -2083,7 +2939,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						list_add_tail(&ref->death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&ref->death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc(proc, false);
 					}
 				}
 			} else {
@@ -2113,7 +2969,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 						list_add_tail(&death->work.entry, &thread->todo);
 					} else {
 						list_add_tail(&death->work.entry, &proc->todo);
-						wake_up_interruptible(&proc->wait);
+						binder_wakeup_proc(proc, false);
 					}
 				} else {
 					BUG_ON(death->work.type != BINDER_WORK_DEAD_BINDER);
@@ -2153,7 +3009,7 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 					list_add_tail(&death->work.entry, &thread->todo);
 				} else {
 					list_add_tail(&death->work.entry, &proc->todo);
-					wake_up_interruptible(&proc->wait);
+					binder_wakeup_proc(proc, false);
 				}
 			}
 		} break;
@@ -2163,6 +3019,11 @@ int binder_thread_write(struct binder_proc *proc, struct binder_thread *thread,
 			       proc->pid, thread->pid, cmd);
 			return -EINVAL;
 		}
+		if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.bc)) {
+			atomic_inc(&binder_stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&proc->stats.bc[_IOC_NR(cmd)]);
+			atomic_inc(&thread->stats.bc[_IOC_NR(cmd)]);
+		}
 		*consumed = ptr - buffer;
 	}
 	return 0;
@@ -2172,9 +3033,9 @@ void binder_stat_br(struct binder_proc *proc, struct binder_thread *thread,
 		    uint32_t cmd)
 {
 	if (_IOC_NR(cmd) < ARRAY_SIZE(binder_stats.br)) {
-		binder_stats.br[_IOC_NR(cmd)]++;
-		proc->stats.br[_IOC_NR(cmd)]++;
-		thread->stats.br[_IOC_NR(cmd)]++;
+		atomic_inc(&binder_stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&proc->stats.br[_IOC_NR(cmd)]);
+		atomic_inc(&thread->stats.br[_IOC_NR(cmd)]);
 	}
 }
 
@@ -2194,7 +3055,8 @@ static int binder_has_thread_work(struct binder_thread *thread)
 static int binder_thread_read(struct binder_proc *proc,
 			      struct binder_thread *thread,
 			      void  __user *buffer, int size,
-			      signed long *consumed, int non_block)
+			      signed long *consumed, int non_block,
+			      struct binder_locks *locks)
 {
 	void __user *ptr = buffer + *consumed;
 	void __user *end = buffer + size;
@@ -2230,9 +3092,13 @@ retry:
 
 
 	thread->looper |= BINDER_LOOPER_STATE_WAITING;
-	if (wait_for_proc_work)
+	if (wait_for_proc_work) {
 		proc->ready_threads++;
-	mutex_unlock(&binder_lock);
+		if (!non_block)
+			list_add(&thread->waiting_thread_node,
+				 &proc->waiting_threads);
+	}
+	binder_unlock(locks);
 	if (wait_for_proc_work) {
 		if (!(thread->looper & (BINDER_LOOPER_STATE_REGISTERED |
 					BINDER_LOOPER_STATE_ENTERED))) {
@@ -2243,12 +3109,12 @@ retry:
 			wait_event_interruptible(binder_user_error_wait,
 						 binder_stop_on_user_error < 2);
 		}
-		binder_set_nice(proc->default_priority);
+		binder_set_priority(proc->default_priority, true);
 		if (non_block) {
 			if (!binder_has_proc_work(proc, thread))
 				ret = -EAGAIN;
 		} else
-			ret = wait_event_interruptible_exclusive(proc->wait, binder_has_proc_work(proc, thread));
+			ret = wait_event_interruptible(thread->wait, binder_has_proc_work(proc, thread) || binder_has_thread_work(thread));
 	} else {
 		if (non_block) {
 			if (!binder_has_thread_work(thread))
@@ -2256,9 +3122,11 @@ retry:
 		} else
 			ret = wait_event_interruptible(thread->wait, binder_has_thread_work(thread));
 	}
-	mutex_lock(&binder_lock);
-	if (wait_for_proc_work)
+	binder_lock_shared(locks, proc);
+	if (wait_for_proc_work) {
 		proc->ready_threads--;
+		list_del_init(&thread->waiting_thread_node);
+	}
 	thread->looper &= ~BINDER_LOOPER_STATE_WAITING;
 
 	if (ret)
@@ -2406,13 +3274,16 @@ retry:
 			struct binder_node *target_node = t->buffer->target_node;
 			tr.target.ptr = target_node->ptr;
 			tr.cookie =  target_node->cookie;
-			t->saved_priority = task_nice(current);
-			if (t->priority < target_node->min_priority &&
-			    !(t->flags & TF_ONE_WAY))
-				binder_set_nice(t->priority);
+			t->saved_priority = binder_get_priority(current);
+			if (!(t->flags & TF_ONE_WAY) &&
+			    binder_priority_higher(t->priority,
+						   target_node->min_priority))
+				binder_set_priority(t->priority, true);
 			else if (!(t->flags & TF_ONE_WAY) ||
-				 t->saved_priority > target_node->min_priority)
-				binder_set_nice(target_node->min_priority);
+				 binder_priority_higher(target_node->min_priority,
+							t->saved_priority))
+				binder_set_priority(target_node->min_priority,
+						    false);
 			cmd = BR_TRANSACTION;
 		} else {
 			tr.target.ptr = NULL;
@@ -2447,6 +3318,7 @@ retry:
 		ptr += sizeof(tr);
 
 		binder_stat_br(proc, thread, cmd);
+		trace_binder_transaction_received(t);
 		binder_debug(BINDER_DEBUG_TRANSACTION,
 			     "binder: %d:%d %s %d %d:%d, cmd %d"
 			     "size %zd-%zd ptr %p-%p\n",
@@ -2541,6 +3413,7 @@ static struct binder_thread *binder_get_thread(struct binder_proc *proc)
 		thread->pid = current->pid;
 		init_waitqueue_head(&thread->wait);
 		INIT_LIST_HEAD(&thread->todo);
+		INIT_LIST_HEAD(&thread->waiting_thread_node);
 		rb_link_node(&thread->rb_node, parent, p);
 		rb_insert_color(&thread->rb_node, &proc->threads);
 		thread->looper |= BINDER_LOOPER_STATE_NEED_RETURN;
@@ -2558,6 +3431,7 @@ static int binder_free_thread(struct binder_proc *proc,
 	int active_transactions = 0;
 
 	rb_erase(&thread->rb_node, &proc->threads);
+	list_del_init(&thread->waiting_thread_node);
 	t = thread->transaction_stack;
 	if (t && t->to_thread == thread)
 		send_reply = t;
@@ -2596,14 +3470,16 @@ static unsigned int binder_poll(struct file *filp,
 {
 	struct binder_proc *proc = filp->private_data;
 	struct binder_thread *thread = NULL;
+	struct binder_locks locks;
 	int wait_for_proc_work;
 
-	mutex_lock(&binder_lock);
+	binder_lock_init(&locks);
+	binder_lock_shared(&locks, proc);
 	thread = binder_get_thread(proc);
 
 	wait_for_proc_work = thread->transaction_stack == NULL &&
 		list_empty(&thread->todo) && thread->return_error == BR_OK;
-	mutex_unlock(&binder_lock);
+	binder_unlock(&locks);
 
 	if (wait_for_proc_work) {
 		if (binder_has_proc_work(proc, thread))
@@ -2626,6 +3502,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	int ret;
 	struct binder_proc *proc = filp->private_data;
 	struct binder_thread *thread;
+	struct binder_locks locks;
 	unsigned int size = _IOC_SIZE(cmd);
 	void __user *ubuf = (void __user *)arg;
 
@@ -2635,7 +3512,11 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 	if (ret)
 		return ret;
 
-	mutex_lock(&binder_lock);
+	binder_lock_init(&locks);
+	if (cmd == BINDER_SET_CONTEXT_MGR || cmd == BINDER_THREAD_EXIT)
+		binder_lock_global(&locks, proc);
+	else
+		binder_lock_shared(&locks, proc);
 	thread = binder_get_thread(proc);
 	if (thread == NULL) {
 		ret = -ENOMEM;
@@ -2659,7 +3540,8 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			     bwr.read_size, bwr.read_buffer);
 
 		if (bwr.write_size > 0) {
-			ret = binder_thread_write(proc, thread, (void __user *)bwr.write_buffer, bwr.write_size, &bwr.write_consumed);
+			while ((ret = binder_thread_write(proc, thread, (void __user *)bwr.write_buffer, bwr.write_size, &bwr.write_consumed, &locks)) == -EAGAIN)
+				binder_relock(&locks, proc);
 			if (ret < 0) {
 				bwr.read_consumed = 0;
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
@@ -2668,9 +3550,9 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 			}
 		}
 		if (bwr.read_size > 0) {
-			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK);
+			ret = binder_thread_read(proc, thread, (void __user *)bwr.read_buffer, bwr.read_size, &bwr.read_consumed, filp->f_flags & O_NONBLOCK, &locks);
 			if (!list_empty(&proc->todo))
-				wake_up_interruptible(&proc->wait);
+				binder_wakeup_proc(proc, false);
 			if (ret < 0) {
 				if (copy_to_user(ubuf, &bwr, sizeof(bwr)))
 					ret = -EFAULT;
@@ -2744,7 +3626,7 @@ static long binder_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 err:
 	if (thread)
 		thread->looper &= ~BINDER_LOOPER_STATE_NEED_RETURN;
-	mutex_unlock(&binder_lock);
+	binder_unlock(&locks);
 	wait_event_interruptible(binder_user_error_wait, binder_stop_on_user_error < 2);
 	if (ret && ret != -ERESTARTSYS)
 		printk(KERN_INFO "binder: %d:%d ioctl %x %lx returned %d\n", proc->pid, current->pid, cmd, arg, ret);
@@ -2786,6 +3668,7 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	struct binder_proc *proc = filp->private_data;
 	const char *failure_string;
 	struct binder_buffer *buffer;
+	int i;
 
 	if ((vma->vm_end - vma->vm_start) > SZ_4M)
 		vma->vm_end = vma->vm_start + SZ_4M;
@@ -2833,6 +3716,10 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 		goto err_alloc_pages_failed;
 	}
 	proc->buffer_size = vma->vm_end - vma->vm_start;
+	for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
+		INIT_LIST_HEAD(&proc->pages[i].lru);
+		proc->pages[i].proc = proc;
+	}
 
 	vma->vm_ops = &binder_vm_ops;
 	vma->vm_private_data = proc;
@@ -2844,6 +3731,8 @@ static int binder_mmap(struct file *filp, struct vm_area_struct *vma)
 	}
 	buffer = proc->buffer;
 	INIT_LIST_HEAD(&proc->buffers);
+	for (i = 0; i < BINDER_FREE_CLASSES; i++)
+		INIT_LIST_HEAD(&proc->free_buffers[i]);
 	list_add(&buffer->entry, &proc->buffers);
 	buffer->free = 1;
 	binder_insert_free_buffer(proc, buffer);
@@ -2882,16 +3771,18 @@ static int binder_open(struct inode *nodp, struct file *filp)
 		return -ENOMEM;
 	get_task_struct(current);
 	proc->tsk = current;
+	mutex_init(&proc->lock);
 	INIT_LIST_HEAD(&proc->todo);
 	init_waitqueue_head(&proc->wait);
-	proc->default_priority = task_nice(current);
-	mutex_lock(&binder_lock);
+	INIT_LIST_HEAD(&proc->waiting_threads);
+	proc->default_priority = binder_get_priority(current);
+	down_write(&binder_lock);
 	binder_stats_created(BINDER_STAT_PROC);
 	hlist_add_head(&proc->proc_node, &binder_procs);
 	proc->pid = current->group_leader->pid;
 	INIT_LIST_HEAD(&proc->delivered_death);
 	filp->private_data = proc;
-	mutex_unlock(&binder_lock);
+	up_write(&binder_lock);
 
 	if (binder_debugfs_dir_entry_proc) {
 		char strbuf[11];
@@ -2992,7 +3883,7 @@ static void binder_deferred_release(struct binder_proc *proc)
 					if (list_empty(&ref->death->work.entry)) {
 						ref->death->work.type = BINDER_WORK_DEAD_BINDER;
 						list_add_tail(&ref->death->work.entry, &ref->proc->todo);
-						wake_up_interruptible(&ref->proc->wait);
+						binder_wakeup_proc(ref->proc, false);
 					} else
 						BUG();
 				}
@@ -3035,16 +3926,26 @@ static void binder_deferred_release(struct binder_proc *proc)
 	if (proc->pages) {
 		int i;
 		for (i = 0; i < proc->buffer_size / PAGE_SIZE; i++) {
-			if (proc->pages[i]) {
+			struct binder_lru_page *page = &proc->pages[i];
+
+			if (page->page_ptr) {
 				void *page_addr = proc->buffer + i * PAGE_SIZE;
-				binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
-					     "binder_release: %d: "
-					     "page %d at %p not freed\n",
-					     proc->pid, i,
-					     page_addr);
+
+				spin_lock(&binder_page_lru_lock);
+				if (list_empty(&page->lru))
+					binder_debug(BINDER_DEBUG_BUFFER_ALLOC,
+						     "binder_release: %d: "
+						     "page %d at %p not freed\n",
+						     proc->pid, i, page_addr);
+				else {
+					list_del_init(&page->lru);
+					binder_page_lru_count--;
+				}
+				spin_unlock(&binder_page_lru_lock);
 				unmap_kernel_range((unsigned long)page_addr,
 					PAGE_SIZE);
-				__free_page(proc->pages[i]);
+				__free_page(page->page_ptr);
+				page->page_ptr = NULL;
 				page_count++;
 			}
 		}
@@ -3071,7 +3972,7 @@ static void binder_deferred_func(struct work_struct *work)
 
 	int defer;
 	do {
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 		mutex_lock(&binder_deferred_lock);
 		if (!hlist_empty(&binder_deferred_list)) {
 			proc = hlist_entry(binder_deferred_list.first,
@@ -3098,7 +3999,7 @@ static void binder_deferred_func(struct work_struct *work)
 		if (defer & BINDER_DEFERRED_RELEASE)
 			binder_deferred_release(proc); /* frees proc */
 
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 		if (files)
 			put_files_struct(files);
 	} while (proc);
@@ -3122,13 +4023,14 @@ static void print_binder_transaction(struct seq_file *m, const char *prefix,
 				     struct binder_transaction *t)
 {
 	seq_printf(m,
-		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %ld r%d",
+		   "%s %d: %p from %d:%d to %d:%d code %x flags %x pri %d:%d r%d",
 		   prefix, t->debug_id, t,
 		   t->from ? t->from->proc->pid : 0,
 		   t->from ? t->from->pid : 0,
 		   t->to_proc ? t->to_proc->pid : 0,
 		   t->to_thread ? t->to_thread->pid : 0,
-		   t->code, t->flags, t->priority, t->need_reply);
+		   t->code, t->flags, t->priority.sched_policy,
+		   t->priority.prio, t->need_reply);
 	if (t->buffer == NULL) {
 		seq_puts(m, " buffer free\n");
 		return;
@@ -3330,7 +4232,9 @@ static const char *binder_command_strings[] = {
 	"BC_EXIT_LOOPER",
 	"BC_REQUEST_DEATH_NOTIFICATION",
 	"BC_CLEAR_DEATH_NOTIFICATION",
-	"BC_DEAD_BINDER_DONE"
+	"BC_DEAD_BINDER_DONE",
+	"BC_TRANSACTION_SG",
+	"BC_REPLY_SG"
 };
 
 static const char *binder_objstat_strings[] = {
@@ -3343,6 +4247,14 @@ static const char *binder_objstat_strings[] = {
 	"transaction_complete"
 };
 
+static const char *binder_lockstat_strings[] = {
+	"global shared",
+	"global exclusive",
+	"proc",
+	"proc retry",
+	"exclusive fallback"
+};
+
 static void print_binder_stats(struct seq_file *m, const char *prefix,
 			       struct binder_stats *stats)
 {
@@ -3351,17 +4263,21 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->bc) !=
 		     ARRAY_SIZE(binder_command_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->bc); i++) {
-		if (stats->bc[i])
+		int temp = atomic_read(&stats->bc[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_command_strings[i], stats->bc[i]);
+				   binder_command_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->br) !=
 		     ARRAY_SIZE(binder_return_strings));
 	for (i = 0; i < ARRAY_SIZE(stats->br); i++) {
-		if (stats->br[i])
+		int temp = atomic_read(&stats->br[i]);
+
+		if (temp)
 			seq_printf(m, "%s%s: %d\n", prefix,
-				   binder_return_strings[i], stats->br[i]);
+				   binder_return_strings[i], temp);
 	}
 
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
@@ -3369,11 +4285,23 @@ static void print_binder_stats(struct seq_file *m, const char *prefix,
 	BUILD_BUG_ON(ARRAY_SIZE(stats->obj_created) !=
 		     ARRAY_SIZE(stats->obj_deleted));
 	for (i = 0; i < ARRAY_SIZE(stats->obj_created); i++) {
-		if (stats->obj_created[i] || stats->obj_deleted[i])
+		int created = atomic_read(&stats->obj_created[i]);
+		int deleted = atomic_read(&stats->obj_deleted[i]);
+
+		if (created || deleted)
 			seq_printf(m, "%s%s: active %d total %d\n", prefix,
 				binder_objstat_strings[i],
-				stats->obj_created[i] - stats->obj_deleted[i],
-				stats->obj_created[i]);
+				created - deleted, created);
+	}
+
+	BUILD_BUG_ON(ARRAY_SIZE(stats->lock_contended) !=
+		     ARRAY_SIZE(binder_lockstat_strings));
+	for (i = 0; i < ARRAY_SIZE(stats->lock_contended); i++) {
+		int temp = atomic_read(&stats->lock_contended[i]);
+
+		if (temp)
+			seq_printf(m, "%slock contended %s: %d\n", prefix,
+				   binder_lockstat_strings[i], temp);
 	}
 }
 
@@ -3439,7 +4367,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder state:\n");
 
@@ -3451,7 +4379,7 @@ static int binder_state_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3462,7 +4390,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder stats:\n");
 
@@ -3471,7 +4399,7 @@ static int binder_stats_show(struct seq_file *m, void *unused)
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc_stats(m, proc);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3482,13 +4410,13 @@ static int binder_transactions_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 
 	seq_puts(m, "binder transactions:\n");
 	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
 		print_binder_proc(m, proc, 0);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3498,11 +4426,11 @@ static int binder_proc_show(struct seq_file *m, void *unused)
 	int do_lock = !binder_debug_no_lock;
 
 	if (do_lock)
-		mutex_lock(&binder_lock);
+		down_write(&binder_lock);
 	seq_puts(m, "binder proc state:\n");
 	print_binder_proc(m, proc, 1);
 	if (do_lock)
-		mutex_unlock(&binder_lock);
+		up_write(&binder_lock);
 	return 0;
 }
 
@@ -3517,6 +4445,62 @@ static void print_binder_transaction_log_entry(struct seq_file *m,
 		   e->target_handle, e->data_size, e->offsets_size);
 }
 
+static const char *binder_latency_band_strings[] = {
+	"rt",
+	"high",
+	"normal",
+	"background"
+};
+
+static void print_binder_proc_latency(struct seq_file *m,
+				      struct binder_proc *proc)
+{
+	int band, i, header = 0;
+
+	for (band = 0; band < BINDER_LATENCY_BAND_COUNT; band++) {
+		unsigned long *hist = proc->latency[band];
+
+		for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+			if (hist[i])
+				break;
+		if (i == BINDER_LATENCY_BUCKETS)
+			continue;
+		if (!header) {
+			seq_printf(m, "proc %d\n", proc->pid);
+			header = 1;
+		}
+		seq_printf(m, "  %-10s", binder_latency_band_strings[band]);
+		for (i = 0; i < BINDER_LATENCY_BUCKETS; i++)
+			seq_printf(m, " %7lu", hist[i]);
+		seq_puts(m, "\n");
+	}
+}
+
+static int binder_latency_show(struct seq_file *m, void *unused)
+{
+	struct binder_proc *proc;
+	struct hlist_node *pos;
+	int do_lock = !binder_debug_no_lock;
+	int i;
+
+	BUILD_BUG_ON(ARRAY_SIZE(binder_latency_band_strings) !=
+		     BINDER_LATENCY_BAND_COUNT);
+
+	if (do_lock)
+		down_write(&binder_lock);
+
+	seq_printf(m, "binder reply latency (us):\n  %-10s", "");
+	for (i = 0; i < BINDER_LATENCY_BUCKETS - 1; i++)
+		seq_printf(m, " %7lu", 1UL << i);
+	seq_printf(m, " %7s\n", "more");
+
+	hlist_for_each_entry(proc, pos, &binder_procs, proc_node)
+		print_binder_proc_latency(m, proc);
+	if (do_lock)
+		up_write(&binder_lock);
+	return 0;
+}
+
 static int binder_transaction_log_show(struct seq_file *m, void *unused)
 {
 	struct binder_transaction_log *log = m->private;
@@ -3551,6 +4535,7 @@ BINDER_DEBUG_ENTRY(state);
 BINDER_DEBUG_ENTRY(stats);
 BINDER_DEBUG_ENTRY(transactions);
 BINDER_DEBUG_ENTRY(transaction_log);
+BINDER_DEBUG_ENTRY(latency);
 
 static int __init binder_init(void)
 {
@@ -3565,6 +4550,8 @@ static int __init binder_init(void)
 		binder_debugfs_dir_entry_proc = debugfs_create_dir("proc",
 						 binder_debugfs_dir_entry_root);
 	ret = misc_register(&binder_miscdev);
+	if (!ret)
+		register_shrinker(&binder_shrinker);
 	if (binder_debugfs_dir_entry_root) {
 		debugfs_create_file("state",
 				    S_IRUGO,
@@ -3591,10 +4578,18 @@ static int __init binder_init(void)
 				    binder_debugfs_dir_entry_root,
 				    &binder_transaction_log_failed,
 				    &binder_transaction_log_fops);
+		debugfs_create_file("latency",
+				    S_IRUGO,
+				    binder_debugfs_dir_entry_root,
+				    NULL,
+				    &binder_latency_fops);
 	}
 	return ret;
 }
 
 device_initcall(binder_init);
 
+#define CREATE_TRACE_POINTS
+#include "binder_trace.h"
+
 MODULE_LICENSE("GPL v2");
@@ -32,11 +32,21 @@ enum {
 	BINDER_TYPE_HANDLE	= B_PACK_CHARS('s', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_WEAK_HANDLE	= B_PACK_CHARS('w', 'h', '*', B_TYPE_LARGE),
 	BINDER_TYPE_FD		= B_PACK_CHARS('f', 'd', '*', B_TYPE_LARGE),
+	BINDER_TYPE_PTR		= B_PACK_CHARS('p', 't', '*', B_TYPE_LARGE),
 };
 
+/*
+ * The low byte of the flags of a BINDER_TYPE_BINDER object is the minimum
+ * priority that threads handling transactions on the node run at: a nice
+ * value (as a signed char) for SCHED_NORMAL and SCHED_BATCH, or an rt
+ * priority for SCHED_FIFO and SCHED_RR.  The scheduling policy is stored
+ * in FLAT_BINDER_FLAG_SCHED_POLICY_MASK and uses the SCHED_* numbering.
+ */
 enum {
 	FLAT_BINDER_FLAG_PRIORITY_MASK = 0xff,
 	FLAT_BINDER_FLAG_ACCEPTS_FDS = 0x100,
+	FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT = 9,
+	FLAT_BINDER_FLAG_SCHED_POLICY_MASK = 3U << FLAT_BINDER_FLAG_SCHED_POLICY_SHIFT,
 };
 
 /*
@@ -61,6 +71,29 @@ struct flat_binder_object {
 	void			*cookie;
 };
 
+enum {
+	BINDER_BUFFER_FLAG_HAS_PARENT = 0x01,
+};
+
+/*
+ * A buffer object describes an additional user buffer that is sent along
+ * with a transaction sent through BC_TRANSACTION_SG or BC_REPLY_SG.  The
+ * driver copies the buffer straight from the sender into the target's
+ * transaction buffer, behind the offsets array, and rewrites 'buffer' to
+ * point at the copy.  If BINDER_BUFFER_FLAG_HAS_PARENT is set, 'parent' is
+ * the index in the offsets array of an earlier buffer object, and the
+ * pointer at 'parent_offset' in that buffer is rewritten as well, so
+ * embedded pointers stay valid in the target without a second copy.
+ */
+struct binder_buffer_object {
+	unsigned long		type;
+	unsigned long		flags;
+	void			*buffer;
+	size_t			length;
+	size_t			parent;
+	size_t			parent_offset;
+};
+
 /*
  * On 64-bit platforms where user code may run in 32-bits the driver must
  * translate the buffer (and local binder) addresses apropriately.
@@ -147,6 +180,12 @@ struct binder_transaction_data {
 	} data;
 };
 
+struct binder_transaction_data_sg {
+	struct binder_transaction_data transaction_data;
+	/* total size of the buffers sent as BINDER_TYPE_PTR objects */
+	size_t		buffers_size;
+};
+
 struct binder_ptr_cookie {
 	void *ptr;
 	void *cookie;
@@ -324,6 +363,13 @@ enum BinderDriverCommandProtocol {
 	/*
 	 * void *: cookie
 	 */
+
+	BC_TRANSACTION_SG = _IOW('c', 17, struct binder_transaction_data_sg),
+	BC_REPLY_SG = _IOW('c', 18, struct binder_transaction_data_sg),
+	/*
+	 * binder_transaction_data_sg: the sent command, the data may contain
+	 * BINDER_TYPE_PTR objects.
+	 */
 };
 
 #endif /* _LINUX_BINDER_H */
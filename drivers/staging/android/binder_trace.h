@@ -0,0 +1,148 @@
+/* binder_trace.h
+ *
+ * Android IPC Subsystem
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM binder
+
+#if !defined(_BINDER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _BINDER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+struct binder_buffer;
+struct binder_node;
+struct binder_proc;
+struct binder_thread;
+struct binder_transaction;
+
+TRACE_EVENT(binder_lock_wait,
+	TP_PROTO(struct binder_proc *proc, int type, u64 wait_ns),
+	TP_ARGS(proc, type, wait_ns),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, type)
+		__field(u64, wait_ns)
+	),
+	TP_fast_assign(
+		__entry->proc = proc ? proc->pid : 0;
+		__entry->type = type;
+		__entry->wait_ns = wait_ns;
+	),
+	TP_printk("proc=%d lock=%s wait_ns=%llu",
+		  __entry->proc,
+		  __print_symbolic(__entry->type,
+			{ BINDER_LOCK_STAT_GLOBAL_SHARED, "global_shared" },
+			{ BINDER_LOCK_STAT_GLOBAL_EXCLUSIVE, "global_exclusive" },
+			{ BINDER_LOCK_STAT_PROC, "proc" }),
+		  (unsigned long long)__entry->wait_ns)
+);
+
+TRACE_EVENT(binder_transaction,
+	TP_PROTO(bool reply, struct binder_transaction *t,
+		 struct binder_node *target_node),
+	TP_ARGS(reply, t, target_node),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(int, target_node)
+		__field(int, to_proc)
+		__field(int, to_thread)
+		__field(int, reply)
+		__field(unsigned int, code)
+		__field(unsigned int, flags)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->target_node = target_node ? target_node->debug_id : 0;
+		__entry->to_proc = t->to_proc->pid;
+		__entry->to_thread = t->to_thread ? t->to_thread->pid : 0;
+		__entry->reply = reply;
+		__entry->code = t->code;
+		__entry->flags = t->flags;
+	),
+	TP_printk("transaction=%d dest_node=%d dest_proc=%d dest_thread=%d "
+		  "reply=%d flags=0x%x code=0x%x",
+		  __entry->debug_id, __entry->target_node,
+		  __entry->to_proc, __entry->to_thread,
+		  __entry->reply, __entry->flags, __entry->code)
+);
+
+TRACE_EVENT(binder_transaction_received,
+	TP_PROTO(struct binder_transaction *t),
+	TP_ARGS(t),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(u64, queued_ns)
+	),
+	TP_fast_assign(
+		__entry->debug_id = t->debug_id;
+		__entry->queued_ns =
+			ktime_to_ns(ktime_sub(ktime_get(), t->start_time));
+	),
+	TP_printk("transaction=%d queued_ns=%llu", __entry->debug_id,
+		  (unsigned long long)__entry->queued_ns)
+);
+
+TRACE_EVENT(binder_transaction_reply,
+	TP_PROTO(struct binder_proc *proc, struct binder_transaction *t,
+		 u64 latency_ns),
+	TP_ARGS(proc, t, latency_ns),
+	TP_STRUCT__entry(
+		__field(int, proc)
+		__field(int, debug_id)
+		__field(unsigned int, sched_policy)
+		__field(int, prio)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->proc = proc->pid;
+		__entry->debug_id = t->debug_id;
+		__entry->sched_policy = t->priority.sched_policy;
+		__entry->prio = t->priority.prio;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("proc=%d transaction=%d policy=%u prio=%d latency_ns=%llu",
+		  __entry->proc, __entry->debug_id, __entry->sched_policy,
+		  __entry->prio,
+		  (unsigned long long)__entry->latency_ns)
+);
+
+TRACE_EVENT(binder_transaction_alloc_buf,
+	TP_PROTO(struct binder_buffer *buf),
+	TP_ARGS(buf),
+	TP_STRUCT__entry(
+		__field(int, debug_id)
+		__field(size_t, data_size)
+		__field(size_t, offsets_size)
+		__field(size_t, extra_buffers_size)
+	),
+	TP_fast_assign(
+		__entry->debug_id = buf->debug_id;
+		__entry->data_size = buf->data_size;
+		__entry->offsets_size = buf->offsets_size;
+		__entry->extra_buffers_size = buf->extra_buffers_size;
+	),
+	TP_printk("transaction=%d data_size=%zd offsets_size=%zd "
+		  "extra_buffers_size=%zd",
+		  __entry->debug_id, __entry->data_size, __entry->offsets_size,
+		  __entry->extra_buffers_size)
+);
+
+#endif /* _BINDER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE binder_trace
+#include <trace/define_trace.h>
@@ -20,43 +20,109 @@
 #include <linux/sched.h>
 #include <linux/module.h>
 #include <linux/fs.h>
+#include <linux/device.h>
 #include <linux/miscdevice.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
 #include <linux/slab.h>
 #include <linux/time.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/lzo.h>
+#include <linux/hash.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
 #include "logger.h"
 
 #include <asm/ioctls.h>
 
+/* number of UIDs the rate limiter of each log keeps track of at a time */
+#define LOGGER_RATELIMIT_BITS	5
+#define LOGGER_RATELIMIT_SLOTS	(1 << LOGGER_RATELIMIT_BITS)
+/* number of slots a UID may live in, starting at the one it hashes to */
+#define LOGGER_RATELIMIT_PROBES	4
+
+/*
+ * struct logger_ratelimit - token bucket limiting the bytes a UID may write
+ * to a log. A UID gets a free slot among the LOGGER_RATELIMIT_PROBES it may
+ * live in, or takes one over whose bucket has refilled completely, i.e. whose
+ * owner has gone quiet. Failing that, it shares the log's overflow bucket
+ * with the other UIDs that found no slot, but never a bucket of another UID.
+ */
+struct logger_ratelimit {
+	uid_t			uid;	/* owner of the bucket */
+	int			used;	/* bucket is owned by 'uid' */
+	size_t			tokens;	/* bytes 'uid' may write right now */
+	unsigned long		stamp;	/* jiffies of the last refill */
+	unsigned long		dropped; /* entries of 'uid' dropped */
+};
+
 /*
  * struct logger_log - represents a specific log, such as 'main' or 'radio'
  *
  * This structure lives from module insertion until module removal, so it does
- * not need additional reference counting. The structure is protected by the
- * mutex 'mutex'.
+ * not need additional reference counting. The offsets, the list of readers
+ * and the list of writes in flight are protected by the spinlock 'lock'.
+ *
+ * Writers never take 'mutex'. A writer reserves room for its entry under
+ * 'lock', copies the entry into the reserved room without holding any lock
+ * and then commits it. Entries become visible to readers, in reservation
+ * order, once they and every entry reserved before them are committed.
+ *
+ * The buffer is resized with both 'mutex' and 'lock' held, once 'resizing'
+ * has drained the writes in flight and while the log is not mapped.
  */
 struct logger_log {
 	unsigned char 		*buffer;/* the ring buffer itself */
 	struct miscdevice	misc;	/* misc device representing the log */
 	wait_queue_head_t	wq;	/* wait queue for readers */
 	struct list_head	readers; /* this log's readers */
-	struct mutex		mutex;	/* mutex protecting buffer */
-	size_t			w_off;	/* current write head offset */
+	struct mutex		mutex;	/* mutex serializing readers */
+	spinlock_t		lock;	/* lock protecting offsets */
+	size_t			w_off;	/* end of the committed entries */
+	size_t			reserve_off; /* current write head offset */
+	struct list_head	writes;	/* writes in flight */
+	size_t			pending; /* bytes reserved by writes in flight */
+	wait_queue_head_t	commit_wq; /* writers waiting for room */
 	size_t			head;	/* new readers start here */
 	size_t			size;	/* size of the log */
+	struct logger_mmap_header *mmap_header; /* first page of mmap view */
+	atomic_t		mapped;	/* number of mmap views */
+	int			resizing; /* buffer is being replaced */
+	size_t			rl_rate; /* bytes per second, 0 to disable */
+	size_t			rl_burst; /* size of the token buckets */
+	unsigned long		dropped; /* entries dropped by rate limiting */
+	struct logger_ratelimit	rl[LOGGER_RATELIMIT_SLOTS];
+	struct logger_ratelimit	rl_overflow; /* UIDs without a slot */
 };
 
 /*
  * struct logger_reader - a logging device open for reading
  *
  * This object lives from open to release, so we don't need additional
- * reference counting. The structure is protected by log->mutex.
+ * reference counting. r_off is protected by log->lock, reads are
+ * serialized by log->mutex.
  */
 struct logger_reader {
 	struct logger_log	*log;	/* associated log */
 	struct list_head	list;	/* entry in logger_log's list */
 	size_t			r_off;	/* current read head offset */
+	int			mode;	/* LOGGER_READ_* */
+	unsigned char		*lzo_raw; /* entries to compress */
+	unsigned char		*lzo_out; /* compressed entries */
+	void			*lzo_wrk; /* lzo work memory */
+};
+
+/*
+ * struct logger_write - room reserved by a writer in the log
+ *
+ * Lives on the writer's stack from logger_reserve() to logger_commit().
+ */
+struct logger_write {
+	struct list_head	list;	/* entry in logger_log's writes */
+	size_t			off;	/* offset of the entry */
+	size_t			len;	/* length of the entry with header */
+	int			done;	/* entry is completely written */
 };
 
 /* logger_offset - returns index 'n' into the log via (optimized) modulus */
@@ -89,7 +155,7 @@ static inline struct logger_log *file_get_log(struct file *file)
  * get_entry_len - Grabs the length of the payload of the next entry starting
  * from 'off'.
  *
- * Caller needs to hold log->mutex.
+ * Caller needs to hold log->lock.
  */
 static __u32 get_entry_len(struct logger_log *log, size_t off)
 {
@@ -108,13 +174,49 @@ static __u32 get_entry_len(struct logger_log *log, size_t off)
 }
 
 /*
- * do_read_log_to_user - reads exactly 'count' bytes from 'log' into the
- * user-space buffer 'buf'. Returns 'count' on success.
+ * get_entry_skip - is the entry starting at 'off' one readers skip, because
+ * its writer faulted while copying the payload?
  *
- * Caller must hold log->mutex.
+ * Caller needs to hold log->lock.
  */
-static ssize_t do_read_log_to_user(struct logger_log *log,
-				   struct logger_reader *reader,
+static int get_entry_skip(struct logger_log *log, size_t off)
+{
+	__u16 val;
+
+	off = logger_offset(off + offsetof(struct logger_entry, __pad));
+	switch (log->size - off) {
+	case 1:
+		memcpy(&val, log->buffer + off, 1);
+		memcpy(((char *) &val) + 1, log->buffer, 1);
+		break;
+	default:
+		memcpy(&val, log->buffer + off, 2);
+	}
+
+	return val & LOGGER_ENTRY_SKIP;
+}
+
+/*
+ * skip_entries - move 'reader' past any entries readers skip
+ *
+ * Caller needs to hold log->lock.
+ */
+static void skip_entries(struct logger_log *log, struct logger_reader *reader)
+{
+	while (log->w_off != reader->r_off &&
+	       get_entry_skip(log, reader->r_off))
+		reader->r_off = logger_offset(reader->r_off +
+					      get_entry_len(log, reader->r_off));
+}
+
+/*
+ * do_read_log_to_user - reads exactly 'count' bytes from 'log' at 'off' into
+ * the user-space buffer 'buf'. Returns 'count' on success.
+ *
+ * Caller must hold log->mutex but not log->lock. A writer may have lapped the
+ * reader while we copied, so the caller has to check reader->r_off afterwards.
+ */
+static ssize_t do_read_log_to_user(struct logger_log *log, size_t off,
 				   char __user *buf,
 				   size_t count)
 {
@@ -125,8 +227,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 	 * the current read head offset up to 'count' bytes or to the end of
 	 * the log, whichever comes first.
 	 */
-	len = min(count, log->size - reader->r_off);
-	if (copy_to_user(buf, log->buffer + reader->r_off, len))
+	len = min(count, log->size - off);
+	if (copy_to_user(buf, log->buffer + off, len))
 		return -EFAULT;
 
 	/*
@@ -137,11 +239,139 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
 		if (copy_to_user(buf + len, log->buffer, count - len))
 			return -EFAULT;
 
-	reader->r_off = logger_offset(reader->r_off + count);
-
 	return count;
 }
 
+/*
+ * do_read_log - copies exactly 'count' bytes from 'log' at 'off' into 'buf'
+ *
+ * Same rules as for do_read_log_to_user().
+ */
+static void do_read_log(struct logger_log *log, size_t off, void *buf,
+			size_t count)
+{
+	size_t len;
+
+	len = min(count, log->size - off);
+	memcpy(buf, log->buffer + off, len);
+	if (count != len)
+		memcpy(buf + len, log->buffer, count - len);
+}
+
+/*
+ * get_batch_len - returns the length of the entries starting at 'off' that
+ * fit in 'limit' bytes; only the first entry unless 'batch' is set. A batch
+ * ends before an entry readers skip. Returns zero if not even the first
+ * entry fits.
+ *
+ * Caller needs to hold log->lock.
+ */
+static size_t get_batch_len(struct logger_log *log, size_t off,
+			    size_t limit, int batch)
+{
+	size_t len = 0;
+
+	do {
+		size_t nr = get_entry_len(log, logger_offset(off + len));
+
+		if (len + nr > limit)
+			break;
+		len += nr;
+	} while (batch && logger_offset(off + len) != log->w_off &&
+		 !get_entry_skip(log, logger_offset(off + len)));
+
+	return len;
+}
+
+/*
+ * lzo_raw_limit - the most uncompressed bytes that are sure to fit in a
+ * user buffer of 'count' bytes once compressed
+ */
+static size_t lzo_raw_limit(size_t count)
+{
+	size_t raw;
+
+	if (count <= sizeof(struct logger_lzo_header) +
+		     lzo1x_worst_compress(0))
+		return 0;
+	raw = count - sizeof(struct logger_lzo_header) -
+		lzo1x_worst_compress(0);
+	raw = min_t(size_t, raw - raw / 17, LOGGER_LZO_MAX_RAW);
+	while (raw && sizeof(struct logger_lzo_header) +
+	       lzo1x_worst_compress(raw) > count)
+		raw--;
+
+	return raw;
+}
+
+/*
+ * do_read_lzo_to_user - compresses the 'count' bytes of entries in
+ * reader->lzo_raw and copies them with a struct logger_lzo_header to 'buf'.
+ * Returns the number of bytes copied on success.
+ */
+static ssize_t do_read_lzo_to_user(struct logger_reader *reader,
+				   char __user *buf, size_t count)
+{
+	struct logger_lzo_header header;
+	size_t len;
+	int err;
+
+	err = lzo1x_1_compress(reader->lzo_raw, count, reader->lzo_out, &len,
+			       reader->lzo_wrk);
+	if (unlikely(err != LZO_E_OK))
+		return -EIO;
+
+	header.raw_len = count;
+	header.len = len;
+	if (copy_to_user(buf, &header, sizeof(header)))
+		return -EFAULT;
+	if (copy_to_user(buf + sizeof(header), reader->lzo_out, len))
+		return -EFAULT;
+
+	return sizeof(header) + len;
+}
+
+/*
+ * logger_set_read_mode - switch 'reader' to LOGGER_READ_* 'mode'
+ *
+ * Caller must hold log->mutex.
+ */
+static int logger_set_read_mode(struct logger_reader *reader, int mode)
+{
+	switch (mode) {
+	case LOGGER_READ_SINGLE:
+	case LOGGER_READ_BATCH:
+		break;
+	case LOGGER_READ_LZO:
+		if (reader->mode == LOGGER_READ_LZO)
+			return 0;
+		reader->lzo_raw = vmalloc(LOGGER_LZO_MAX_RAW);
+		reader->lzo_out = vmalloc(
+			lzo1x_worst_compress(LOGGER_LZO_MAX_RAW));
+		reader->lzo_wrk = vmalloc(LZO1X_1_MEM_COMPRESS);
+		if (!reader->lzo_raw || !reader->lzo_out || !reader->lzo_wrk)
+			goto err_nomem;
+		reader->mode = mode;
+		return 0;
+	default:
+		return -EINVAL;
+	}
+
+	vfree(reader->lzo_raw);
+	vfree(reader->lzo_out);
+	vfree(reader->lzo_wrk);
+	reader->lzo_raw = reader->lzo_out = reader->lzo_wrk = NULL;
+	reader->mode = mode;
+	return 0;
+
+err_nomem:
+	vfree(reader->lzo_raw);
+	vfree(reader->lzo_out);
+	vfree(reader->lzo_wrk);
+	reader->lzo_raw = reader->lzo_out = reader->lzo_wrk = NULL;
+	return -ENOMEM;
+}
+
 /*
  * logger_read - our log's read() method
  *
@@ -149,7 +379,8 @@ static ssize_t do_read_log_to_user(struct logger_log *log,
  *
  * 	- O_NONBLOCK works
  * 	- If there are no log entries to read, blocks until log is written to
- * 	- Atomically reads exactly one log entry
+ * 	- Atomically reads exactly one log entry, or as many whole entries as
+ * 	  fit in the buffer in batch and lzo mode
  *
  * Optimal read size is LOGGER_ENTRY_MAX_LEN. Will set errno to EINVAL if read
  * buffer is insufficient to hold next entry.
@@ -160,15 +391,16 @@ static ssize_t logger_read(struct file *file, char __user *buf,
 	struct logger_reader *reader = file->private_data;
 	struct logger_log *log = reader->log;
 	ssize_t ret;
+	size_t off;
 	DEFINE_WAIT(wait);
 
 start:
 	while (1) {
 		prepare_to_wait(&log->wq, &wait, TASK_INTERRUPTIBLE);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		ret = (log->w_off == reader->r_off);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 		if (!ret)
 			break;
 
@@ -190,22 +422,47 @@ start:
 		return ret;
 
 	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 
 	/* is there still something to read or did we race? */
+	skip_entries(log, reader);
 	if (unlikely(log->w_off == reader->r_off)) {
+		spin_unlock(&log->lock);
 		mutex_unlock(&log->mutex);
 		goto start;
 	}
 
-	/* get the size of the next entry */
-	ret = get_entry_len(log, reader->r_off);
-	if (count < ret) {
+	/* get the size of the next entry, or of the next batch */
+	off = reader->r_off;
+	ret = get_batch_len(log, off, reader->mode == LOGGER_READ_LZO ?
+			    lzo_raw_limit(count) : count,
+			    reader->mode != LOGGER_READ_SINGLE);
+	spin_unlock(&log->lock);
+	if (!ret) {
 		ret = -EINVAL;
 		goto out;
 	}
 
-	/* get exactly one entry from the log */
-	ret = do_read_log_to_user(log, reader, buf, ret);
+	/* get the entries from the log */
+	if (reader->mode == LOGGER_READ_LZO)
+		do_read_log(log, off, reader->lzo_raw, ret);
+	else
+		ret = do_read_log_to_user(log, off, buf, ret);
+	if (ret < 0)
+		goto out;
+
+	spin_lock(&log->lock);
+	if (unlikely(reader->r_off != off)) {
+		/* a writer lapped us and the entry may be torn, try again */
+		spin_unlock(&log->lock);
+		mutex_unlock(&log->mutex);
+		goto start;
+	}
+	reader->r_off = logger_offset(off + ret);
+	spin_unlock(&log->lock);
+
+	if (reader->mode == LOGGER_READ_LZO)
+		ret = do_read_lzo_to_user(reader, buf, ret);
 
 out:
 	mutex_unlock(&log->mutex);
@@ -217,7 +474,7 @@ out:
  * get_next_entry - return the offset of the first valid entry at least 'len'
  * bytes after 'off'.
  *
- * Caller must hold log->mutex.
+ * Caller must hold log->lock.
  */
 static size_t get_next_entry(struct logger_log *log, size_t off, size_t len)
 {
@@ -255,16 +512,20 @@ static inline int clock_interval(size_t a, size_t b, size_t c)
  * We do this by "pulling forward" the readers and start head to the first
  * entry after the new write head.
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to hold log->lock.
  */
 static void fix_up_readers(struct logger_log *log, size_t len)
 {
-	size_t old = log->w_off;
+	size_t old = log->reserve_off;
 	size_t new = logger_offset(old + len);
 	struct logger_reader *reader;
 
-	if (clock_interval(old, new, log->head))
-		log->head = get_next_entry(log, log->head, len);
+	if (clock_interval(old, new, log->head)) {
+		size_t head = get_next_entry(log, log->head, len);
+
+		log->mmap_header->head_pos += logger_offset(head - log->head);
+		log->head = head;
+	}
 
 	list_for_each_entry(reader, &log->readers, list)
 		if (clock_interval(old, new, reader->r_off))
@@ -272,50 +533,223 @@ static void fix_up_readers(struct logger_log *log, size_t len)
 }
 
 /*
- * do_write_log - writes 'len' bytes from 'buf' to 'log'
+ * do_write_log - writes 'count' bytes from 'buf' to 'log' at 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to own the room at 'off' through logger_reserve().
  */
-static void do_write_log(struct logger_log *log, const void *buf, size_t count)
+static void do_write_log(struct logger_log *log, size_t off, const void *buf,
+			 size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	memcpy(log->buffer + log->w_off, buf, len);
+	len = min(count, log->size - off);
+	memcpy(log->buffer + off, buf, len);
 
 	if (count != len)
 		memcpy(log->buffer, buf + len, count - len);
-
-	log->w_off = logger_offset(log->w_off + count);
-
 }
 
 /*
- * do_write_log_user - writes 'len' bytes from the user-space buffer 'buf' to
- * the log 'log'
+ * do_write_log_user - writes 'count' bytes from the user-space buffer 'buf'
+ * to the log 'log' at 'off'
  *
- * The caller needs to hold log->mutex.
+ * The caller needs to own the room at 'off' through logger_reserve().
  *
  * Returns 'count' on success, negative error code on failure.
  */
-static ssize_t do_write_log_from_user(struct logger_log *log,
+static ssize_t do_write_log_from_user(struct logger_log *log, size_t off,
 				      const void __user *buf, size_t count)
 {
 	size_t len;
 
-	len = min(count, log->size - log->w_off);
-	if (len && copy_from_user(log->buffer + log->w_off, buf, len))
+	len = min(count, log->size - off);
+	if (len && copy_from_user(log->buffer + off, buf, len))
 		return -EFAULT;
 
 	if (count != len)
 		if (copy_from_user(log->buffer, buf + len, count - len))
 			return -EFAULT;
 
-	log->w_off = logger_offset(log->w_off + count);
-
 	return count;
 }
 
+/*
+ * logger_reserve - reserve 'len' bytes at the write head for 'write'
+ *
+ * Fixes up any readers, pulling them forward to the first readable entry
+ * after (what will be) the new write head. We do this now because readers
+ * must not see the entry while it is being written.
+ *
+ * Writes in flight may not take up more than half the log, so that fixing
+ * up readers never walks into an entry that is not written yet. Returns 0
+ * if there is no room or the log is being resized; the writer then waits
+ * on log->commit_wq.
+ */
+static int logger_reserve(struct logger_log *log, struct logger_write *write,
+			  size_t len)
+{
+	spin_lock(&log->lock);
+	if (log->resizing || log->pending + len > log->size / 2) {
+		spin_unlock(&log->lock);
+		return 0;
+	}
+	fix_up_readers(log, len);
+	/* mmap readers must see the new head before the entry is written */
+	smp_wmb();
+	write->off = log->reserve_off;
+	write->len = len;
+	write->done = 0;
+	list_add_tail(&write->list, &log->writes);
+	log->reserve_off = logger_offset(log->reserve_off + len);
+	log->pending += len;
+	spin_unlock(&log->lock);
+
+	return 1;
+}
+
+/*
+ * logger_commit - mark the entry of 'write' as written and publish every
+ * entry at the head of the writes in flight that is complete
+ */
+static void logger_commit(struct logger_log *log, struct logger_write *write)
+{
+	struct logger_write *first;
+	int published = 0;
+
+	spin_lock(&log->lock);
+	write->done = 1;
+	while (!list_empty(&log->writes)) {
+		first = list_first_entry(&log->writes, struct logger_write,
+					 list);
+		if (!first->done)
+			break;
+		list_del(&first->list);
+		log->w_off = logger_offset(first->off + first->len);
+		log->pending -= first->len;
+		/* the entry must be visible to mmap readers before w_pos */
+		smp_wmb();
+		log->mmap_header->w_pos += first->len;
+		published = 1;
+	}
+	spin_unlock(&log->lock);
+
+	if (!published)
+		return;
+
+	/* wake up any blocked readers and writers */
+	wake_up_interruptible(&log->wq);
+	if (waitqueue_active(&log->commit_wq))
+		wake_up(&log->commit_wq);
+}
+
+/*
+ * logger_ratelimit_refill - add the tokens 'rl' earned since its last refill
+ *
+ * Caller needs to hold log->lock.
+ */
+static void logger_ratelimit_refill(struct logger_log *log,
+				    struct logger_ratelimit *rl,
+				    unsigned long now)
+{
+	if (!rl->used) {
+		rl->used = 1;
+		rl->tokens = log->rl_burst;
+		rl->stamp = now;
+		rl->dropped = 0;
+	} else if (now - rl->stamp > 3600 * HZ) {
+		rl->tokens = log->rl_burst;
+		rl->stamp = now;
+	} else {
+		u64 refill = (u64)(now - rl->stamp) * log->rl_rate;
+
+		do_div(refill, HZ);
+		/* keep the remainder until it adds up to a whole byte */
+		if (refill) {
+			rl->tokens = min_t(u64, rl->tokens + refill,
+					   log->rl_burst);
+			rl->stamp = now;
+		}
+	}
+}
+
+/*
+ * logger_ratelimit_bucket - find the token bucket of 'uid', refilled up to
+ * 'now'
+ *
+ * Caller needs to hold log->lock.
+ */
+static struct logger_ratelimit *
+logger_ratelimit_bucket(struct logger_log *log, uid_t uid, unsigned long now)
+{
+	struct logger_ratelimit *rl, *unused = NULL, *idle = NULL;
+	unsigned int slot = hash_32(uid, LOGGER_RATELIMIT_BITS);
+	int i;
+
+	for (i = 0; i < LOGGER_RATELIMIT_PROBES; i++) {
+		rl = &log->rl[(slot + i) & (LOGGER_RATELIMIT_SLOTS - 1)];
+		if (!rl->used) {
+			if (!unused)
+				unused = rl;
+			continue;
+		}
+		logger_ratelimit_refill(log, rl, now);
+		if (rl->uid == uid)
+			return rl;
+		if (!idle && rl->tokens == log->rl_burst)
+			idle = rl;
+	}
+
+	if (unused) {
+		logger_ratelimit_refill(log, unused, now);
+		unused->uid = uid;
+		return unused;
+	}
+
+	if (idle) {
+		if (idle->dropped)
+			printk(KERN_INFO "logger: log '%s': uid %u dropped "
+			       "%lu entries\n", log->misc.name, idle->uid,
+			       idle->dropped);
+		idle->uid = uid;
+		idle->dropped = 0;
+		return idle;
+	}
+
+	logger_ratelimit_refill(log, &log->rl_overflow, now);
+	return &log->rl_overflow;
+}
+
+/*
+ * logger_ratelimit - charge 'len' bytes to the token bucket of the current
+ * UID. Returns 1 if the entry may be written, 0 if it has to be dropped.
+ */
+static int logger_ratelimit(struct logger_log *log, size_t len)
+{
+	struct logger_ratelimit *rl;
+	int ret = 1;
+
+	/* unlocked peek, the fast path when rate limiting is off */
+	if (!ACCESS_ONCE(log->rl_rate))
+		return 1;
+
+	spin_lock(&log->lock);
+	if (!log->rl_rate)
+		goto out;
+	rl = logger_ratelimit_bucket(log, current_uid(), jiffies);
+
+	if (rl->tokens >= len) {
+		rl->tokens -= len;
+	} else {
+		rl->dropped++;
+		log->dropped++;
+		ret = 0;
+	}
+out:
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
 /*
  * logger_aio_write - our write method, implementing support for write(),
  * writev(), and aio_write(). Writes are our fast path, and we try to optimize
@@ -325,13 +759,15 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 			 unsigned long nr_segs, loff_t ppos)
 {
 	struct logger_log *log = file_get_log(iocb->ki_filp);
-	size_t orig = log->w_off;
 	struct logger_entry header;
+	struct logger_write write;
 	struct timespec now;
+	size_t off;
 	ssize_t ret = 0;
 
 	now = current_kernel_time();
 
+	header.__pad = 0;
 	header.pid = current->tgid;
 	header.tid = current->pid;
 	header.sec = now.tv_sec;
@@ -342,17 +778,16 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 	if (unlikely(!header.len))
 		return 0;
 
-	mutex_lock(&log->mutex);
+	/* entries over the rate limit are dropped, but look written */
+	if (!logger_ratelimit(log, sizeof(struct logger_entry) + header.len))
+		return header.len;
 
-	/*
-	 * Fix up any readers, pulling them forward to the first readable
-	 * entry after (what will be) the new write offset. We do this now
-	 * because if we partially fail, we can end up with clobbered log
-	 * entries that encroach on readable buffer.
-	 */
-	fix_up_readers(log, sizeof(struct logger_entry) + header.len);
+	if (wait_event_interruptible(log->commit_wq, logger_reserve(log,
+			&write, sizeof(struct logger_entry) + header.len)))
+		return -ERESTARTSYS;
 
-	do_write_log(log, &header, sizeof(struct logger_entry));
+	do_write_log(log, write.off, &header, sizeof(struct logger_entry));
+	off = logger_offset(write.off + sizeof(struct logger_entry));
 
 	while (nr_segs-- > 0) {
 		size_t len;
@@ -362,21 +797,26 @@ ssize_t logger_aio_write(struct kiocb *iocb, const struct iovec *iov,
 		len = min_t(size_t, iov->iov_len, header.len - ret);
 
 		/* write out this segment's payload */
-		nr = do_write_log_from_user(log, iov->iov_base, len);
+		nr = do_write_log_from_user(log, off, iov->iov_base, len);
 		if (unlikely(nr < 0)) {
-			log->w_off = orig;
-			mutex_unlock(&log->mutex);
-			return nr;
+			/*
+			 * The room is reserved and later entries may already
+			 * be written behind it, so we cannot take it back.
+			 * Mark the entry for readers to skip instead.
+			 */
+			header.__pad = LOGGER_ENTRY_SKIP;
+			do_write_log(log, write.off, &header,
+				     sizeof(struct logger_entry));
+			ret = nr;
+			break;
 		}
 
+		off = logger_offset(off + nr);
 		iov++;
 		ret += nr;
 	}
 
-	mutex_unlock(&log->mutex);
-
-	/* wake up any blocked readers */
-	wake_up_interruptible(&log->wq);
+	logger_commit(log, &write);
 
 	return ret;
 }
@@ -409,12 +849,14 @@ static int logger_open(struct inode *inode, struct file *file)
 			return -ENOMEM;
 
 		reader->log = log;
+		reader->mode = LOGGER_READ_SINGLE;
+		reader->lzo_raw = reader->lzo_out = reader->lzo_wrk = NULL;
 		INIT_LIST_HEAD(&reader->list);
 
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		reader->r_off = log->head;
 		list_add_tail(&reader->list, &log->readers);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
 
 		file->private_data = reader;
 	} else
@@ -435,9 +877,10 @@ static int logger_release(struct inode *ignored, struct file *file)
 		struct logger_log *log;
 
 		log = reader->log;
-		mutex_lock(&log->mutex);
+		spin_lock(&log->lock);
 		list_del(&reader->list);
-		mutex_unlock(&log->mutex);
+		spin_unlock(&log->lock);
+		logger_set_read_mode(reader, LOGGER_READ_SINGLE);
 		kfree(reader);
 	}
 
@@ -467,9 +910,64 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 
 	poll_wait(file, &log->wq, wait);
 
-	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
 	if (log->w_off != reader->r_off)
 		ret |= POLLIN | POLLRDNORM;
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+/* number of entries logger_set_position() checks per hold of log->lock */
+#define LOGGER_WALK_BATCH	64
+
+/*
+ * logger_set_position - move 'reader' to position 'new_pos', which must be
+ * the start of an entry still in the log, or w_pos
+ *
+ * We check that by walking the entries from the head, a batch at a time so
+ * that log->lock is never held for long. Writers may push the head past us
+ * while the lock is dropped; the walk then carries on from the new head.
+ */
+static long logger_set_position(struct logger_log *log,
+				struct logger_reader *reader, __u32 new_pos)
+{
+	struct logger_mmap_header *header = log->mmap_header;
+	long ret = -EINVAL;
+	__u32 pos;
+	int nr;
+
+	/* keeps the buffer from being resized under the walk */
+	mutex_lock(&log->mutex);
+	spin_lock(&log->lock);
+
+	pos = header->head_pos;
+	while ((__s32)(new_pos - header->head_pos) >= 0 &&
+	       (__s32)(header->w_pos - new_pos) >= 0) {
+		if ((__s32)(pos - header->head_pos) < 0)
+			pos = header->head_pos;
+
+		for (nr = 0; nr < LOGGER_WALK_BATCH &&
+		     (__s32)(new_pos - pos) > 0; nr++)
+			pos += get_entry_len(log, logger_offset(log->head +
+						(pos - header->head_pos)));
+
+		if (pos == new_pos) {
+			reader->r_off = logger_offset(log->head +
+						(new_pos - header->head_pos));
+			ret = 0;
+			break;
+		}
+		/* we stepped over new_pos, so it is inside an entry */
+		if ((__s32)(new_pos - pos) < 0)
+			break;
+
+		spin_unlock(&log->lock);
+		cond_resched();
+		spin_lock(&log->lock);
+	}
+
+	spin_unlock(&log->lock);
 	mutex_unlock(&log->mutex);
 
 	return ret;
@@ -478,10 +976,32 @@ static unsigned int logger_poll(struct file *file, poll_table *wait)
 static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 {
 	struct logger_log *log = file_get_log(file);
+	struct logger_mmap_header *header = log->mmap_header;
 	struct logger_reader *reader;
+	struct logger_position pos;
+	void __user *argp = (void __user *)arg;
+	__u32 new_pos;
 	long ret = -ENOTTY;
 
-	mutex_lock(&log->mutex);
+	if (cmd == LOGGER_SET_POSITION) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		if (get_user(new_pos, (__u32 __user *)argp))
+			return -EFAULT;
+		return logger_set_position(log, file->private_data, new_pos);
+	}
+
+	if (cmd == LOGGER_SET_READ_MODE) {
+		if (!(file->f_mode & FMODE_READ))
+			return -EBADF;
+		reader = file->private_data;
+		mutex_lock(&log->mutex);
+		ret = logger_set_read_mode(reader, arg);
+		mutex_unlock(&log->mutex);
+		return ret;
+	}
+
+	spin_lock(&log->lock);
 
 	switch (cmd) {
 	case LOGGER_GET_LOG_BUF_SIZE:
@@ -504,6 +1024,7 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 			break;
 		}
 		reader = file->private_data;
+		skip_entries(log, reader);
 		if (log->w_off != reader->r_off)
 			ret = get_entry_len(log, reader->r_off);
 		else
@@ -517,15 +1038,105 @@ static long logger_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		list_for_each_entry(reader, &log->readers, list)
 			reader->r_off = log->w_off;
 		log->head = log->w_off;
+		header->head_pos = header->w_pos;
+		ret = 0;
+		break;
+	case LOGGER_GET_POSITION:
+		if (!(file->f_mode & FMODE_READ)) {
+			ret = -EBADF;
+			break;
+		}
+		reader = file->private_data;
+		pos.head_pos = header->head_pos;
+		pos.w_pos = header->w_pos;
+		pos.r_pos = pos.w_pos - logger_offset(log->w_off - reader->r_off);
 		ret = 0;
 		break;
 	}
 
-	mutex_unlock(&log->mutex);
+	spin_unlock(&log->lock);
+
+	if (cmd == LOGGER_GET_POSITION && !ret &&
+	    copy_to_user(argp, &pos, sizeof(pos)))
+		ret = -EFAULT;
 
 	return ret;
 }
 
+static void logger_vma_open(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_inc(&log->mapped);
+}
+
+static void logger_vma_close(struct vm_area_struct *vma)
+{
+	struct logger_log *log = vma->vm_private_data;
+
+	atomic_dec(&log->mapped);
+}
+
+static const struct vm_operations_struct logger_vm_ops = {
+	.open = logger_vma_open,
+	.close = logger_vma_close,
+};
+
+/*
+ * logger_mmap - the log's mmap file operation
+ *
+ * Maps the header page followed by the whole ring, read-only. Only allowed
+ * for readers; see struct logger_mmap_header for how to use the mapping.
+ * The buffer cannot be resized while it is mapped.
+ */
+static int logger_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct logger_log *log = file_get_log(file);
+	unsigned long addr = vma->vm_start;
+	unsigned char *buffer;
+	size_t off, size;
+	int ret;
+
+	if (!(file->f_mode & FMODE_READ))
+		return -EBADF;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+
+	spin_lock(&log->lock);
+	if (log->resizing) {
+		spin_unlock(&log->lock);
+		return -EBUSY;
+	}
+	buffer = log->buffer;
+	size = log->size;
+	atomic_inc(&log->mapped);
+	spin_unlock(&log->lock);
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start != PAGE_SIZE + size) {
+		ret = -EINVAL;
+		goto err;
+	}
+	vma->vm_flags &= ~VM_MAYWRITE;
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	ret = vm_insert_page(vma, addr, virt_to_page(log->mmap_header));
+	for (off = 0; !ret && off < size; off += PAGE_SIZE) {
+		addr += PAGE_SIZE;
+		ret = vm_insert_page(vma, addr, vmalloc_to_page(buffer + off));
+	}
+	if (ret)
+		goto err;
+
+	vma->vm_private_data = log;
+	vma->vm_ops = &logger_vm_ops;
+
+	return 0;
+
+err:
+	atomic_dec(&log->mapped);
+	return ret;
+}
+
 static const struct file_operations logger_fops = {
 	.owner = THIS_MODULE,
 	.read = logger_read,
@@ -533,19 +1144,23 @@ static const struct file_operations logger_fops = {
 	.poll = logger_poll,
 	.unlocked_ioctl = logger_ioctl,
 	.compat_ioctl = logger_ioctl,
+	.mmap = logger_mmap,
 	.open = logger_open,
 	.release = logger_release,
 };
 
+/* limits on the size of a log, which must also be a power of two */
+#define LOGGER_MIN_SIZE		(64*1024)
+#define LOGGER_MAX_SIZE		(16*1024*1024)
+
 /*
- * Defines a log structure with name 'NAME' and a size of 'SIZE' bytes, which
- * must be a power of two, greater than LOGGER_ENTRY_MAX_LEN, and less than
- * LONG_MAX minus LOGGER_ENTRY_MAX_LEN.
+ * Defines a log structure with name 'NAME' and an initial size of 'SIZE'
+ * bytes, which must be a power of two between LOGGER_MIN_SIZE and
+ * LOGGER_MAX_SIZE. The buffer is allocated by init_log().
  */
 #define DEFINE_LOGGER_DEVICE(VAR, NAME, SIZE) \
-static unsigned char _buf_ ## VAR[SIZE]; \
 static struct logger_log VAR = { \
-	.buffer = _buf_ ## VAR, \
+	.buffer = NULL, \
 	.misc = { \
 		.minor = MISC_DYNAMIC_MINOR, \
 		.name = NAME, \
@@ -555,9 +1170,18 @@ static struct logger_log VAR = { \
 	.wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .wq), \
 	.readers = LIST_HEAD_INIT(VAR .readers), \
 	.mutex = __MUTEX_INITIALIZER(VAR .mutex), \
+	.lock = __SPIN_LOCK_UNLOCKED(VAR .lock), \
 	.w_off = 0, \
+	.reserve_off = 0, \
+	.writes = LIST_HEAD_INIT(VAR .writes), \
+	.pending = 0, \
+	.commit_wq = __WAIT_QUEUE_HEAD_INITIALIZER(VAR .commit_wq), \
 	.head = 0, \
 	.size = SIZE, \
+	.mapped = ATOMIC_INIT(0), \
+	.resizing = 0, \
+	.rl_rate = 0, \
+	.rl_burst = 16 * LOGGER_ENTRY_MAX_LEN, \
 };
 
 DEFINE_LOGGER_DEVICE(log_main, LOGGER_LOG_MAIN, 256*1024)
@@ -578,17 +1202,278 @@ static struct logger_log *get_log_from_minor(int minor)
 	return NULL;
 }
 
+static inline struct logger_log *dev_get_log(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct logger_log, misc);
+}
+
+/*
+ * logger_writes_done - have all writes in flight been committed?
+ */
+static int logger_writes_done(struct logger_log *log)
+{
+	int ret;
+
+	spin_lock(&log->lock);
+	ret = !log->pending;
+	spin_unlock(&log->lock);
+
+	return ret;
+}
+
+/*
+ * logger_resize - replace the buffer of 'log' with one of 'size' bytes,
+ * keeping as many of the newest entries as fit
+ *
+ * The entries kept stay at their positions, so they land at offset
+ * (pos & (size - 1)) of the new buffer, just as the mmap header promises.
+ */
+static int logger_resize(struct logger_log *log, size_t size)
+{
+	struct logger_reader *reader;
+	unsigned char *buffer, *old;
+	size_t head, len, skip, off, first;
+	int ret = 0;
+
+	buffer = vzalloc(size);
+	if (!buffer)
+		return -ENOMEM;
+
+	mutex_lock(&log->mutex);
+
+	spin_lock(&log->lock);
+	if (atomic_read(&log->mapped)) {
+		spin_unlock(&log->lock);
+		old = buffer;
+		ret = -EBUSY;
+		goto out;
+	}
+	log->resizing = 1;
+	spin_unlock(&log->lock);
+
+	/* new writers wait in logger_reserve(), let those in flight finish */
+	wait_event(log->commit_wq, logger_writes_done(log));
+
+	spin_lock(&log->lock);
+
+	/* drop the oldest entries until the rest fits */
+	head = log->head;
+	len = logger_offset(log->w_off - head);
+	while (len >= size) {
+		size_t nr = get_entry_len(log, head);
+
+		head = logger_offset(head + nr);
+		len -= nr;
+	}
+	skip = logger_offset(head - log->head);
+
+	/* where the new head goes in the new buffer */
+	off = (log->mmap_header->w_pos - len) & (size - 1);
+	first = min(len, size - off);
+	do_read_log(log, head, buffer + off, first);
+	do_read_log(log, logger_offset(head + first), buffer, len - first);
+
+	list_for_each_entry(reader, &log->readers, list) {
+		size_t r_off = logger_offset(reader->r_off - log->head);
+
+		r_off = r_off < skip ? 0 : r_off - skip;
+		reader->r_off = (off + r_off) & (size - 1);
+	}
+
+	old = log->buffer;
+	log->buffer = buffer;
+	log->size = size;
+	log->head = off;
+	log->w_off = logger_offset(off + len);
+	log->reserve_off = log->w_off;
+	log->mmap_header->size = size;
+	log->mmap_header->head_pos = log->mmap_header->w_pos - len;
+	log->resizing = 0;
+	spin_unlock(&log->lock);
+
+	wake_up(&log->commit_wq);
+
+out:
+	mutex_unlock(&log->mutex);
+	vfree(old);
+
+	return ret;
+}
+
+static ssize_t buffer_size_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+
+	return sprintf(buf, "%zu\n", log->size);
+}
+
+static ssize_t buffer_size_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct logger_log *log = dev_get_log(dev);
+	unsigned long size;
+	int ret;
+
+	if (sscanf(buf, "%lu", &size) != 1)
+		return -EINVAL;
+	if (!is_power_of_2(size) || size < LOGGER_MIN_SIZE ||
+	    size > LOGGER_MAX_SIZE)
+		return -EINVAL;
+
+	ret = logger_resize(log, size);
+	if (ret)
+		return ret;
+
+	return count;
+}
+
+static ssize_t ratelimit_rate_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+
+	return sprintf(buf, "%zu\n", log->rl_rate);
+}
+
+static ssize_t ratelimit_rate_store(struct device *dev,
+				    struct device_attribute *attr,
+				    const char *buf, size_t count)
+{
+	struct logger_log *log = dev_get_log(dev);
+	unsigned long rate;
+
+	if (sscanf(buf, "%lu", &rate) != 1 || rate > LOGGER_MAX_SIZE)
+		return -EINVAL;
+
+	spin_lock(&log->lock);
+	log->rl_rate = rate;
+	memset(log->rl, 0, sizeof(log->rl));
+	memset(&log->rl_overflow, 0, sizeof(log->rl_overflow));
+	spin_unlock(&log->lock);
+
+	return count;
+}
+
+static ssize_t ratelimit_burst_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+
+	return sprintf(buf, "%zu\n", log->rl_burst);
+}
+
+static ssize_t ratelimit_burst_store(struct device *dev,
+				     struct device_attribute *attr,
+				     const char *buf, size_t count)
+{
+	struct logger_log *log = dev_get_log(dev);
+	unsigned long burst;
+
+	/* the bucket must hold at least one entry of maximum length */
+	if (sscanf(buf, "%lu", &burst) != 1 || burst < LOGGER_ENTRY_MAX_LEN ||
+	    burst > LOGGER_MAX_SIZE)
+		return -EINVAL;
+
+	spin_lock(&log->lock);
+	log->rl_burst = burst;
+	memset(log->rl, 0, sizeof(log->rl));
+	memset(&log->rl_overflow, 0, sizeof(log->rl_overflow));
+	spin_unlock(&log->lock);
+
+	return count;
+}
+
+static ssize_t dropped_show(struct device *dev,
+			    struct device_attribute *attr, char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+
+	return sprintf(buf, "%lu\n", log->dropped);
+}
+
+/*
+ * UIDs currently tracked by the rate limiter and how many entries they lost,
+ * followed by the overflow bucket shared by the UIDs that found no slot
+ */
+static ssize_t ratelimit_uids_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	struct logger_log *log = dev_get_log(dev);
+	ssize_t len = 0;
+	int i;
+
+	spin_lock(&log->lock);
+	for (i = 0; i < LOGGER_RATELIMIT_SLOTS; i++)
+		if (log->rl[i].used)
+			len += scnprintf(buf + len, PAGE_SIZE - len,
+					 "%u %lu\n", log->rl[i].uid,
+					 log->rl[i].dropped);
+	if (log->rl_overflow.used)
+		len += scnprintf(buf + len, PAGE_SIZE - len, "overflow %lu\n",
+				 log->rl_overflow.dropped);
+	spin_unlock(&log->lock);
+
+	return len;
+}
+
+static DEVICE_ATTR(buffer_size, S_IRUGO | S_IWUSR,
+		   buffer_size_show, buffer_size_store);
+static DEVICE_ATTR(ratelimit_rate, S_IRUGO | S_IWUSR,
+		   ratelimit_rate_show, ratelimit_rate_store);
+static DEVICE_ATTR(ratelimit_burst, S_IRUGO | S_IWUSR,
+		   ratelimit_burst_show, ratelimit_burst_store);
+static DEVICE_ATTR(dropped, S_IRUGO, dropped_show, NULL);
+static DEVICE_ATTR(ratelimit_uids, S_IRUGO, ratelimit_uids_show, NULL);
+
+static struct attribute *logger_attrs[] = {
+	&dev_attr_buffer_size.attr,
+	&dev_attr_ratelimit_rate.attr,
+	&dev_attr_ratelimit_burst.attr,
+	&dev_attr_dropped.attr,
+	&dev_attr_ratelimit_uids.attr,
+	NULL
+};
+
+static const struct attribute_group logger_attr_group = {
+	.attrs = logger_attrs,
+};
+
 static int __init init_log(struct logger_log *log)
 {
 	int ret;
 
+	log->buffer = vzalloc(log->size);
+	if (!log->buffer)
+		return -ENOMEM;
+
+	log->mmap_header = (void *)get_zeroed_page(GFP_KERNEL);
+	if (!log->mmap_header) {
+		vfree(log->buffer);
+		return -ENOMEM;
+	}
+	log->mmap_header->version = LOGGER_MMAP_VERSION;
+	log->mmap_header->data_offset = PAGE_SIZE;
+	log->mmap_header->size = log->size;
+
 	ret = misc_register(&log->misc);
 	if (unlikely(ret)) {
 		printk(KERN_ERR "logger: failed to register misc "
 		       "device for log '%s'!\n", log->misc.name);
+		free_page((unsigned long)log->mmap_header);
+		vfree(log->buffer);
 		return ret;
 	}
 
+	ret = sysfs_create_group(&log->misc.this_device->kobj,
+				 &logger_attr_group);
+	if (unlikely(ret))
+		printk(KERN_WARNING "logger: failed to create sysfs "
+		       "attributes for log '%s'\n", log->misc.name);
+
 	printk(KERN_INFO "logger: created %luK log '%s'\n",
 	       (unsigned long) log->size >> 10, log->misc.name);
 
@@ -30,6 +30,9 @@ struct logger_entry {
 	char		msg[0];	/* the entry's payload */
 };
 
+/* __pad of an entry whose payload could not be written; skip the entry */
+#define LOGGER_ENTRY_SKIP		0x1
+
 #define LOGGER_LOG_RADIO	"log_radio"	/* radio-related messages */
 #define LOGGER_LOG_EVENTS	"log_events"	/* system/hardware events */
 #define LOGGER_LOG_SYSTEM	"log_system"	/* system/framework messages */
@@ -39,11 +42,59 @@ struct logger_entry {
 #define LOGGER_ENTRY_MAX_PAYLOAD	\
 	(LOGGER_ENTRY_MAX_LEN - sizeof(struct logger_entry))
 
+/*
+ * A log opened for reading can be mapped read-only: the first page of the
+ * mapping holds a struct logger_mmap_header, the ring itself follows at
+ * data_offset. Positions are free-running byte counters; position 'pos' is
+ * at offset (pos & (size - 1)) of the ring. Entries between head_pos and
+ * w_pos are readable. To read an entry in place, check that w_pos is past
+ * it, parse it and then check that head_pos has not moved past its start;
+ * if it has, a writer lapped the reader and the entry may be torn. Entries
+ * with LOGGER_ENTRY_SKIP set in __pad carry no message and are skipped.
+ */
+struct logger_mmap_header {
+	__u32		version;	/* LOGGER_MMAP_VERSION */
+	__u32		data_offset;	/* offset of the ring in the mapping */
+	__u32		size;		/* size of the ring, a power of two */
+	__u32		w_pos;		/* position after the newest entry */
+	__u32		head_pos;	/* position of the oldest entry */
+};
+
+#define LOGGER_MMAP_VERSION		1
+
+struct logger_position {
+	__u32		head_pos;	/* position of the oldest entry */
+	__u32		w_pos;		/* position after the newest entry */
+	__u32		r_pos;		/* position of the reader */
+};
+
+/*
+ * Read modes, selected per reader with LOGGER_SET_READ_MODE. In single mode
+ * read() returns exactly one entry. In batch mode it returns as many whole
+ * entries as fit in the buffer. In lzo mode it returns a struct
+ * logger_lzo_header followed by a batch of whole entries compressed with
+ * LZO1X-1.
+ */
+#define LOGGER_READ_SINGLE		0
+#define LOGGER_READ_BATCH		1
+#define LOGGER_READ_LZO			2
+
+struct logger_lzo_header {
+	__u32		raw_len;	/* length of the uncompressed entries */
+	__u32		len;		/* length of the compressed data */
+};
+
+/* most uncompressed data returned by one read() in lzo mode */
+#define LOGGER_LZO_MAX_RAW		(64*1024)
+
 #define __LOGGERIO	0xAE
 
 #define LOGGER_GET_LOG_BUF_SIZE		_IO(__LOGGERIO, 1) /* size of log */
 #define LOGGER_GET_LOG_LEN		_IO(__LOGGERIO, 2) /* used log len */
 #define LOGGER_GET_NEXT_ENTRY_LEN	_IO(__LOGGERIO, 3) /* next entry len */
 #define LOGGER_FLUSH_LOG		_IO(__LOGGERIO, 4) /* flush log */
+#define LOGGER_GET_POSITION		_IOR(__LOGGERIO, 5, struct logger_position)
+#define LOGGER_SET_POSITION		_IOW(__LOGGERIO, 6, __u32) /* move reader */
+#define LOGGER_SET_READ_MODE		_IO(__LOGGERIO, 7) /* read mode */
 
 #endif /* _LINUX_LOGGER_H */
@@ -16,6 +16,28 @@
  * percentage of the cached memory is locked this can be very inaccurate
  * and processes may not get killed until the normal oom killer is triggered.
  *
+ * Rather than walking the task list on every call, the driver keeps every
+ * process in a bucket for its oom_adj value, kept up to date through the
+ * oom_adj notifier. A victim is picked from the highest non-empty bucket at
+ * or above the threshold, using a recently cached RSS for each process.
+ *
+ * Besides the thresholds, the driver watches how well reclaim is doing in
+ * each zone. When more than /sys/module/lowmemorykiller/parameters/pressure
+ * percent of the pages scanned in a zone could not be reclaimed, it kills a
+ * process at the highest oom_adj threshold right away, without waiting for
+ * free memory to drop below minfree. Write 0 to turn this off.
+ *
+ * User-space can hear about memory getting low before anything is killed by
+ * polling /dev/lowmem_pressure. Reading it returns the current level and the
+ * oom_adj value that level is about to kill, as "<level> <adj>\n". Level 0
+ * means all is well; level n means free memory is within notify_margin
+ * percent of the n-th largest minfree threshold, or that some zone is below
+ * its low watermark. The top level, one more than the number of thresholds,
+ * means some zone is below its min watermark. The first read returns at
+ * once; later ones block until the level changes, or fail with EAGAIN with
+ * O_NONBLOCK. poll() reports POLLIN when the level changed since the file
+ * was last read, and POLLPRI at the top level.
+ *
  * Copyright (C) 2007-2008 Google, Inc.
  *
  * This software is licensed under the terms of the GNU General Public
@@ -35,6 +57,27 @@
 #include <linux/oom.h>
 #include <linux/sched.h>
 #include <linux/notifier.h>
+#include <linux/slab.h>
+#include <linux/hash.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/swap.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/poll.h>
+#include <linux/uaccess.h>
+
+/* why a process was killed */
+enum {
+	LOWMEM_KILL_MINFREE,
+	LOWMEM_KILL_PRESSURE,
+};
+
+#include "lowmemorykiller_trace.h"
 
 static uint32_t lowmem_debug_level = 2;
 static int lowmem_adj[6] = {
@@ -55,6 +98,230 @@ static int lowmem_minfree_size = 4;
 static struct task_struct *lowmem_deathpending;
 static unsigned long lowmem_deathpending_timeout;
 
+/* percentage of unreclaimable scanned pages that triggers a kill */
+static int lowmem_pressure = 95;
+
+/*
+ * Reclaim is judged over windows of this many scanned pages per zone, so
+ * that a few bad rounds do not kill anything.
+ */
+#define LOWMEM_PRESSURE_WINDOW	(16 * SWAP_CLUSTER_MAX)
+
+struct lowmem_zone_pressure {
+	unsigned long scanned;
+	unsigned long reclaimed;
+	int over;		/* the last window was over the threshold */
+};
+
+/*
+ * lowmem_pressure_lock protects the reclaim windows, the number of zones
+ * whose last window was over the threshold, lowmem_pressure_start (when the
+ * current bout of memory pressure was first seen, or zero) and the kill
+ * histograms
+ */
+static DEFINE_SPINLOCK(lowmem_pressure_lock);
+static struct lowmem_zone_pressure
+	lowmem_zone_pressure[MAX_NUMNODES * MAX_NR_ZONES];
+static int lowmem_zones_over;
+static ktime_t lowmem_pressure_start;
+
+/* how far above a minfree threshold user-space hears about it, in percent */
+static int lowmem_notify_margin = 25;
+
+/*
+ * lowmem_notify_lock protects the pressure level reported to user-space
+ * and the count of its changes
+ */
+static DEFINE_SPINLOCK(lowmem_notify_lock);
+static DECLARE_WAIT_QUEUE_HEAD(lowmem_notify_wait);
+static int lowmem_notify_level;
+static int lowmem_notify_adj = OOM_ADJUST_MAX + 1;
+static unsigned long lowmem_notify_seq;
+static atomic_t lowmem_notify_users = ATOMIC_INIT(0);
+
+#define LOWMEM_HIST_BUCKETS	20
+static unsigned long lowmem_kill_latency_hist[LOWMEM_HIST_BUCKETS];
+static unsigned long lowmem_kill_size_hist[LOWMEM_HIST_BUCKETS];
+
+/*
+ * lowmem_task - a process in the index
+ * Lifecycle: From fork (or the first oom_adj write) until exit
+ * Locking: Protected by `lowmem_index_lock'
+ */
+struct lowmem_task {
+	struct hlist_node hash;		/* entry in lowmem_task_hash */
+	struct list_head bucket;	/* entry in its oom_adj bucket */
+	struct task_struct *task;	/* the thread group leader, pinned */
+	int oom_adj;			/* bucket the task is in */
+	int rss;			/* cached get_mm_rss() */
+	unsigned long rss_stamp;	/* jiffies when 'rss' was read */
+};
+
+#define LOWMEM_NR_BUCKETS	(OOM_ADJUST_MAX - OOM_DISABLE + 1)
+#define LOWMEM_HASH_BITS	8
+#define LOWMEM_RSS_TTL		(HZ / 4)
+
+static DEFINE_SPINLOCK(lowmem_index_lock);
+static struct list_head lowmem_buckets[LOWMEM_NR_BUCKETS];
+static struct hlist_head lowmem_task_hash[1 << LOWMEM_HASH_BITS];
+
+static inline struct list_head *lowmem_bucket(int oom_adj)
+{
+	oom_adj = clamp(oom_adj, OOM_DISABLE, OOM_ADJUST_MAX);
+	return &lowmem_buckets[oom_adj - OOM_DISABLE];
+}
+
+static inline struct hlist_head *lowmem_hash(struct task_struct *task)
+{
+	return &lowmem_task_hash[hash_ptr(task, LOWMEM_HASH_BITS)];
+}
+
+/*
+ * lowmem_index_find - returns the index entry of 'task', or NULL
+ *
+ * Caller must hold lowmem_index_lock.
+ */
+static struct lowmem_task *lowmem_index_find(struct task_struct *task)
+{
+	struct lowmem_task *lt;
+	struct hlist_node *node;
+
+	hlist_for_each_entry(lt, node, lowmem_hash(task), hash)
+		if (lt->task == task)
+			return lt;
+
+	return NULL;
+}
+
+/*
+ * lowmem_index_update - add 'task' to the index, or move it to the bucket of
+ * its current oom_adj. 'lt' is a free entry to use if the task is new; the
+ * return value is NULL if it was used, 'lt' otherwise.
+ *
+ * Caller must hold lowmem_index_lock.
+ */
+static struct lowmem_task *
+lowmem_index_update(struct task_struct *task, struct lowmem_task *lt)
+{
+	struct lowmem_task *old = lowmem_index_find(task);
+	int oom_adj = task->signal->oom_adj;
+
+	if (old) {
+		if (old->oom_adj != oom_adj) {
+			list_move_tail(&old->bucket, lowmem_bucket(oom_adj));
+			old->oom_adj = oom_adj;
+		}
+		return lt;
+	}
+
+	get_task_struct(task);
+	lt->task = task;
+	lt->oom_adj = oom_adj;
+	lt->rss = 0;
+	lt->rss_stamp = jiffies - LOWMEM_RSS_TTL - 1;
+	hlist_add_head(&lt->hash, lowmem_hash(task));
+	list_add_tail(&lt->bucket, lowmem_bucket(oom_adj));
+
+	return NULL;
+}
+
+static int oom_adj_notify_func(struct notifier_block *self,
+			       unsigned long event, void *data)
+{
+	struct task_struct *task = data;
+	struct lowmem_task *lt;
+
+	switch (event) {
+	case OOM_ADJ_FORK:
+		if (task->flags & PF_KTHREAD)
+			break;
+		/* fall through */
+	case OOM_ADJ_CHANGE:
+		lt = kmalloc(sizeof(*lt), GFP_KERNEL);
+		if (!lt)
+			break;
+		spin_lock(&lowmem_index_lock);
+		/* an exiting task has been, or is about to be, removed */
+		if (!(task->flags & PF_EXITING))
+			lt = lowmem_index_update(task, lt);
+		spin_unlock(&lowmem_index_lock);
+		kfree(lt);
+		break;
+	case OOM_ADJ_EXIT:
+		spin_lock(&lowmem_index_lock);
+		lt = lowmem_index_find(task);
+		if (lt) {
+			hlist_del(&lt->hash);
+			list_del(&lt->bucket);
+		}
+		spin_unlock(&lowmem_index_lock);
+		if (lt) {
+			put_task_struct(lt->task);
+			kfree(lt);
+		}
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block oom_adj_nb = {
+	.notifier_call	= oom_adj_notify_func,
+};
+
+/*
+ * lowmem_index_init - index the processes that already exist
+ *
+ * Must be called after the oom_adj notifier is registered, so that nothing
+ * forked in the meantime is missed.
+ */
+static void __init lowmem_index_init(void)
+{
+	struct task_struct *p;
+	struct lowmem_task *lt = NULL;
+	int i;
+
+	for (i = 0; i < LOWMEM_NR_BUCKETS; i++)
+		INIT_LIST_HEAD(&lowmem_buckets[i]);
+
+	read_lock(&tasklist_lock);
+	for_each_process(p) {
+		if (p->flags & PF_KTHREAD)
+			continue;
+		if (!lt)
+			lt = kmalloc(sizeof(*lt), GFP_ATOMIC);
+		if (!lt)
+			break;
+		spin_lock(&lowmem_index_lock);
+		if (!(p->flags & PF_EXITING))
+			lt = lowmem_index_update(p, lt);
+		spin_unlock(&lowmem_index_lock);
+	}
+	read_unlock(&tasklist_lock);
+	kfree(lt);
+}
+
+/*
+ * lowmem_task_rss - returns the RSS of 'lt', re-reading it if the cached
+ * value is stale
+ *
+ * Caller must hold lowmem_index_lock.
+ */
+static int lowmem_task_rss(struct lowmem_task *lt)
+{
+	struct task_struct *p = lt->task;
+
+	if (time_before(jiffies, lt->rss_stamp + LOWMEM_RSS_TTL))
+		return lt->rss;
+
+	task_lock(p);
+	lt->rss = p->mm ? get_mm_rss(p->mm) : 0;
+	task_unlock(p);
+	lt->rss_stamp = jiffies;
+
+	return lt->rss;
+}
+
 #define lowmem_print(level, x...)			\
 	do {						\
 		if (lowmem_debug_level >= (level))	\
@@ -79,17 +346,204 @@ task_notify_func(struct notifier_block *self, unsigned long val, void *data)
 	return NOTIFY_OK;
 }
 
-static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+static int lowmem_array_size(void)
 {
-	struct task_struct *p;
+	int array_size = ARRAY_SIZE(lowmem_adj);
+
+	if (lowmem_adj_size < array_size)
+		array_size = lowmem_adj_size;
+	if (lowmem_minfree_size < array_size)
+		array_size = lowmem_minfree_size;
+	return array_size;
+}
+
+static void lowmem_notify_recheck(struct work_struct *work);
+static DECLARE_DELAYED_WORK(lowmem_notify_work, lowmem_notify_recheck);
+
+/*
+ * lowmem_notify_update - work out the pressure level and wake up pollers
+ * if it changed
+ */
+static void lowmem_notify_update(void)
+{
+	int array_size = lowmem_array_size();
+	int other_free = global_page_state(NR_FREE_PAGES);
+	int other_file = global_page_state(NR_FILE_PAGES) -
+						global_page_state(NR_SHMEM);
+	int level = 0, adj = OOM_ADJUST_MAX + 1;
+	unsigned long flags;
+	struct zone *zone;
+	int i;
+
+	if (!atomic_read(&lowmem_notify_users))
+		return;
+
+	/* the thresholds are in ascending order, the largest is level 1 */
+	for (i = 0; i < array_size; i++) {
+		size_t minfree = lowmem_minfree[i] +
+			lowmem_minfree[i] * lowmem_notify_margin / 100;
+
+		if (other_free < minfree && other_file < minfree) {
+			level = array_size - i;
+			adj = lowmem_adj[i];
+			break;
+		}
+	}
+
+	for_each_populated_zone(zone) {
+		unsigned long free = zone_page_state(zone, NR_FREE_PAGES);
+
+		if (free < min_wmark_pages(zone)) {
+			level = array_size + 1;
+			if (array_size > 0)
+				adj = lowmem_adj[0];
+			break;
+		}
+		if (free < low_wmark_pages(zone) && !level) {
+			level = 1;
+			if (array_size > 0)
+				adj = lowmem_adj[array_size - 1];
+		}
+	}
+
+	spin_lock_irqsave(&lowmem_notify_lock, flags);
+	if (level != lowmem_notify_level) {
+		lowmem_notify_level = level;
+		lowmem_notify_adj = adj;
+		lowmem_notify_seq++;
+		wake_up_interruptible(&lowmem_notify_wait);
+	}
+	spin_unlock_irqrestore(&lowmem_notify_lock, flags);
+
+	/* nothing calls us while memory is plentiful, so watch it recover */
+	if (level)
+		schedule_delayed_work(&lowmem_notify_work, HZ);
+}
+
+static void lowmem_notify_recheck(struct work_struct *work)
+{
+	lowmem_notify_update();
+}
+
+/*
+ * lowmem_pressure_begin - note that memory pressure is being felt, unless
+ * it already was
+ */
+static void lowmem_pressure_begin(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_pressure_lock, flags);
+	if (!lowmem_pressure_start.tv64)
+		lowmem_pressure_start = ktime_get();
+	spin_unlock_irqrestore(&lowmem_pressure_lock, flags);
+}
+
+/*
+ * lowmem_pressure_end - forget the current bout of memory pressure, which
+ * ended without a kill, so it is not charged to a later one
+ */
+static void lowmem_pressure_end(void)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&lowmem_pressure_lock, flags);
+	lowmem_pressure_start.tv64 = 0;
+	spin_unlock_irqrestore(&lowmem_pressure_lock, flags);
+}
+
+/*
+ * lowmem_account_kill - account a kill of 'tasksize' pages in the
+ * histograms; returns the time since the pressure that led to it was first
+ * seen, in ns
+ */
+static u64 lowmem_account_kill(int tasksize)
+{
+	unsigned long flags;
+	u64 latency_ns = 0;
+	u64 usecs;
+	int bucket;
+
+	spin_lock_irqsave(&lowmem_pressure_lock, flags);
+	if (lowmem_pressure_start.tv64)
+		latency_ns = ktime_to_ns(ktime_sub(ktime_get(),
+						   lowmem_pressure_start));
+	lowmem_pressure_start.tv64 = 0;
+
+	usecs = latency_ns;
+	do_div(usecs, NSEC_PER_USEC);
+	bucket = min_t(int, fls64(usecs), LOWMEM_HIST_BUCKETS - 1);
+	lowmem_kill_latency_hist[bucket]++;
+
+	bucket = min_t(int, fls(tasksize << (PAGE_SHIFT - 10)),
+		       LOWMEM_HIST_BUCKETS - 1);
+	lowmem_kill_size_hist[bucket]++;
+	spin_unlock_irqrestore(&lowmem_pressure_lock, flags);
+
+	return latency_ns;
+}
+
+/*
+ * lowmem_kill - kill the largest process in the highest non-empty oom_adj
+ * bucket at or above 'min_adj'. Returns the size of the process killed, in
+ * pages, or zero.
+ */
+static int lowmem_kill(int min_adj, int reason)
+{
+	struct lowmem_task *lt;
 	struct task_struct *selected = NULL;
-	int rem = 0;
+	int selected_tasksize = 0;
+	int selected_oom_adj = min_adj;
 	int tasksize;
+	u64 latency_ns;
+	int i;
+
+	spin_lock(&lowmem_index_lock);
+	for (i = OOM_ADJUST_MAX; i >= min_adj && !selected; i--) {
+		list_for_each_entry(lt, lowmem_bucket(i), bucket) {
+			tasksize = lowmem_task_rss(lt);
+			if (tasksize <= 0)
+				continue;
+			if (selected && tasksize <= selected_tasksize)
+				continue;
+			selected = lt->task;
+			selected_tasksize = tasksize;
+			selected_oom_adj = i;
+			lowmem_print(2, "select %d (%s), adj %d, size %d, "
+				     "to kill\n", selected->pid, selected->comm,
+				     i, tasksize);
+		}
+	}
+	if (selected)
+		get_task_struct(selected);
+	spin_unlock(&lowmem_index_lock);
+
+	if (!selected) {
+		lowmem_pressure_end();
+		return 0;
+	}
+
+	lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
+		     selected->pid, selected->comm,
+		     selected_oom_adj, selected_tasksize);
+	lowmem_deathpending = selected;
+	lowmem_deathpending_timeout = jiffies + HZ;
+	do_send_sig_info(SIGKILL, SEND_SIG_FORCED, selected, true);
+
+	latency_ns = lowmem_account_kill(selected_tasksize);
+	trace_lowmem_kill(selected, selected_oom_adj, selected_tasksize,
+			  reason, latency_ns);
+	put_task_struct(selected);
+
+	return selected_tasksize;
+}
+
+static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
+{
+	int rem = 0;
 	int i;
 	int min_adj = OOM_ADJUST_MAX + 1;
-	int selected_tasksize = 0;
-	int selected_oom_adj;
-	int array_size = ARRAY_SIZE(lowmem_adj);
+	int array_size = lowmem_array_size();
 	int other_free = global_page_state(NR_FREE_PAGES);
 	int other_file = global_page_state(NR_FILE_PAGES) -
 						global_page_state(NR_SHMEM);
@@ -101,14 +555,12 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 	 * this pass.
 	 *
 	 */
+	lowmem_notify_update();
+
 	if (lowmem_deathpending &&
 	    time_before_eq(jiffies, lowmem_deathpending_timeout))
 		return 0;
 
-	if (lowmem_adj_size < array_size)
-		array_size = lowmem_adj_size;
-	if (lowmem_minfree_size < array_size)
-		array_size = lowmem_minfree_size;
 	for (i = 0; i < array_size; i++) {
 		if (other_free < lowmem_minfree[i] &&
 		    other_file < lowmem_minfree[i]) {
@@ -129,58 +581,227 @@ static int lowmem_shrink(struct shrinker *s, struct shrink_control *sc)
 			     sc->nr_to_scan, sc->gfp_mask, rem);
 		return rem;
 	}
-	selected_oom_adj = min_adj;
 
-	read_lock(&tasklist_lock);
-	for_each_process(p) {
-		struct mm_struct *mm;
-		struct signal_struct *sig;
-		int oom_adj;
-
-		task_lock(p);
-		mm = p->mm;
-		sig = p->signal;
-		if (!mm || !sig) {
-			task_unlock(p);
-			continue;
-		}
-		oom_adj = sig->oom_adj;
-		if (oom_adj < min_adj) {
-			task_unlock(p);
-			continue;
-		}
-		tasksize = get_mm_rss(mm);
-		task_unlock(p);
-		if (tasksize <= 0)
-			continue;
-		if (selected) {
-			if (oom_adj < selected_oom_adj)
-				continue;
-			if (oom_adj == selected_oom_adj &&
-			    tasksize <= selected_tasksize)
-				continue;
-		}
-		selected = p;
-		selected_tasksize = tasksize;
-		selected_oom_adj = oom_adj;
-		lowmem_print(2, "select %d (%s), adj %d, size %d, to kill\n",
-			     p->pid, p->comm, oom_adj, tasksize);
-	}
-	if (selected) {
-		lowmem_print(1, "send sigkill to %d (%s), adj %d, size %d\n",
-			     selected->pid, selected->comm,
-			     selected_oom_adj, selected_tasksize);
-		lowmem_deathpending = selected;
-		lowmem_deathpending_timeout = jiffies + HZ;
-		force_sig(SIGKILL, selected);
-		rem -= selected_tasksize;
-	}
+	lowmem_pressure_begin();
+	rem -= lowmem_kill(min_adj, LOWMEM_KILL_MINFREE);
+
 	lowmem_print(4, "lowmem_shrink %lu, %x, return %d\n",
 		     sc->nr_to_scan, sc->gfp_mask, rem);
-	read_unlock(&tasklist_lock);
 	return rem;
 }
 
+/*
+ * lowmem_pressure_work_func - kill a process at the highest oom_adj
+ * threshold because reclaim is not keeping up
+ */
+static void lowmem_pressure_work_func(struct work_struct *work)
+{
+	int array_size = lowmem_array_size();
+
+	if (lowmem_deathpending &&
+	    time_before_eq(jiffies, lowmem_deathpending_timeout))
+		return;
+	if (array_size <= 0)
+		return;
+
+	lowmem_kill(lowmem_adj[array_size - 1], LOWMEM_KILL_PRESSURE);
+}
+
+static DECLARE_WORK(lowmem_pressure_work, lowmem_pressure_work_func);
+
+static int reclaim_pressure_notify_func(struct notifier_block *self,
+					unsigned long val, void *data)
+{
+	struct reclaim_pressure *rp = data;
+	struct lowmem_zone_pressure *zp;
+	unsigned long scanned, reclaimed, flags;
+	int pressure, over;
+
+	lowmem_notify_update();
+
+	if (!lowmem_pressure)
+		return NOTIFY_OK;
+
+	zp = &lowmem_zone_pressure[zone_to_nid(rp->zone) * MAX_NR_ZONES +
+				   zone_idx(rp->zone)];
+
+	spin_lock_irqsave(&lowmem_pressure_lock, flags);
+	zp->scanned += rp->scanned;
+	zp->reclaimed += rp->reclaimed;
+	if (zp->scanned < LOWMEM_PRESSURE_WINDOW) {
+		spin_unlock_irqrestore(&lowmem_pressure_lock, flags);
+		return NOTIFY_OK;
+	}
+	scanned = zp->scanned;
+	reclaimed = min(zp->reclaimed, scanned);
+	zp->scanned = zp->reclaimed = 0;
+
+	pressure = (scanned - reclaimed) * 100 / scanned;
+	over = pressure >= lowmem_pressure;
+	if (over != zp->over) {
+		zp->over = over;
+		lowmem_zones_over += over ? 1 : -1;
+	}
+
+	/* the bout lasts until no zone is over the threshold any more */
+	if (over) {
+		if (!lowmem_pressure_start.tv64)
+			lowmem_pressure_start = ktime_get();
+	} else if (!lowmem_zones_over)
+		lowmem_pressure_start.tv64 = 0;
+	spin_unlock_irqrestore(&lowmem_pressure_lock, flags);
+
+	trace_lowmem_pressure(rp->zone, scanned, reclaimed, pressure);
+
+	if (over)
+		schedule_work(&lowmem_pressure_work);
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block reclaim_pressure_nb = {
+	.notifier_call	= reclaim_pressure_notify_func,
+};
+
+static void lowmem_print_hist(struct seq_file *m, const char *unit,
+			      unsigned long *hist)
+{
+	unsigned long copy[LOWMEM_HIST_BUCKETS];
+	int i;
+
+	spin_lock_irq(&lowmem_pressure_lock);
+	memcpy(copy, hist, sizeof(copy));
+	spin_unlock_irq(&lowmem_pressure_lock);
+
+	for (i = 0; i < LOWMEM_HIST_BUCKETS; i++) {
+		if (i < LOWMEM_HIST_BUCKETS - 1)
+			seq_printf(m, "< %8lu %s", 1UL << i, unit);
+		else
+			seq_printf(m, "  %8s %s", "more", unit);
+		seq_printf(m, " %lu\n", copy[i]);
+	}
+}
+
+static int lowmem_kill_latency_show(struct seq_file *m, void *unused)
+{
+	lowmem_print_hist(m, "us", lowmem_kill_latency_hist);
+	return 0;
+}
+
+static int lowmem_kill_size_show(struct seq_file *m, void *unused)
+{
+	lowmem_print_hist(m, "KB", lowmem_kill_size_hist);
+	return 0;
+}
+
+#define LOWMEM_DEBUG_ENTRY(name) \
+static int lowmem_##name##_open(struct inode *inode, struct file *file) \
+{ \
+	return single_open(file, lowmem_##name##_show, inode->i_private); \
+} \
+\
+static const struct file_operations lowmem_##name##_fops = { \
+	.owner = THIS_MODULE, \
+	.open = lowmem_##name##_open, \
+	.read = seq_read, \
+	.llseek = seq_lseek, \
+	.release = single_release, \
+}
+
+LOWMEM_DEBUG_ENTRY(kill_latency);
+LOWMEM_DEBUG_ENTRY(kill_size);
+
+static struct dentry *lowmem_debugfs_dir;
+
+static int lowmem_notify_open(struct inode *inode, struct file *file)
+{
+	unsigned long *seq;
+
+	seq = kmalloc(sizeof(*seq), GFP_KERNEL);
+	if (!seq)
+		return -ENOMEM;
+
+	/* make the first poll() report the current level */
+	spin_lock_irq(&lowmem_notify_lock);
+	*seq = lowmem_notify_seq - 1;
+	spin_unlock_irq(&lowmem_notify_lock);
+	file->private_data = seq;
+
+	atomic_inc(&lowmem_notify_users);
+	lowmem_notify_update();
+
+	return nonseekable_open(inode, file);
+}
+
+static int lowmem_notify_release(struct inode *inode, struct file *file)
+{
+	atomic_dec(&lowmem_notify_users);
+	kfree(file->private_data);
+	return 0;
+}
+
+static ssize_t lowmem_notify_read(struct file *file, char __user *buf,
+				  size_t count, loff_t *pos)
+{
+	unsigned long *seq = file->private_data;
+	char tmp[32];
+	int len;
+
+	spin_lock_irq(&lowmem_notify_lock);
+	while (*seq == lowmem_notify_seq) {
+		spin_unlock_irq(&lowmem_notify_lock);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(lowmem_notify_wait,
+				*seq != ACCESS_ONCE(lowmem_notify_seq)))
+			return -ERESTARTSYS;
+		spin_lock_irq(&lowmem_notify_lock);
+	}
+	len = snprintf(tmp, sizeof(tmp), "%d %d\n", lowmem_notify_level,
+		       lowmem_notify_adj);
+	*seq = lowmem_notify_seq;
+	spin_unlock_irq(&lowmem_notify_lock);
+
+	if (count < len)
+		return -EINVAL;
+	if (copy_to_user(buf, tmp, len))
+		return -EFAULT;
+
+	return len;
+}
+
+static unsigned int lowmem_notify_poll(struct file *file, poll_table *wait)
+{
+	unsigned long *seq = file->private_data;
+	unsigned int ret = 0;
+
+	poll_wait(file, &lowmem_notify_wait, wait);
+
+	spin_lock_irq(&lowmem_notify_lock);
+	if (*seq != lowmem_notify_seq)
+		ret |= POLLIN | POLLRDNORM;
+	if (lowmem_notify_level > lowmem_array_size())
+		ret |= POLLPRI;
+	spin_unlock_irq(&lowmem_notify_lock);
+
+	return ret;
+}
+
+static const struct file_operations lowmem_notify_fops = {
+	.owner = THIS_MODULE,
+	.open = lowmem_notify_open,
+	.release = lowmem_notify_release,
+	.read = lowmem_notify_read,
+	.poll = lowmem_notify_poll,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice lowmem_notify_misc = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "lowmem_pressure",
+	.fops = &lowmem_notify_fops,
+};
+
 static struct shrinker lowmem_shrinker = {
 	.shrink = lowmem_shrink,
 	.seeks = DEFAULT_SEEKS * 16
@@ -189,13 +810,35 @@ static struct shrinker lowmem_shrinker = {
 static int __init lowmem_init(void)
 {
 	task_free_register(&task_nb);
+	register_oom_adj_notifier(&oom_adj_nb);
+	lowmem_index_init();
 	register_shrinker(&lowmem_shrinker);
+	register_reclaim_pressure_notifier(&reclaim_pressure_nb);
+	if (misc_register(&lowmem_notify_misc))
+		printk(KERN_ERR "lowmemorykiller: failed to register "
+		       "pressure device\n");
+
+	lowmem_debugfs_dir = debugfs_create_dir("lowmemorykiller", NULL);
+	if (lowmem_debugfs_dir) {
+		debugfs_create_file("kill_latency", S_IRUGO,
+				    lowmem_debugfs_dir, NULL,
+				    &lowmem_kill_latency_fops);
+		debugfs_create_file("kill_size", S_IRUGO,
+				    lowmem_debugfs_dir, NULL,
+				    &lowmem_kill_size_fops);
+	}
 	return 0;
 }
 
 static void __exit lowmem_exit(void)
 {
+	debugfs_remove_recursive(lowmem_debugfs_dir);
+	misc_deregister(&lowmem_notify_misc);
+	cancel_delayed_work_sync(&lowmem_notify_work);
+	unregister_reclaim_pressure_notifier(&reclaim_pressure_nb);
+	cancel_work_sync(&lowmem_pressure_work);
 	unregister_shrinker(&lowmem_shrinker);
+	unregister_oom_adj_notifier(&oom_adj_nb);
 	task_free_unregister(&task_nb);
 }
 
@@ -205,9 +848,15 @@ module_param_array_named(adj, lowmem_adj, int, &lowmem_adj_size,
 module_param_array_named(minfree, lowmem_minfree, uint, &lowmem_minfree_size,
 			 S_IRUGO | S_IWUSR);
 module_param_named(debug_level, lowmem_debug_level, uint, S_IRUGO | S_IWUSR);
+module_param_named(pressure, lowmem_pressure, int, S_IRUGO | S_IWUSR);
+module_param_named(notify_margin, lowmem_notify_margin, int,
+		   S_IRUGO | S_IWUSR);
 
 module_init(lowmem_init);
 module_exit(lowmem_exit);
 
+#define CREATE_TRACE_POINTS
+#include "lowmemorykiller_trace.h"
+
 MODULE_LICENSE("GPL");
 
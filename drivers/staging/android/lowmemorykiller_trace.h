@@ -0,0 +1,82 @@
+/* lowmemorykiller_trace.h
+ *
+ * Tracepoints for the Android low memory killer
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM lowmemorykiller
+
+#if !defined(_LOWMEMORYKILLER_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _LOWMEMORYKILLER_TRACE_H
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(lowmem_pressure,
+	TP_PROTO(struct zone *zone, unsigned long scanned,
+		 unsigned long reclaimed, int pressure),
+	TP_ARGS(zone, scanned, reclaimed, pressure),
+	TP_STRUCT__entry(
+		__field(int, nid)
+		__field(int, zone_idx)
+		__field(unsigned long, scanned)
+		__field(unsigned long, reclaimed)
+		__field(int, pressure)
+	),
+	TP_fast_assign(
+		__entry->nid = zone_to_nid(zone);
+		__entry->zone_idx = zone_idx(zone);
+		__entry->scanned = scanned;
+		__entry->reclaimed = reclaimed;
+		__entry->pressure = pressure;
+	),
+	TP_printk("nid=%d zone=%d scanned=%lu reclaimed=%lu pressure=%d",
+		  __entry->nid, __entry->zone_idx, __entry->scanned,
+		  __entry->reclaimed, __entry->pressure)
+);
+
+TRACE_EVENT(lowmem_kill,
+	TP_PROTO(struct task_struct *task, int oom_adj, int tasksize,
+		 int reason, u64 latency_ns),
+	TP_ARGS(task, oom_adj, tasksize, reason, latency_ns),
+	TP_STRUCT__entry(
+		__field(pid_t, pid)
+		__array(char, comm, TASK_COMM_LEN)
+		__field(int, oom_adj)
+		__field(int, tasksize)
+		__field(int, reason)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->pid = task->pid;
+		memcpy(__entry->comm, task->comm, TASK_COMM_LEN);
+		__entry->oom_adj = oom_adj;
+		__entry->tasksize = tasksize;
+		__entry->reason = reason;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("pid=%d comm=%s adj=%d size=%d reason=%s latency_ns=%llu",
+		  __entry->pid, __entry->comm, __entry->oom_adj,
+		  __entry->tasksize,
+		  __print_symbolic(__entry->reason,
+			{ LOWMEM_KILL_MINFREE, "minfree" },
+			{ LOWMEM_KILL_PRESSURE, "pressure" }),
+		  (unsigned long long)__entry->latency_ns)
+);
+
+#endif /* _LOWMEMORYKILLER_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE lowmemorykiller_trace
+#include <trace/define_trace.h>
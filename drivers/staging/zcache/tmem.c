@@ -27,6 +27,7 @@
 #include <linux/list.h>
 #include <linux/spinlock.h>
 #include <linux/atomic.h>
+#include <linux/rcupdate.h>
 
 #include "tmem.h"
 
@@ -66,13 +67,26 @@ void tmem_register_pamops(struct tmem_pamops *m)
  * So an rb_tree is an ideal data structure to manage tmem_objs.  But because
  * of the potentially huge number of tmem_objs, each pool manages a hashtable
  * of rb_trees to reduce search, insert, delete, and rebalancing time.
- * Each hashbucket also has a lock to manage concurrent access.
+ * Each hashbucket also has a lock, which serializes inserting and erasing
+ * tmem_objs, and a sequence count bumped around those changes.
  *
- * The following routines manage tmem_objs.  When any tmem_obj is accessed,
- * the hashbucket lock must be held.
+ * Gets and flushes of a cached page look the tmem_obj up without the
+ * hashbucket lock, under RCU, and then only take the lock of the tmem_obj
+ * itself; that lock covers everything hanging off the object.  So readers
+ * of different objects never share a lock, even within one hashbucket.
+ * The lock order is hashbucket lock, then object lock.  tmem_objs are
+ * handed back to the host only an RCU grace period after being unlinked.
+ *
+ * The following routines manage tmem_objs.
+ */
+
+/*
+ * A red-black tree this deep would hold more objects than fit in memory;
+ * a lockless walk that gets there has been misled by a concurrent rotation.
  */
+#define TMEM_OBJ_FIND_MAX_DEPTH (2 * BITS_PER_LONG)
 
-/* searches for object==oid in pool, returns locked object if found */
+/* searches for object==oid in pool, hashbucket lock must be held */
 static struct tmem_obj *tmem_obj_find(struct tmem_hashbucket *hb,
 					struct tmem_oid *oidp)
 {
@@ -99,9 +113,82 @@ out:
 	return obj;
 }
 
+/*
+ * searches for object==oid without the hashbucket lock; may miss an object
+ * or return one being freed while the rbtree changes, so the caller must
+ * check the sequence count and revalidate what it found
+ */
+static struct tmem_obj *tmem_obj_find_rcu(struct tmem_hashbucket *hb,
+					struct tmem_oid *oidp)
+{
+	struct rb_node *rbnode;
+	struct tmem_obj *obj;
+	int depth = TMEM_OBJ_FIND_MAX_DEPTH;
+
+	rbnode = ACCESS_ONCE(hb->obj_rb_root.rb_node);
+	while (rbnode != NULL && depth-- > 0) {
+		obj = rb_entry(rbnode, struct tmem_obj, rb_tree_node);
+		switch (tmem_oid_compare(oidp, &obj->oid)) {
+		case 0: /* equal */
+			return obj;
+		case -1:
+			rbnode = ACCESS_ONCE(rbnode->rb_left);
+			break;
+		case 1:
+			rbnode = ACCESS_ONCE(rbnode->rb_right);
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * searches for object==oid in pool, returns locked object if found; only
+ * falls back to the hashbucket lock if the lockless walk raced with an
+ * insert or erase.  Must be called under rcu_read_lock().
+ */
+static struct tmem_obj *tmem_obj_find_lock(struct tmem_pool *pool,
+					struct tmem_hashbucket *hb,
+					struct tmem_oid *oidp)
+{
+	struct tmem_obj *obj;
+	unsigned seq;
+
+	seq = read_seqcount_begin(&hb->seq);
+	obj = tmem_obj_find_rcu(hb, oidp);
+	if (obj != NULL) {
+		spin_lock(&obj->lock);
+		/* a freed object has no pool, and is not reused until unlock */
+		if (likely(obj->pool == pool &&
+			   tmem_oid_compare(oidp, &obj->oid) == 0))
+			goto out;
+		spin_unlock(&obj->lock);
+	} else if (!read_seqcount_retry(&hb->seq, seq))
+		goto out;
+	spin_lock(&hb->lock);
+	obj = tmem_obj_find(hb, oidp);
+	if (obj != NULL)
+		spin_lock(&obj->lock);
+	spin_unlock(&hb->lock);
+out:
+	return obj;
+}
+
 static void tmem_pampd_destroy_all_in_obj(struct tmem_obj *);
 
-/* free an object that has no more pampds in it */
+/* hand a freed object back to the host once lockless lookups are done */
+static void tmem_obj_free_rcu(struct rcu_head *head)
+{
+	struct tmem_obj *obj = container_of(head, struct tmem_obj, rcu);
+
+	ASSERT_INVERTED_SENTINEL(obj, OBJ);
+	(*tmem_hostops.obj_free)(obj, NULL);
+}
+
+/*
+ * free an object that has no more pampds in it and unlink it from the
+ * rbtree; both the hashbucket lock and the object lock must be held
+ */
 static void tmem_obj_free(struct tmem_obj *obj, struct tmem_hashbucket *hb)
 {
 	struct tmem_pool *pool;
@@ -119,12 +206,44 @@ static void tmem_obj_free(struct tmem_obj *obj, struct tmem_hashbucket *hb)
 	BUG_ON(atomic_read(&pool->obj_count) < 0);
 	INVERT_SENTINEL(obj, OBJ);
 	obj->pool = NULL;
+	write_seqcount_begin(&hb->seq);
 	tmem_oid_set_invalid(&obj->oid);
 	rb_erase(&obj->rb_tree_node, &hb->obj_rb_root);
+	write_seqcount_end(&hb->seq);
 }
 
 /*
- * initialize, and insert an tmem_object_root (called only if find failed)
+ * Drop the lock of an object found or created by one of the core
+ * operations and, if that left it without pampds, free it.  The object
+ * lock has to be dropped to take the hashbucket lock first, so recheck
+ * the object is still live and empty after relocking.  Must be called
+ * under rcu_read_lock().
+ */
+static void tmem_obj_unlock(struct tmem_obj *obj, struct tmem_hashbucket *hb)
+{
+	struct tmem_pool *pool = obj->pool;
+	bool freed = false;
+
+	if (obj->pampd_count > 0) {
+		spin_unlock(&obj->lock);
+		return;
+	}
+	spin_unlock(&obj->lock);
+	spin_lock(&hb->lock);
+	spin_lock(&obj->lock);
+	if (obj->pool == pool && obj->pampd_count == 0) {
+		tmem_obj_free(obj, hb);
+		freed = true;
+	}
+	spin_unlock(&obj->lock);
+	spin_unlock(&hb->lock);
+	if (freed)
+		call_rcu(&obj->rcu, tmem_obj_free_rcu);
+}
+
+/*
+ * initialize, and insert an tmem_object_root (called only if find failed);
+ * hashbucket lock must be held, returns with the object locked
  */
 static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 					struct tmem_pool *pool,
@@ -136,6 +255,8 @@ static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 
 	BUG_ON(pool == NULL);
 	atomic_inc(&pool->obj_count);
+	spin_lock_init(&obj->lock);
+	spin_lock(&obj->lock);
 	obj->objnode_tree_height = 0;
 	obj->objnode_tree_root = NULL;
 	obj->pool = pool;
@@ -143,6 +264,8 @@ static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 	obj->objnode_count = 0;
 	obj->pampd_count = 0;
 	SET_SENTINEL(obj, OBJ);
+	/* also orders the stores above before the object becomes visible */
+	write_seqcount_begin(&hb->seq);
 	while (*new) {
 		BUG_ON(RB_EMPTY_NODE(*new));
 		this = rb_entry(*new, struct tmem_obj, rb_tree_node);
@@ -161,6 +284,7 @@ static void tmem_obj_init(struct tmem_obj *obj, struct tmem_hashbucket *hb,
 	}
 	rb_link_node(&obj->rb_tree_node, parent, new);
 	rb_insert_color(&obj->rb_tree_node, root);
+	write_seqcount_end(&hb->seq);
 }
 
 /*
@@ -186,9 +310,11 @@ static void tmem_pool_flush(struct tmem_pool *pool, bool destroy)
 		while (rbnode != NULL) {
 			obj = rb_entry(rbnode, struct tmem_obj, rb_tree_node);
 			rbnode = rb_next(rbnode);
+			spin_lock(&obj->lock);
 			tmem_pampd_destroy_all_in_obj(obj);
 			tmem_obj_free(obj, hb);
-			(*tmem_hostops.obj_free)(obj, pool);
+			spin_unlock(&obj->lock);
+			call_rcu(&obj->rcu, tmem_obj_free_rcu);
 		}
 		spin_unlock(&hb->lock);
 	}
@@ -505,7 +631,7 @@ static void tmem_pampd_destroy_all_in_obj(struct tmem_obj *obj)
 int tmem_put(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 		struct page *page)
 {
-	struct tmem_obj *obj = NULL, *objfound = NULL, *objnew = NULL;
+	struct tmem_obj *obj = NULL;
 	void *pampd = NULL, *pampd_del = NULL;
 	int ret = -ENOMEM;
 	bool ephemeral;
@@ -513,51 +639,44 @@ int tmem_put(struct tmem_pool *pool, struct tmem_oid *oidp, uint32_t index,
 
 	ephemeral = is_ephemeral(pool);
 	hb = &pool->hashbucket[tmem_oid_hash(oidp)];
-	spin_lock(&hb->lock);
-	obj = objfound = tmem_obj_find(hb, oidp);
-	if (obj != NULL) {
-		pampd = tmem_pampd_lookup_in_obj(objfound, index);
-		if (pampd != NULL) {
-			/* if found, is a dup put, flush the old one */
-			pampd_del = tmem_pampd_delete_from_obj(obj, index);
-			BUG_ON(pampd_del != pampd);
-			(*tmem_pamops.free)(pampd, pool);
-			if (obj->pampd_count == 0) {
-				objnew = obj;
-				objfound = NULL;
-			}
-			pampd = NULL;
+	rcu_read_lock();
+	obj = tmem_obj_find_lock(pool, hb, oidp);
+	if (obj == NULL) {
+		spin_lock(&hb->lock);
+		/* another put may have created it since the lockless lookup */
+		obj = tmem_obj_find(hb, oidp);
+		if (obj != NULL)
+			spin_lock(&obj->lock);
+		else {
+			obj = (*tmem_hostops.obj_alloc)(pool);
+			if (likely(obj != NULL))
+				tmem_obj_init(obj, hb, pool, oidp);
 		}
-	} else {
-		obj = objnew = (*tmem_hostops.obj_alloc)(pool);
-		if (unlikely(obj == NULL)) {
-			ret = -ENOMEM;
+		spin_unlock(&hb->lock);
+		if (unlikely(obj == NULL))
 			goto out;
-		}
-		tmem_obj_init(obj, hb, pool, oidp);
 	}
-	BUG_ON(obj == NULL);
-	BUG_ON(((objnew != obj) && (objfound != obj)) || (objnew == objfound));
+	pampd = tmem_pampd_lookup_in_obj(obj, index);
+	if (pampd != NULL) {
+		/* if found, is a dup put, flush the old one */
+		pampd_del = tmem_pampd_delete_from_obj(obj, index);
+		BUG_ON(pampd_del != pampd);
+		(*tmem_pamops.free)(pampd, pool);
+	}
 	pampd = (*tmem_pamops.create)(obj->pool, &obj->oid, index, page);
 	if (unlikely(pampd == NULL))
-		goto free;
+		goto unlock;
 	ret = tmem_pampd_add_to_obj(obj, index, pampd);
-	if (unlikely(ret == -ENOMEM))
+	if (unlikely(ret == -ENOMEM)) {
 		/* may have partially built objnode tree ("stump") */
-		goto delete_and_free;
-	goto out;
-
-delete_and_free:
-	(void)tmem_pampd_delete_from_obj(obj, index);
-free:
-	if (pampd)
+		(void)tmem_pampd_delete_from_obj(obj, index);
 		(*tmem_pamops.free)(pampd, pool);
-	if (objnew) {
-		tmem_obj_free(objnew, hb);
-		(*tmem_hostops.obj_free)(objnew, pool);
 	}
+unlock:
+	/* frees the object again if it was new or the dup was its last page */
+	tmem_obj_unlock(obj, hb);
 out:
-	spin_unlock(&hb->lock);
+	rcu_read_unlock();
 	return ret;
 }
 
@@ -571,7 +690,8 @@ out:
  * That is, if a get is done with a certain handle and fails, any
  * subsequent "get" must also fail (unless of course there is a
  * "put" done with the same handle).
-
+ * Only the lock of the matching object is taken, so gets of pages in
+ * different objects run in parallel.
  */
 int tmem_get(struct tmem_pool *pool, struct tmem_oid *oidp,
 				uint32_t index, struct page *page)
@@ -579,35 +699,30 @@ int tmem_get(struct tmem_pool *pool, struct tmem_oid *oidp,
 	struct tmem_obj *obj;
 	void *pampd;
 	bool ephemeral = is_ephemeral(pool);
-	uint32_t ret = -1;
+	int ret = -1;
 	struct tmem_hashbucket *hb;
 
 	hb = &pool->hashbucket[tmem_oid_hash(oidp)];
-	spin_lock(&hb->lock);
-	obj = tmem_obj_find(hb, oidp);
+	rcu_read_lock();
+	obj = tmem_obj_find_lock(pool, hb, oidp);
 	if (obj == NULL)
 		goto out;
-	ephemeral = is_ephemeral(pool);
 	if (ephemeral)
 		pampd = tmem_pampd_delete_from_obj(obj, index);
 	else
 		pampd = tmem_pampd_lookup_in_obj(obj, index);
 	if (pampd == NULL)
-		goto out;
+		goto unlock;
 	ret = (*tmem_pamops.get_data)(page, pampd, pool);
 	if (ret < 0)
-		goto out;
-	if (ephemeral) {
+		goto unlock;
+	if (ephemeral)
 		(*tmem_pamops.free)(pampd, pool);
-		if (obj->pampd_count == 0) {
-			tmem_obj_free(obj, hb);
-			(*tmem_hostops.obj_free)(obj, pool);
-			obj = NULL;
-		}
-	}
 	ret = 0;
+unlock:
+	tmem_obj_unlock(obj, hb);
 out:
-	spin_unlock(&hb->lock);
+	rcu_read_unlock();
 	return ret;
 }
 
@@ -625,22 +740,20 @@ int tmem_flush_page(struct tmem_pool *pool,
 	struct tmem_hashbucket *hb;
 
 	hb = &pool->hashbucket[tmem_oid_hash(oidp)];
-	spin_lock(&hb->lock);
-	obj = tmem_obj_find(hb, oidp);
+	rcu_read_lock();
+	obj = tmem_obj_find_lock(pool, hb, oidp);
 	if (obj == NULL)
 		goto out;
 	pampd = tmem_pampd_delete_from_obj(obj, index);
 	if (pampd == NULL)
-		goto out;
+		goto unlock;
 	(*tmem_pamops.free)(pampd, pool);
-	if (obj->pampd_count == 0) {
-		tmem_obj_free(obj, hb);
-		(*tmem_hostops.obj_free)(obj, pool);
-	}
 	ret = 0;
 
+unlock:
+	tmem_obj_unlock(obj, hb);
 out:
-	spin_unlock(&hb->lock);
+	rcu_read_unlock();
 	return ret;
 }
 
@@ -654,17 +767,17 @@ int tmem_flush_object(struct tmem_pool *pool, struct tmem_oid *oidp)
 	int ret = -1;
 
 	hb = &pool->hashbucket[tmem_oid_hash(oidp)];
-	spin_lock(&hb->lock);
-	obj = tmem_obj_find(hb, oidp);
+	rcu_read_lock();
+	obj = tmem_obj_find_lock(pool, hb, oidp);
 	if (obj == NULL)
 		goto out;
 	tmem_pampd_destroy_all_in_obj(obj);
-	tmem_obj_free(obj, hb);
-	(*tmem_hostops.obj_free)(obj, pool);
+	/* now empty, so this frees the object */
+	tmem_obj_unlock(obj, hb);
 	ret = 0;
 
 out:
-	spin_unlock(&hb->lock);
+	rcu_read_unlock();
 	return ret;
 }
 
@@ -700,6 +813,7 @@ void tmem_new_pool(struct tmem_pool *pool, uint32_t flags)
 	for (i = 0; i < TMEM_HASH_BUCKETS; i++, hb++) {
 		hb->obj_rb_root = RB_ROOT;
 		spin_lock_init(&hb->lock);
+		seqcount_init(&hb->seq);
 	}
 	INIT_LIST_HEAD(&pool->pool_list);
 	atomic_set(&pool->obj_count, 0);
@@ -13,6 +13,10 @@
 #include <linux/highmem.h>
 #include <linux/hash.h>
 #include <linux/atomic.h>
+#include <linux/rbtree.h>
+#include <linux/rcupdate.h>
+#include <linux/seqlock.h>
+#include <linux/spinlock.h>
 
 /*
  * These are pre-defined by the Xen<->Linux ABI
@@ -54,7 +58,9 @@
  * usually corresponds to a large independent set of pages such as
  * a filesystem.  Each pool has an id, and certain attributes and counters.
  * It also contains a set of hash buckets, each of which contains an rbtree
- * of objects and a lock to manage concurrency within the pool.
+ * of objects and a lock to manage concurrency within the pool.  The lock
+ * only serializes changes to the rbtree; lookups walk it under RCU and use
+ * the sequence count to detect that they raced with an insert or erase.
  */
 
 #define TMEM_HASH_BUCKET_BITS	8
@@ -63,6 +69,7 @@
 struct tmem_hashbucket {
 	struct rb_root obj_rb_root;
 	spinlock_t lock;
+	seqcount_t seq;
 };
 
 struct tmem_pool {
@@ -134,7 +141,10 @@ static inline unsigned tmem_oid_hash(struct tmem_oid *oidp)
  * A tmem_obj contains an identifier (oid), pointers to the parent
  * pool and the rb_tree to which it belongs, counters, and an ordered
  * set of pampds, structured in a radix-tree-like tree.  The intermediate
- * nodes of the tree are called tmem_objnodes.
+ * nodes of the tree are called tmem_objnodes.  The object lock protects
+ * the objnode tree and the pampds hanging off it; a tmem_obj is only
+ * handed back to the host an RCU grace period after it was unlinked, so a
+ * lockless lookup may always take the lock of an object it found.
  */
 
 struct tmem_objnode;
@@ -142,7 +152,9 @@ struct tmem_objnode;
 struct tmem_obj {
 	struct tmem_oid oid;
 	struct tmem_pool *pool;
+	spinlock_t lock;
 	struct rb_node rb_tree_node;
+	struct rcu_head rcu;
 	struct tmem_objnode *objnode_tree_root;
 	unsigned int objnode_tree_height;
 	unsigned long objnode_count;
@@ -173,7 +185,10 @@ struct tmem_pamops {
 };
 extern void tmem_register_pamops(struct tmem_pamops *m);
 
-/* memory allocation methods provided by the host implementation */
+/*
+ * memory allocation methods provided by the host implementation;
+ * obj_free is called from RCU callback context with a NULL pool
+ */
 struct tmem_hostops {
 	struct tmem_obj *(*obj_alloc)(struct tmem_pool *);
 	void (*obj_free)(struct tmem_obj *, struct tmem_pool *);
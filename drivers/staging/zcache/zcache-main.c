@@ -10,22 +10,26 @@
  * 1) "compression buddies" ("zbud") is used for ephemeral pages
  * 2) xvmalloc is used for persistent pages.
  * Xvmalloc (based on the TLSF allocator) has very low fragmentation
- * so maximizes space efficiency, while zbud allows pairs (and potentially,
- * in the future, more than a pair of) compressed pages to be closely linked
- * so that reclaiming can be done via the kernel's physical-page-oriented
- * "shrinker" interface.
+ * so maximizes space efficiency, while zbud allows pairs (or, with
+ * CONFIG_ZCACHE_ZBUD_MAX_BUDS and the "zbud_max_buds=" boot option, up to
+ * four) compressed pages to be closely linked so that reclaiming can be
+ * done via the kernel's physical-page-oriented "shrinker" interface.
  *
  * [1] For a definition of page-accessible memory (aka PAM), see:
  *   http://marc.info/?l=linux-mm&m=127811271605009
  */
 
 #include <linux/cpu.h>
+#include <linux/debugfs.h>
 #include <linux/highmem.h>
+#include <linux/ktime.h>
 #include <linux/list.h>
 #include <linux/lzo.h>
+#include <linux/mutex.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/workqueue.h>
 #include <linux/atomic.h>
 #include "tmem.h"
 
@@ -41,6 +45,8 @@
 #include <linux/frontswap.h>
 #endif
 
+#define MAX_POOLS_PER_CLIENT 16
+
 #if 0
 /* this is more aggressive but may cause other problems? */
 #define ZCACHE_GFP_MASK	(GFP_ATOMIC | __GFP_NORETRY | __GFP_NOWARN)
@@ -50,30 +56,42 @@
 #endif
 
 /**********
- * Compression buddies ("zbud") provides for packing two (or, possibly
- * in the future, more) compressed ephemeral pages into a single "raw"
- * (physical) page and tracking them with data structures so that
- * the raw pages can be easily reclaimed.
+ * Compression buddies ("zbud") provides for packing several compressed
+ * ephemeral pages into a single "raw" (physical) page and tracking them
+ * with data structures so that the raw pages can be easily reclaimed.
  *
- * A zbud page ("zbpg") is an aligned page containing a list_head,
- * a lock, and two "zbud headers".  The remainder of the physical
- * page is divided up into aligned 64-byte "chunks" which contain
- * the compressed data for zero, one, or two zbuds.  Each zbpg
- * resides on: (1) an "unused list" if it has no zbuds; (2) a
- * "buddied" list if it is fully populated  with two zbuds; or
- * (3) one of PAGE_SIZE/64 "unbuddied" lists indexed by how many chunks
- * the one unbuddied zbud uses.  The data inside a zbpg cannot be
- * read or written unless the zbpg's lock is held.
+ * A zbud page ("zbpg") is an aligned page containing two list_heads, a
+ * lock, and ZBUD_MAX_BUDS "zbud headers".  The remainder of the physical
+ * page is divided up into aligned 64-byte "chunks" which contain the
+ * compressed data of its zbuds, packed back to back in buddy order.
+ * At most zbud_max_buds zbuds are used per zbpg: two by default, more
+ * with the "zbud_max_buds=" boot option, which packs well-compressing
+ * pages denser at the cost of evicting more of them per raw page.  The
+ * headers for that are only built in if CONFIG_ZCACHE_ZBUD_MAX_BUDS asks
+ * for them, as they take chunks away from every zbpg.
+ *
+ * Each zbpg resides on: (1) an "unused list" if it has no zbuds; (2) a
+ * "buddied" list if it is full, i.e. holds zbud_max_buds zbuds or has no
+ * chunk left; or (3) one of PAGE_SIZE/64 "unbuddied" lists indexed by
+ * how many chunks its zbuds use.  Zbpgs holding zbuds are also on an
+ * LRU list, moved to its tail whenever a zbud is added; since gets of
+ * ephemeral pages are exclusive, that is the order in which they were
+ * last used.  The data inside a zbpg cannot be read or written unless
+ * the zbpg's lock is held.
  */
 
 #define ZBH_SENTINEL  0x43214321
 #define ZBPG_SENTINEL  0xdeadbeef
 
-#define ZBUD_MAX_BUDS 2
+#define ZBUD_MAX_BUDS CONFIG_ZCACHE_ZBUD_MAX_BUDS
+
+/* zbuds used per zbpg, at least 2 and at most ZBUD_MAX_BUDS */
+static unsigned zbud_max_buds = 2;
 
+/* oid first: no padding before it, which keeps the zbpg header small */
 struct zbud_hdr {
-	uint32_t pool_id;
 	struct tmem_oid oid;
+	uint32_t pool_id;
 	uint32_t index;
 	uint16_t size; /* compressed size in bytes, zero means unused */
 	DECL_SENTINEL
@@ -81,7 +99,10 @@ struct zbud_hdr {
 
 struct zbud_page {
 	struct list_head bud_list;
+	struct list_head lru;
 	spinlock_t lock;
+	uint16_t nbuds;		/* zbuds in use */
+	uint16_t chunks;	/* chunks used by those zbuds */
 	struct zbud_hdr buddy[ZBUD_MAX_BUDS];
 	DECL_SENTINEL
 	/* followed by NUM_CHUNK aligned CHUNK_SIZE-byte chunks */
@@ -105,7 +126,10 @@ static unsigned long zbud_cumul_chunk_counts[NCHUNKS];
 struct list_head zbud_buddied_list;
 static unsigned long zcache_zbud_buddied_count;
 
-/* protects the buddied list and all unbuddied lists */
+/* zbpgs holding zbuds, least recently filled first */
+static LIST_HEAD(zbud_lru_list);
+
+/* protects the buddied list, all unbuddied lists and the LRU list */
 static DEFINE_SPINLOCK(zbud_budlists_spinlock);
 
 static LIST_HEAD(zbpg_unused_list);
@@ -121,6 +145,13 @@ static unsigned long zcache_zbud_cumul_zpages;
 static unsigned long zcache_zbud_cumul_zbytes;
 static unsigned long zcache_compress_poor;
 
+/* ephemeral pages held and evicted, per tmem pool */
+static struct {
+	atomic_t zpages;
+	atomic_long_t zbytes;
+	atomic_long_t evicted;
+} zbud_pool_stats[MAX_POOLS_PER_CLIENT];
+
 /* forward references */
 static void *zcache_get_free_page(void);
 static void zcache_free_page(void *p);
@@ -156,6 +187,18 @@ static inline int zbud_budnum(struct zbud_hdr *zh)
 	return budnum;
 }
 
+/* bytes of data held by the zbuds of zbpg numbered first..last-1 */
+static unsigned zbud_span(struct zbud_page *zbpg, int first, int last)
+{
+	unsigned chunks = 0;
+	int i;
+
+	for (i = first; i < last; i++)
+		if (zbpg->buddy[i].size)
+			chunks += zbud_size_to_chunks(zbpg->buddy[i].size);
+	return chunks << CHUNK_SHIFT;
+}
+
 static char *zbud_data(struct zbud_hdr *zh, unsigned size)
 {
 	struct zbud_page *zbpg;
@@ -168,14 +211,41 @@ static char *zbud_data(struct zbud_hdr *zh, unsigned size)
 	zbpg = container_of(zh, struct zbud_page, buddy[budnum]);
 	ASSERT_SPINLOCK(&zbpg->lock);
 	p = (char *)zbpg;
-	if (budnum == 0)
-		p += ((sizeof(struct zbud_page) + CHUNK_SIZE - 1) &
-							CHUNK_MASK);
-	else if (budnum == 1)
-		p += PAGE_SIZE - ((size + CHUNK_SIZE - 1) & CHUNK_MASK);
+	p += ((sizeof(struct zbud_page) + CHUNK_SIZE - 1) & CHUNK_MASK);
+	p += zbud_span(zbpg, 0, budnum);
 	return p;
 }
 
+/* a full zbpg can't take another zbud, whatever its size */
+static inline bool zbud_full(struct zbud_page *zbpg)
+{
+	return zbpg->nbuds >= zbud_max_buds || zbpg->chunks >= NCHUNKS;
+}
+
+/* put zbpg on the list matching how full it is; budlists lock held */
+static void zbud_list_add(struct zbud_page *zbpg)
+{
+	if (zbud_full(zbpg)) {
+		list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
+		zcache_zbud_buddied_count++;
+	} else {
+		list_add_tail(&zbpg->bud_list,
+				&zbud_unbuddied[zbpg->chunks].list);
+		zbud_unbuddied[zbpg->chunks].count++;
+	}
+}
+
+/* must be called before nbuds or chunks change; budlists lock held */
+static void zbud_list_del(struct zbud_page *zbpg)
+{
+	BUG_ON(list_empty(&zbpg->bud_list));
+	list_del_init(&zbpg->bud_list);
+	if (zbud_full(zbpg))
+		zcache_zbud_buddied_count--;
+	else
+		zbud_unbuddied[zbpg->chunks].count--;
+}
+
 /*
  * zbud raw page management
  */
@@ -183,8 +253,8 @@ static char *zbud_data(struct zbud_hdr *zh, unsigned size)
 static struct zbud_page *zbud_alloc_raw_page(void)
 {
 	struct zbud_page *zbpg = NULL;
-	struct zbud_hdr *zh0, *zh1;
 	bool recycled = 0;
+	int i;
 
 	/* if any pages on the zbpg list, use one */
 	spin_lock(&zbpg_unused_list_spinlock);
@@ -201,20 +271,24 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 		zbpg = zcache_get_free_page();
 	if (likely(zbpg != NULL)) {
 		INIT_LIST_HEAD(&zbpg->bud_list);
-		zh0 = &zbpg->buddy[0]; zh1 = &zbpg->buddy[1];
+		INIT_LIST_HEAD(&zbpg->lru);
 		spin_lock_init(&zbpg->lock);
 		if (recycled) {
 			ASSERT_INVERTED_SENTINEL(zbpg, ZBPG);
 			SET_SENTINEL(zbpg, ZBPG);
-			BUG_ON(zh0->size != 0 || tmem_oid_valid(&zh0->oid));
-			BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
+			BUG_ON(zbpg->nbuds != 0 || zbpg->chunks != 0);
+			for (i = 0; i < ZBUD_MAX_BUDS; i++)
+				BUG_ON(zbpg->buddy[i].size != 0 ||
+					tmem_oid_valid(&zbpg->buddy[i].oid));
 		} else {
 			atomic_inc(&zcache_zbud_curr_raw_pages);
-			INIT_LIST_HEAD(&zbpg->bud_list);
 			SET_SENTINEL(zbpg, ZBPG);
-			zh0->size = 0; zh1->size = 0;
-			tmem_oid_set_invalid(&zh0->oid);
-			tmem_oid_set_invalid(&zh1->oid);
+			zbpg->nbuds = 0;
+			zbpg->chunks = 0;
+			for (i = 0; i < ZBUD_MAX_BUDS; i++) {
+				zbpg->buddy[i].size = 0;
+				tmem_oid_set_invalid(&zbpg->buddy[i].oid);
+			}
 		}
 	}
 	return zbpg;
@@ -222,13 +296,16 @@ static struct zbud_page *zbud_alloc_raw_page(void)
 
 static void zbud_free_raw_page(struct zbud_page *zbpg)
 {
-	struct zbud_hdr *zh0 = &zbpg->buddy[0], *zh1 = &zbpg->buddy[1];
+	int i;
 
 	ASSERT_SENTINEL(zbpg, ZBPG);
 	BUG_ON(!list_empty(&zbpg->bud_list));
+	BUG_ON(!list_empty(&zbpg->lru));
 	ASSERT_SPINLOCK(&zbpg->lock);
-	BUG_ON(zh0->size != 0 || tmem_oid_valid(&zh0->oid));
-	BUG_ON(zh1->size != 0 || tmem_oid_valid(&zh1->oid));
+	BUG_ON(zbpg->nbuds != 0 || zbpg->chunks != 0);
+	for (i = 0; i < ZBUD_MAX_BUDS; i++)
+		BUG_ON(zbpg->buddy[i].size != 0 ||
+			tmem_oid_valid(&zbpg->buddy[i].oid));
 	INVERT_SENTINEL(zbpg, ZBPG);
 	spin_unlock(&zbpg->lock);
 	spin_lock(&zbpg_unused_list_spinlock);
@@ -243,27 +320,34 @@ static void zbud_free_raw_page(struct zbud_page *zbpg)
 
 static unsigned zbud_free(struct zbud_hdr *zh)
 {
+	struct zbud_page *zbpg =
+		container_of(zh, struct zbud_page, buddy[zbud_budnum(zh)]);
 	unsigned size;
 
 	ASSERT_SENTINEL(zh, ZBH);
 	BUG_ON(!tmem_oid_valid(&zh->oid));
 	size = zh->size;
 	BUG_ON(zh->size == 0 || zh->size > zbud_max_buddy_size());
+	zbpg->nbuds--;
+	zbpg->chunks -= zbud_size_to_chunks(size);
 	zh->size = 0;
 	tmem_oid_set_invalid(&zh->oid);
 	INVERT_SENTINEL(zh, ZBH);
 	zcache_zbud_curr_zbytes -= size;
 	atomic_dec(&zcache_zbud_curr_zpages);
+	if (zh->pool_id < MAX_POOLS_PER_CLIENT) {
+		atomic_dec(&zbud_pool_stats[zh->pool_id].zpages);
+		atomic_long_sub(size, &zbud_pool_stats[zh->pool_id].zbytes);
+	}
 	return size;
 }
 
 static void zbud_free_and_delist(struct zbud_hdr *zh)
 {
-	unsigned chunks;
-	struct zbud_hdr *zh_other;
-	unsigned budnum = zbud_budnum(zh), size;
+	unsigned budnum = zbud_budnum(zh), gap;
 	struct zbud_page *zbpg =
 		container_of(zh, struct zbud_page, buddy[budnum]);
+	char *p;
 
 	spin_lock(&zbpg->lock);
 	if (list_empty(&zbpg->bud_list)) {
@@ -271,38 +355,34 @@ static void zbud_free_and_delist(struct zbud_hdr *zh)
 		spin_unlock(&zbpg->lock);
 		return;
 	}
-	size = zbud_free(zh);
-	ASSERT_SPINLOCK(&zbpg->lock);
-	zh_other = &zbpg->buddy[(budnum == 0) ? 1 : 0];
-	if (zh_other->size == 0) { /* was unbuddied: unlist and free */
-		chunks = zbud_size_to_chunks(size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		BUG_ON(list_empty(&zbud_unbuddied[chunks].list));
-		list_del_init(&zbpg->bud_list);
-		zbud_unbuddied[chunks].count--;
+	p = zbud_data(zh, zh->size);
+	gap = zbud_size_to_chunks(zh->size) << CHUNK_SHIFT;
+	spin_lock(&zbud_budlists_spinlock);
+	zbud_list_del(zbpg);
+	zbud_free(zh);
+	if (zbpg->nbuds == 0) { /* was the last one: unlist and free */
+		list_del_init(&zbpg->lru);
 		spin_unlock(&zbud_budlists_spinlock);
 		zbud_free_raw_page(zbpg);
-	} else { /* was buddied: move remaining buddy to unbuddied list */
-		chunks = zbud_size_to_chunks(zh_other->size) ;
-		spin_lock(&zbud_budlists_spinlock);
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
-		list_add_tail(&zbpg->bud_list, &zbud_unbuddied[chunks].list);
-		zbud_unbuddied[chunks].count++;
-		spin_unlock(&zbud_budlists_spinlock);
-		spin_unlock(&zbpg->lock);
+		return;
 	}
+	/* the remaining buddies move to the list matching the new fill */
+	zbud_list_add(zbpg);
+	spin_unlock(&zbud_budlists_spinlock);
+	/* close the gap so the free chunks stay contiguous */
+	memmove(p, p + gap, zbud_span(zbpg, budnum + 1, ZBUD_MAX_BUDS));
+	spin_unlock(&zbpg->lock);
 }
 
 static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
 					uint32_t index, struct page *page,
 					void *cdata, unsigned size)
 {
-	struct zbud_hdr *zh0, *zh1, *zh = NULL;
+	struct zbud_hdr *zh = NULL;
 	struct zbud_page *zbpg = NULL, *ztmp;
-	unsigned nchunks;
+	unsigned nchunks, budnum;
 	char *to;
-	int i, found_good_buddy = 0;
+	int i;
 
 	nchunks = zbud_size_to_chunks(size) ;
 	for (i = MAX_CHUNK - nchunks + 1; i > 0; i--) {
@@ -310,10 +390,8 @@ static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
 		if (!list_empty(&zbud_unbuddied[i].list)) {
 			list_for_each_entry_safe(zbpg, ztmp,
 				    &zbud_unbuddied[i].list, bud_list) {
-				if (spin_trylock(&zbpg->lock)) {
-					found_good_buddy = i;
+				if (spin_trylock(&zbpg->lock))
 					goto found_unbuddied;
-				}
 			}
 		}
 		spin_unlock(&zbud_budlists_spinlock);
@@ -325,38 +403,36 @@ static struct zbud_hdr *zbud_create(uint32_t pool_id, struct tmem_oid *oid,
 	/* ok, have a page, now compress the data before taking locks */
 	spin_lock(&zbpg->lock);
 	spin_lock(&zbud_budlists_spinlock);
-	list_add_tail(&zbpg->bud_list, &zbud_unbuddied[nchunks].list);
-	zbud_unbuddied[nchunks].count++;
-	zh = &zbpg->buddy[0];
 	goto init_zh;
 
 found_unbuddied:
 	ASSERT_SPINLOCK(&zbpg->lock);
-	zh0 = &zbpg->buddy[0]; zh1 = &zbpg->buddy[1];
-	BUG_ON(!((zh0->size == 0) ^ (zh1->size == 0)));
-	if (zh0->size != 0) { /* buddy0 in use, buddy1 is vacant */
-		ASSERT_SENTINEL(zh0, ZBH);
-		zh = zh1;
-	} else if (zh1->size != 0) { /* buddy1 in use, buddy0 is vacant */
-		ASSERT_SENTINEL(zh1, ZBH);
-		zh = zh0;
-	} else
-		BUG();
-	list_del_init(&zbpg->bud_list);
-	zbud_unbuddied[found_good_buddy].count--;
-	list_add_tail(&zbpg->bud_list, &zbud_buddied_list);
-	zcache_zbud_buddied_count++;
+	BUG_ON(zbud_full(zbpg));
+	zbud_list_del(zbpg);
+	list_del_init(&zbpg->lru);
 
 init_zh:
+	for (budnum = 0; budnum < ZBUD_MAX_BUDS; budnum++)
+		if (zbpg->buddy[budnum].size == 0)
+			break;
+	BUG_ON(budnum >= zbud_max_buds);
+	zh = &zbpg->buddy[budnum];
 	SET_SENTINEL(zh, ZBH);
 	zh->size = size;
 	zh->index = index;
 	zh->oid = *oid;
 	zh->pool_id = pool_id;
+	zbpg->nbuds++;
+	zbpg->chunks += nchunks;
+	zbud_list_add(zbpg);
+	list_add_tail(&zbpg->lru, &zbud_lru_list);
 	/* can wait to copy the data until the list locks are dropped */
 	spin_unlock(&zbud_budlists_spinlock);
 
+	/* make room between the buddies before and after this one */
 	to = zbud_data(zh, size);
+	memmove(to + (nchunks << CHUNK_SHIFT), to,
+		zbud_span(zbpg, budnum + 1, ZBUD_MAX_BUDS));
 	memcpy(to, cdata, size);
 	spin_unlock(&zbpg->lock);
 	zbud_cumul_chunk_counts[nchunks]++;
@@ -364,6 +440,10 @@ init_zh:
 	zcache_zbud_cumul_zpages++;
 	zcache_zbud_curr_zbytes += size;
 	zcache_zbud_cumul_zbytes += size;
+	if (pool_id < MAX_POOLS_PER_CLIENT) {
+		atomic_inc(&zbud_pool_stats[pool_id].zpages);
+		atomic_long_add(size, &zbud_pool_stats[pool_id].zbytes);
+	}
 out:
 	return zh;
 }
@@ -400,7 +480,7 @@ out:
 
 /*
  * The following routines handle shrinking of ephemeral pages by evicting
- * pages "least valuable" first.
+ * the least recently used zbpgs first.
  */
 
 static unsigned long zcache_evicted_raw_pages;
@@ -423,6 +503,7 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 
 	ASSERT_SPINLOCK(&zbpg->lock);
 	BUG_ON(!list_empty(&zbpg->bud_list));
+	BUG_ON(!list_empty(&zbpg->lru));
 	for (i = 0, j = 0; i < ZBUD_MAX_BUDS; i++) {
 		zh = &zbpg->buddy[i];
 		if (zh->size) {
@@ -435,6 +516,8 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 	}
 	spin_unlock(&zbpg->lock);
 	for (i = 0; i < j; i++) {
+		if (pool_id[i] < MAX_POOLS_PER_CLIENT)
+			atomic_long_inc(&zbud_pool_stats[pool_id[i]].evicted);
 		pool = zcache_get_pool_by_id(pool_id[i]);
 		if (pool != NULL) {
 			tmem_flush_page(pool, &oid[i], index[i]);
@@ -457,7 +540,6 @@ static void zbud_evict_zbpg(struct zbud_page *zbpg)
 static void zbud_evict_pages(int nr)
 {
 	struct zbud_page *zbpg;
-	int i;
 
 	/* first try freeing any pages on unused list */
 retry_unused_list:
@@ -478,57 +560,34 @@ retry_unused_list:
 	}
 	spin_unlock_bh(&zbpg_unused_list_spinlock);
 
-	/* now try freeing unbuddied pages, starting with least space avail */
-	for (i = 0; i < MAX_CHUNK; i++) {
-retry_unbud_list_i:
-		spin_lock_bh(&zbud_budlists_spinlock);
-		if (list_empty(&zbud_unbuddied[i].list)) {
-			spin_unlock_bh(&zbud_budlists_spinlock);
-			continue;
-		}
-		list_for_each_entry(zbpg, &zbud_unbuddied[i].list, bud_list) {
-			if (unlikely(!spin_trylock(&zbpg->lock)))
-				continue;
-			list_del_init(&zbpg->bud_list);
-			zbud_unbuddied[i].count--;
-			spin_unlock(&zbud_budlists_spinlock);
-			zcache_evicted_unbuddied_pages++;
-			/* want budlists unlocked when doing zbpg eviction */
-			zbud_evict_zbpg(zbpg);
-			local_bh_enable();
-			if (--nr <= 0)
-				goto out;
-			goto retry_unbud_list_i;
-		}
-		spin_unlock_bh(&zbud_budlists_spinlock);
-	}
-
-	/* as a last resort, free buddied pages */
-retry_bud_list:
+	/* then free the zbpgs that were filled longest ago */
+retry_lru_list:
 	spin_lock_bh(&zbud_budlists_spinlock);
-	if (list_empty(&zbud_buddied_list)) {
-		spin_unlock_bh(&zbud_budlists_spinlock);
-		goto out;
-	}
-	list_for_each_entry(zbpg, &zbud_buddied_list, bud_list) {
+	list_for_each_entry(zbpg, &zbud_lru_list, lru) {
 		if (unlikely(!spin_trylock(&zbpg->lock)))
 			continue;
-		list_del_init(&zbpg->bud_list);
-		zcache_zbud_buddied_count--;
+		if (zbud_full(zbpg))
+			zcache_evicted_buddied_pages++;
+		else
+			zcache_evicted_unbuddied_pages++;
+		zbud_list_del(zbpg);
+		list_del_init(&zbpg->lru);
 		spin_unlock(&zbud_budlists_spinlock);
-		zcache_evicted_buddied_pages++;
 		/* want budlists unlocked when doing zbpg eviction */
 		zbud_evict_zbpg(zbpg);
 		local_bh_enable();
 		if (--nr <= 0)
 			goto out;
-		goto retry_bud_list;
+		goto retry_lru_list;
 	}
 	spin_unlock_bh(&zbud_budlists_spinlock);
 out:
 	return;
 }
 
+/* set once the zbud lists are set up, i.e. ephemeral pools can be used */
+static bool zbud_enabled;
+
 static void zbud_init(void)
 {
 	int i;
@@ -539,6 +598,7 @@ static void zbud_init(void)
 		INIT_LIST_HEAD(&zbud_unbuddied[i].list);
 		zbud_unbuddied[i].count = 0;
 	}
+	zbud_enabled = true;
 }
 
 #ifdef CONFIG_SYSFS
@@ -582,6 +642,24 @@ static int zbud_show_cumul_chunk_counts(char *buf)
 		chunks == 0 ? 0 : sum_total_chunks / chunks);
 	return p - buf;
 }
+
+/* one line per pool holding ephemeral pages: id, zpages, zbytes, evicted */
+static int zbud_show_pool_stats(char *buf)
+{
+	char *p = buf;
+	int i;
+
+	for (i = 0; i < MAX_POOLS_PER_CLIENT; i++) {
+		if (!atomic_read(&zbud_pool_stats[i].zpages) &&
+		    !atomic_long_read(&zbud_pool_stats[i].evicted))
+			continue;
+		p += sprintf(p, "%d %d %ld %ld\n", i,
+			atomic_read(&zbud_pool_stats[i].zpages),
+			atomic_long_read(&zbud_pool_stats[i].zbytes),
+			atomic_long_read(&zbud_pool_stats[i].evicted));
+	}
+	return p - buf;
+}
 #endif
 
 /**********
@@ -677,8 +755,6 @@ static unsigned long zcache_flobj_found;
 static unsigned long zcache_failed_eph_puts;
 static unsigned long zcache_failed_pers_puts;
 
-#define MAX_POOLS_PER_CLIENT 16
-
 static struct {
 	struct tmem_pool *tmem_pools[MAX_POOLS_PER_CLIENT];
 	struct xv_pool *xvpool;
@@ -1066,7 +1142,164 @@ static struct notifier_block zcache_cpu_notifier_block = {
 	.notifier_call = zcache_cpu_notifier
 };
 
+#ifdef CONFIG_ZCACHE_GET_BENCH
+/*
+ * Microbenchmark of the get path, run by writing an iteration count to
+ * <debugfs>/zcache/get_bench.  Every online cpu puts and gets back that
+ * many pages of its own object in a scratch ephemeral pool at the same
+ * time, so gets on different cpus contend exactly as cleancache get_page
+ * hits on different files do.  Only the gets are timed, and only those of
+ * pages whose put went through; the puts are serialized so that they do
+ * not fail on each other in zcache_do_preload().  Reading the file shows
+ * "cpus gets hits ns_per_get" of the last run.
+ */
+#define ZCACHE_BENCH_MAX_ITERS	(1UL << 20)
+
+static int zcache_put_page(int, struct tmem_oid *, uint32_t, struct page *);
+static int zcache_get_page(int, struct tmem_oid *, uint32_t, struct page *);
+static int zcache_flush_object(int, struct tmem_oid *);
+static int zcache_new_pool(uint32_t);
+static int zcache_destroy_pool(int);
+
+struct zcache_bench {
+	unsigned long gets;
+	unsigned long hits;
+	u64 ns;
+};
+static DEFINE_PER_CPU(struct zcache_bench, zcache_bench);
+static DEFINE_MUTEX(zcache_bench_mutex);
+static DEFINE_SPINLOCK(zcache_bench_put_lock);
+static int zcache_bench_pool_id;
+static unsigned long zcache_bench_iters;
+static unsigned long zcache_bench_cpus;
+static unsigned long zcache_bench_gets;
+static unsigned long zcache_bench_hits;
+static unsigned long zcache_bench_ns_per_get;
+
+static void zcache_bench_cpu(struct work_struct *work)
+{
+	int cpu = raw_smp_processor_id();
+	struct zcache_bench *zb = &per_cpu(zcache_bench, cpu);
+	struct tmem_oid oid = { .oid = { cpu } };
+	unsigned long i, flags, gets = 0, hits = 0;
+	struct page *page;
+	unsigned long *va;
+	ktime_t start;
+	u64 ns = 0;
+	int ret;
+
+	page = alloc_page(GFP_KERNEL);
+	if (page == NULL)
+		return;
+	va = kmap(page);
+	for (i = 0; i < PAGE_SIZE / sizeof(*va); i++)
+		va[i] = i & 0xff;
+	kunmap(page);
+	/* index 0 stays put so the object is not freed after every get */
+	for (i = 0; i <= zcache_bench_iters; i++) {
+		spin_lock_irqsave(&zcache_bench_put_lock, flags);
+		ret = zcache_put_page(zcache_bench_pool_id, &oid, i, page);
+		spin_unlock_irqrestore(&zcache_bench_put_lock, flags);
+		if (i == 0 || ret < 0)
+			continue;
+		gets++;
+		start = ktime_get();
+		if (zcache_get_page(zcache_bench_pool_id, &oid, i, page) == 0)
+			hits++;
+		ns += ktime_to_ns(ktime_sub(ktime_get(), start));
+		cond_resched();
+	}
+	zcache_flush_object(zcache_bench_pool_id, &oid);
+	__free_page(page);
+	zb->gets = gets;
+	zb->hits = hits;
+	zb->ns = ns;
+}
+
+static ssize_t zcache_get_bench_read(struct file *file, char __user *ubuf,
+				size_t count, loff_t *ppos)
+{
+	char buf[96];
+	int len;
+
+	len = snprintf(buf, sizeof(buf), "%lu %lu %lu %lu\n",
+			zcache_bench_cpus, zcache_bench_gets,
+			zcache_bench_hits, zcache_bench_ns_per_get);
+	return simple_read_from_buffer(ubuf, count, ppos, buf, len);
+}
+
+static ssize_t zcache_get_bench_write(struct file *file,
+				const char __user *ubuf, size_t count,
+				loff_t *ppos)
+{
+	struct zcache_bench *zb;
+	unsigned long iters;
+	char buf[16];
+	u64 ns = 0;
+	int cpu, ret;
+
+	if (count >= sizeof(buf))
+		return -EINVAL;
+	if (copy_from_user(buf, ubuf, count))
+		return -EFAULT;
+	buf[count] = '\0';
+	ret = strict_strtoul(buf, 10, &iters);
+	if (ret || iters == 0 || iters > ZCACHE_BENCH_MAX_ITERS)
+		return -EINVAL;
+	if (!zbud_enabled)
+		return -ENODEV;
+	mutex_lock(&zcache_bench_mutex);
+	zcache_bench_pool_id = zcache_new_pool(0);
+	if (zcache_bench_pool_id < 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+	for_each_possible_cpu(cpu)
+		memset(&per_cpu(zcache_bench, cpu), 0, sizeof(*zb));
+	zcache_bench_iters = iters;
+	ret = schedule_on_each_cpu(zcache_bench_cpu);
+	zcache_destroy_pool(zcache_bench_pool_id);
+	if (ret)
+		goto out;
+	zcache_bench_cpus = zcache_bench_gets = zcache_bench_hits = 0;
+	for_each_possible_cpu(cpu) {
+		zb = &per_cpu(zcache_bench, cpu);
+		if (zb->gets == 0)
+			continue;
+		zcache_bench_cpus++;
+		zcache_bench_gets += zb->gets;
+		zcache_bench_hits += zb->hits;
+		ns += zb->ns;
+	}
+	zcache_bench_ns_per_get = zcache_bench_gets ?
+		div64_u64(ns, zcache_bench_gets) : 0;
+	ret = count;
+out:
+	mutex_unlock(&zcache_bench_mutex);
+	return ret;
+}
+
+static const struct file_operations zcache_get_bench_fops = {
+	.owner = THIS_MODULE,
+	.read = zcache_get_bench_read,
+	.write = zcache_get_bench_write,
+	.llseek = default_llseek,
+};
+
+static struct dentry *zcache_debugfs_root;
+
+static void __init zcache_get_bench_init(void)
+{
+	zcache_debugfs_root = debugfs_create_dir("zcache", NULL);
+	if (zcache_debugfs_root == NULL ||
+	    debugfs_create_file("get_bench", 0644, zcache_debugfs_root, NULL,
+				&zcache_get_bench_fops) == NULL)
+		pr_err("zcache: can't create debugfs get_bench\n");
+}
+#endif /* CONFIG_ZCACHE_GET_BENCH */
+
 #ifdef CONFIG_SYSFS
+
 #define ZCACHE_SYSFS_RO(_name) \
 	static ssize_t zcache_##_name##_show(struct kobject *kobj, \
 				struct kobj_attribute *attr, char *buf) \
@@ -1130,6 +1363,7 @@ ZCACHE_SYSFS_RO_CUSTOM(zbud_unbuddied_list_counts,
 			zbud_show_unbuddied_list_counts);
 ZCACHE_SYSFS_RO_CUSTOM(zbud_cumul_chunk_counts,
 			zbud_show_cumul_chunk_counts);
+ZCACHE_SYSFS_RO_CUSTOM(zbud_pool_stats, zbud_show_pool_stats);
 
 static struct attribute *zcache_attrs[] = {
 	&zcache_curr_obj_count_attr.attr,
@@ -1160,6 +1394,7 @@ static struct attribute *zcache_attrs[] = {
 	&zcache_aborted_shrink_attr.attr,
 	&zcache_zbud_unbuddied_list_counts_attr.attr,
 	&zcache_zbud_cumul_chunk_counts_attr.attr,
+	&zcache_zbud_pool_stats_attr.attr,
 	NULL,
 };
 
@@ -1319,6 +1554,12 @@ static int zcache_destroy_pool(int pool_id)
 	local_bh_disable();
 	ret = tmem_destroy_pool(pool);
 	local_bh_enable();
+	/*
+	 * Lockless lookups may still be looking at objects of this pool that
+	 * wait for call_rcu() to free them; the pool must outlive those, or
+	 * a new pool allocated at the same address could match obj->pool.
+	 */
+	rcu_barrier();
 	kfree(pool);
 	pr_info("zcache: destroyed pool id=%d\n", pool_id);
 out:
@@ -1592,6 +1833,18 @@ static int __init no_frontswap(char *s)
 
 __setup("nofrontswap", no_frontswap);
 
+/* pack up to this many compressed ephemeral pages per page */
+static int __init set_zbud_max_buds(char *s)
+{
+	int n;
+
+	if (get_option(&s, &n) && n >= 2 && n <= ZBUD_MAX_BUDS)
+		zbud_max_buds = n;
+	return 1;
+}
+
+__setup("zbud_max_buds=", set_zbud_max_buds);
+
 static int __init zcache_init(void)
 {
 #ifdef CONFIG_SYSFS
@@ -1603,6 +1856,9 @@ static int __init zcache_init(void)
 		goto out;
 	}
 #endif /* CONFIG_SYSFS */
+#ifdef CONFIG_ZCACHE_GET_BENCH
+	zcache_get_bench_init();
+#endif
 #if defined(CONFIG_CLEANCACHE) || defined(CONFIG_FRONTSWAP)
 	if (zcache_enabled) {
 		unsigned int cpu;
@@ -1633,7 +1889,8 @@ static int __init zcache_init(void)
 		register_shrinker(&zcache_shrinker);
 		old_ops = zcache_cleancache_register_ops();
 		pr_info("zcache: cleancache enabled using kernel "
-			"transcendent memory and compression buddies\n");
+			"transcendent memory and compression buddies "
+			"(%u per page)\n", zbud_max_buds);
 		if (old_ops.init_fs != NULL)
 			pr_warning("zcache: cleancache_ops overridden");
 	}
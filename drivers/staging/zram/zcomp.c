@@ -0,0 +1,219 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/err.h>
+#include <linux/gfp.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zcomp.h"
+
+/* Compression algorithms zram knows to work with PAGE_SIZE inputs */
+static const char * const backends[] = {
+	"lzo",
+	"deflate",
+	NULL
+};
+
+static void zcomp_strm_free(struct zcomp_strm *zstrm)
+{
+	if (!IS_ERR_OR_NULL(zstrm->tfm))
+		crypto_free_comp(zstrm->tfm);
+	free_pages((unsigned long)zstrm->buffer, 1);
+	kfree(zstrm);
+}
+
+static struct zcomp_strm *zcomp_strm_alloc(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	zstrm = kzalloc(sizeof(*zstrm), GFP_KERNEL);
+	if (!zstrm)
+		return NULL;
+
+	zstrm->tfm = crypto_alloc_comp(comp->name, 0, 0);
+	zstrm->buffer = (void *)__get_free_pages(GFP_KERNEL | __GFP_ZERO, 1);
+	if (IS_ERR(zstrm->tfm) || !zstrm->buffer) {
+		zcomp_strm_free(zstrm);
+		return NULL;
+	}
+
+	return zstrm;
+}
+
+ssize_t zcomp_available_show(const char *comp, char *buf)
+{
+	ssize_t sz = 0;
+	int i;
+
+	for (i = 0; backends[i]; i++) {
+		if (!crypto_has_comp(backends[i], 0, 0))
+			continue;
+
+		if (!strcmp(comp, backends[i]))
+			sz += sprintf(buf + sz, "[%s] ", backends[i]);
+		else
+			sz += sprintf(buf + sz, "%s ", backends[i]);
+	}
+
+	if (sz)
+		buf[sz - 1] = '\n';
+	return sz;
+}
+
+int zcomp_available_algorithm(const char *comp)
+{
+	int i;
+
+	for (i = 0; backends[i]; i++)
+		if (!strcmp(comp, backends[i]))
+			return crypto_has_comp(comp, 0, 0);
+
+	return 0;
+}
+
+/* Get an idle stream, sleeping until another user releases one */
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm;
+
+	for (;;) {
+		spin_lock(&comp->strm_lock);
+		if (!list_empty(&comp->idle_strm)) {
+			zstrm = list_first_entry(&comp->idle_strm,
+					struct zcomp_strm, list);
+			list_del(&zstrm->list);
+			spin_unlock(&comp->strm_lock);
+			return zstrm;
+		}
+		spin_unlock(&comp->strm_lock);
+
+		wait_event(comp->strm_wait, !list_empty(&comp->idle_strm));
+	}
+}
+
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm)
+{
+	spin_lock(&comp->strm_lock);
+	if (comp->avail_strm <= comp->max_strm) {
+		list_add(&zstrm->list, &comp->idle_strm);
+		spin_unlock(&comp->strm_lock);
+		wake_up(&comp->strm_wait);
+		return;
+	}
+
+	/* max_strm was lowered while this stream was in use */
+	comp->avail_strm--;
+	spin_unlock(&comp->strm_lock);
+	zcomp_strm_free(zstrm);
+}
+
+/*
+ * Grow or shrink the pool. Streams in use when shrinking are freed as
+ * they are released. Returns -ENOMEM if not all new streams could be
+ * allocated; the ones that were stay in the pool.
+ */
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm)
+{
+	struct zcomp_strm *zstrm, *tmp;
+	LIST_HEAD(free_list);
+	int ret = 0;
+
+	spin_lock(&comp->strm_lock);
+	comp->max_strm = num_strm;
+	while (comp->avail_strm > num_strm &&
+	       !list_empty(&comp->idle_strm)) {
+		zstrm = list_first_entry(&comp->idle_strm,
+				struct zcomp_strm, list);
+		list_move(&zstrm->list, &free_list);
+		comp->avail_strm--;
+	}
+
+	while (comp->avail_strm < comp->max_strm) {
+		comp->avail_strm++;
+		spin_unlock(&comp->strm_lock);
+
+		zstrm = zcomp_strm_alloc(comp);
+
+		spin_lock(&comp->strm_lock);
+		if (!zstrm) {
+			comp->avail_strm--;
+			ret = -ENOMEM;
+			break;
+		}
+		list_add(&zstrm->list, &comp->idle_strm);
+	}
+	spin_unlock(&comp->strm_lock);
+	wake_up_all(&comp->strm_wait);
+
+	list_for_each_entry_safe(zstrm, tmp, &free_list, list)
+		zcomp_strm_free(zstrm);
+
+	return ret;
+}
+
+/* Compress one page into zstrm->buffer */
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len)
+{
+	int ret;
+	unsigned int dlen = PAGE_SIZE * 2;
+
+	ret = crypto_comp_compress(zstrm->tfm, src, PAGE_SIZE,
+				zstrm->buffer, &dlen);
+	*dst_len = dlen;
+
+	return ret;
+}
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst)
+{
+	unsigned int dlen = PAGE_SIZE;
+
+	return crypto_comp_decompress(zstrm->tfm, src, src_len, dst, &dlen);
+}
+
+struct zcomp *zcomp_create(const char *compress, int max_strm)
+{
+	struct zcomp *comp;
+
+	if (!zcomp_available_algorithm(compress))
+		return NULL;
+
+	comp = kzalloc(sizeof(*comp), GFP_KERNEL);
+	if (!comp)
+		return NULL;
+
+	spin_lock_init(&comp->strm_lock);
+	INIT_LIST_HEAD(&comp->idle_strm);
+	init_waitqueue_head(&comp->strm_wait);
+	strlcpy(comp->name, compress, sizeof(comp->name));
+
+	/* Settle for fewer streams, but not for none */
+	zcomp_set_max_streams(comp, max_strm);
+	if (!comp->avail_strm) {
+		kfree(comp);
+		return NULL;
+	}
+
+	return comp;
+}
+
+void zcomp_destroy(struct zcomp *comp)
+{
+	struct zcomp_strm *zstrm, *tmp;
+
+	list_for_each_entry_safe(zstrm, tmp, &comp->idle_strm, list)
+		zcomp_strm_free(zstrm);
+	kfree(comp);
+}
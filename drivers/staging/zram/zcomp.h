@@ -0,0 +1,58 @@
+/*
+ * Compression streams for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/crypto.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+/* State of one compression or decompression in flight */
+struct zcomp_strm {
+	/* crypto API transforms keep per-call state, so one per stream */
+	struct crypto_comp *tfm;
+	/* compressed output; two pages since the input may expand */
+	void *buffer;
+	struct list_head list;
+};
+
+/*
+ * A pool of max_strm compression streams for one backend. Streams are
+ * allocated up front, since the crypto API cannot allocate them from
+ * the I/O path; users wait for an idle one.
+ */
+struct zcomp {
+	spinlock_t strm_lock;
+	struct list_head idle_strm;
+	wait_queue_head_t strm_wait;
+	int avail_strm;		/* streams allocated */
+	int max_strm;
+	char name[CRYPTO_MAX_ALG_NAME];
+};
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+int zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp, int max_strm);
+void zcomp_destroy(struct zcomp *comp);
+int zcomp_set_max_streams(struct zcomp *comp, int num_strm);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+/* Both return 0 on success */
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * Compressed RAM block device: same page deduplication
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/jhash.h>
+#include <linux/log2.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "zram_drv.h"
+
+/* Average number of stored pages per hash bucket */
+#define ZRAM_DEDUP_BUCKET_PAGES	8
+
+int zram_dedup_init(struct zram *zram, size_t num_pages)
+{
+	size_t i;
+
+	zram->hash_size = roundup_pow_of_two(
+			max_t(size_t, num_pages / ZRAM_DEDUP_BUCKET_PAGES, 1));
+	zram->hash = vzalloc(zram->hash_size * sizeof(*zram->hash));
+	if (!zram->hash)
+		return -ENOMEM;
+
+	for (i = 0; i < zram->hash_size; i++) {
+		spin_lock_init(&zram->hash[i].lock);
+		INIT_HLIST_HEAD(&zram->hash[i].head);
+	}
+
+	return 0;
+}
+
+void zram_dedup_fini(struct zram *zram)
+{
+	vfree(zram->hash);
+	zram->hash = NULL;
+	zram->hash_size = 0;
+}
+
+/* Checksum of compressed data: much shorter than the page it came from */
+u32 zram_dedup_checksum(const void *cmem, size_t len)
+{
+	return jhash(cmem, len, 0);
+}
+
+static struct zram_hash *zram_dedup_bucket(struct zram *zram, u32 checksum)
+{
+	return &zram->hash[checksum & (zram->hash_size - 1)];
+}
+
+/*
+ * Look for an object with the same compressed data. On success a
+ * reference is taken on the returned entry.
+ */
+struct zram_entry *zram_dedup_find(struct zram *zram, const void *cmem,
+				size_t len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct zram_entry *entry, *found = NULL;
+	struct hlist_node *pos;
+	void *obj;
+	int match;
+
+	spin_lock(&hash->lock);
+	hlist_for_each_entry(entry, pos, &hash->head, node) {
+		if (entry->checksum != checksum || entry->len != len)
+			continue;
+
+		obj = zs_map_object(zram->mem_pool, entry->handle, ZS_MM_RO);
+		match = !memcmp(obj, cmem, len);
+		zs_unmap_object(zram->mem_pool, entry->handle);
+
+		if (match) {
+			entry->refcount++;
+			found = entry;
+			break;
+		}
+	}
+	spin_unlock(&hash->lock);
+
+	return found;
+}
+
+/* Wrap a freshly stored object and make it findable */
+struct zram_entry *zram_dedup_new(struct zram *zram, unsigned long handle,
+				size_t len, u32 checksum)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, checksum);
+	struct zram_entry *entry;
+
+	entry = kmalloc(sizeof(*entry), GFP_NOIO);
+	if (!entry)
+		return NULL;
+
+	entry->checksum = checksum;
+	entry->refcount = 1;
+	entry->len = len;
+	entry->handle = handle;
+
+	spin_lock(&hash->lock);
+	hlist_add_head(&entry->node, &hash->head);
+	spin_unlock(&hash->lock);
+
+	return entry;
+}
+
+/* Drop a reference. Returns 1 if the object itself was freed. */
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry)
+{
+	struct zram_hash *hash = zram_dedup_bucket(zram, entry->checksum);
+	int last;
+
+	spin_lock(&hash->lock);
+	last = !--entry->refcount;
+	if (last)
+		hlist_del(&entry->node);
+	spin_unlock(&hash->lock);
+
+	if (!last)
+		return 0;
+
+	zs_free(zram->mem_pool, entry->handle);
+	kfree(entry);
+	return 1;
+}
@@ -0,0 +1,48 @@
+/*
+ * Compressed RAM block device: same page deduplication
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZRAM_DEDUP_H_
+#define _ZRAM_DEDUP_H_
+
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+struct zram;
+
+/*
+ * With deduplication enabled, table entries of compressed pages point
+ * to one of these instead of holding the zsmalloc handle directly, so
+ * that pages with identical compressed data share one object.
+ */
+struct zram_entry {
+	struct hlist_node node;
+	u32 checksum;
+	int refcount;		/* table entries using the object */
+	unsigned int len;	/* compressed size */
+	unsigned long handle;	/* zsmalloc handle */
+};
+
+struct zram_hash {
+	spinlock_t lock;
+	struct hlist_head head;
+};
+
+int zram_dedup_init(struct zram *zram, size_t num_pages);
+void zram_dedup_fini(struct zram *zram);
+
+u32 zram_dedup_checksum(const void *cmem, size_t len);
+struct zram_entry *zram_dedup_find(struct zram *zram, const void *cmem,
+				size_t len, u32 checksum);
+struct zram_entry *zram_dedup_new(struct zram *zram, unsigned long handle,
+				size_t len, u32 checksum);
+int zram_dedup_put(struct zram *zram, struct zram_entry *entry);
+
+#endif
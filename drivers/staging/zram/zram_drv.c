@@ -23,15 +23,19 @@
 #include <linux/kernel.h>
 #include <linux/bio.h>
 #include <linux/bitops.h>
+#include <linux/bit_spinlock.h>
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
 #include <linux/device.h>
+#include <linux/fs.h>
 #include <linux/genhd.h>
 #include <linux/highmem.h>
+#include <linux/ktime.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
+#include <linux/workqueue.h>
 
 #include "zram_drv.h"
 
@@ -39,20 +43,23 @@
 static int zram_major;
 struct zram *devices;
 
+/* Compression backend used unless comp_algorithm is set */
+static const char *default_compressor = "lzo";
+
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
-static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
+void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
 {
 	spin_lock(&zram->stat64_lock);
 	*v = *v + inc;
@@ -71,22 +78,48 @@ static void zram_stat64_inc(struct zram *zram, u64 *v)
 	zram_stat64_add(zram, v, 1);
 }
 
+/*
+ * Table entries are protected by a bit spinlock in their own flags, so
+ * I/O to different pages never contends on a device-wide lock.
+ */
+static void zram_lock_table(struct zram *zram, u32 index)
+{
+	bit_spin_lock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
+static void zram_unlock_table(struct zram *zram, u32 index)
+{
+	bit_spin_unlock(ZRAM_ACCESS, &zram->table[index].value);
+}
+
 static int zram_test_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	return zram->table[index].flags & BIT(flag);
+	return zram->table[index].value & BIT(flag);
 }
 
 static void zram_set_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags |= BIT(flag);
+	zram->table[index].value |= BIT(flag);
 }
 
 static void zram_clear_flag(struct zram *zram, u32 index,
 			enum zram_pageflags flag)
 {
-	zram->table[index].flags &= ~BIT(flag);
+	zram->table[index].value &= ~BIT(flag);
+}
+
+static size_t zram_get_obj_size(struct zram *zram, u32 index)
+{
+	return zram->table[index].value & (BIT(ZRAM_FLAG_SHIFT) - 1);
+}
+
+static void zram_set_obj_size(struct zram *zram, u32 index, size_t size)
+{
+	unsigned long flags = zram->table[index].value >> ZRAM_FLAG_SHIFT;
+
+	zram->table[index].value = (flags << ZRAM_FLAG_SHIFT) | size;
 }
 
 static int page_zero_filled(void *ptr)
@@ -133,15 +166,55 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 	zram->disksize &= PAGE_MASK;
 }
 
+/* zsmalloc handle of a compressed page's table handle */
+static unsigned long zram_obj_handle(struct zram *zram, unsigned long handle)
+{
+	if (zram->use_dedup)
+		return ((struct zram_entry *)handle)->handle;
+	return handle;
+}
+
+/* Returns 1 if the object was freed, 0 if other pages still share it */
+static int zram_free_obj(struct zram *zram, unsigned long handle)
+{
+	if (zram->use_dedup)
+		return zram_dedup_put(zram, (struct zram_entry *)handle);
+
+	zs_free(zram->mem_pool, handle);
+	return 1;
+}
+
+/* Block 0 is never used, so that a zero handle still means "empty" */
+static unsigned long zram_alloc_block(struct zram *zram)
+{
+	unsigned long blk;
+
+	do {
+		blk = find_next_zero_bit(zram->bitmap, zram->nr_bd_pages, 1);
+		if (blk >= zram->nr_bd_pages)
+			return 0;
+	} while (test_and_set_bit(blk, zram->bitmap));
+
+	return blk;
+}
+
+static void zram_free_block(struct zram *zram, unsigned long blk)
+{
+	WARN_ON_ONCE(!test_and_clear_bit(blk, zram->bitmap));
+}
+
+/* Called with the table entry locked */
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
+	/* Any writeback or deferred free of the old contents is stale now */
+	zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+	zram_clear_flag(zram, index, ZRAM_PENDING_FREE);
 
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -153,28 +226,35 @@ static void zram_free_page(struct zram *zram, size_t index)
 		return;
 	}
 
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_free_block(zram, handle);
+		zram_clear_flag(zram, index, ZRAM_WB);
+		zram_stat_dec(&zram->stats.bd_count);
+		goto out;
+	}
+
+	clen = zram_get_obj_size(zram, index);
+
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
-		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	if (zram_free_obj(zram, handle))
+		zram_stat64_sub(zram, &zram->stats.compr_size, clen);
+	else
+		zram_stat64_sub(zram, &zram->stats.dup_data_size, clen);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
 out:
-	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram_set_obj_size(zram, index, 0);
 }
 
 static void handle_zero_page(struct bio_vec *bvec)
@@ -196,7 +276,7 @@ static void handle_uncompressed_page(struct zram *zram, struct bio_vec *bvec,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1);
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem + bvec->bv_offset, cmem + offset, bvec->bv_len);
 	kunmap_atomic(cmem, KM_USER1);
@@ -210,108 +290,273 @@ static inline int is_partial_io(struct bio_vec *bvec)
 	return bvec->bv_len != PAGE_SIZE;
 }
 
+struct zram_bio_wait {
+	struct completion done;
+	int error;
+};
+
+static void zram_bio_end_io(struct bio *bio, int err)
+{
+	struct zram_bio_wait *wait = bio->bi_private;
+
+	if (!err && !test_bit(BIO_UPTODATE, &bio->bi_flags))
+		err = -EIO;
+	wait->error = err;
+	complete(&wait->done);
+}
+
+/* Synchronously read or write one page of the backing device */
+static int zram_bdev_rw_sync(struct zram *zram, struct page *page,
+			     unsigned long blk, int rw)
+{
+	struct bio *bio;
+	struct zram_bio_wait wait;
+
+	bio = bio_alloc(GFP_NOIO, 1);
+	if (!bio)
+		return -ENOMEM;
+
+	bio->bi_sector = blk << SECTORS_PER_PAGE_SHIFT;
+	bio->bi_bdev = zram->bdev;
+	if (!bio_add_page(bio, page, PAGE_SIZE, 0)) {
+		bio_put(bio);
+		return -EIO;
+	}
+
+	init_completion(&wait.done);
+	bio->bi_private = &wait;
+	bio->bi_end_io = zram_bio_end_io;
+	submit_bio(rw, bio);
+	wait_for_completion(&wait.done);
+	bio_put(bio);
+
+	return wait.error;
+}
+
+struct zram_read_work {
+	struct work_struct work;
+	struct zram *zram;
+	struct page *page;
+	unsigned long blk;
+	int ret;
+};
+
+static void zram_read_work_fn(struct work_struct *work)
+{
+	struct zram_read_work *rw =
+		container_of(work, struct zram_read_work, work);
+
+	rw->ret = zram_bdev_rw_sync(rw->zram, rw->page, rw->blk, READ);
+}
+
+/*
+ * Reads arrive through zram_make_request(), and bios submitted from
+ * there are only queued until it returns. Waiting for one would never
+ * finish, so the backing device is read from a worker.
+ */
+static int zram_read_from_bdev(struct zram *zram, struct page *page,
+			       unsigned long blk)
+{
+	struct zram_read_work rw;
+
+	rw.zram = zram;
+	rw.page = page;
+	rw.blk = blk;
+	INIT_WORK_ONSTACK(&rw.work, zram_read_work_fn);
+	schedule_work(&rw.work);
+	flush_work(&rw.work);
+	destroy_work_on_stack(&rw.work);
+
+	zram_stat64_inc(zram, &zram->stats.bd_reads);
+	return rw.ret;
+}
+
+static int zram_bvec_read_from_bdev(struct zram *zram, struct bio_vec *bvec,
+				    unsigned long blk, int offset)
+{
+	int ret;
+	struct page *page;
+	unsigned char *user_mem, *src;
+
+	if (!is_partial_io(bvec)) {
+		ret = zram_read_from_bdev(zram, bvec->bv_page, blk);
+		goto out;
+	}
+
+	page = alloc_page(GFP_NOIO);
+	if (!page)
+		return -ENOMEM;
+
+	ret = zram_read_from_bdev(zram, page, blk);
+	if (!ret) {
+		user_mem = kmap_atomic(bvec->bv_page, KM_USER0);
+		src = kmap_atomic(page, KM_USER1);
+		memcpy(user_mem + bvec->bv_offset, src + offset, bvec->bv_len);
+		kunmap_atomic(src, KM_USER1);
+		kunmap_atomic(user_mem, KM_USER0);
+	}
+	__free_page(page);
+
+out:
+	if (ret) {
+		pr_err("Backing device read failed! err=%d, block=%lu\n",
+			ret, blk);
+		zram_stat64_inc(zram, &zram->stats.failed_reads);
+		return ret;
+	}
+
+	flush_dcache_page(bvec->bv_page);
+	return 0;
+}
+
 static int zram_bvec_read(struct zram *zram, struct bio_vec *bvec,
 			  u32 index, int offset, struct bio *bio)
 {
-	int ret;
-	size_t clen;
+	int ret = 0;
 	struct page *page;
-	struct zobj_header *zheader;
+	unsigned long handle;
+	struct zcomp_strm *zstrm = NULL;
 	unsigned char *user_mem, *cmem, *uncmem = NULL;
 
 	page = bvec->bv_page;
 
+	if (is_partial_io(bvec)) {
+		/* Use  a temporary buffer to decompress the page */
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
+		if (!uncmem) {
+			pr_info("Error allocating temp memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+again:
+	zram_lock_table(zram, index);
+	handle = zram->table[index].handle;
+	zram_clear_flag(zram, index, ZRAM_IDLE);
+
 	if (zram_test_flag(zram, index, ZRAM_ZERO)) {
+		zram_unlock_table(zram, index);
 		handle_zero_page(bvec);
-		return 0;
+		goto out;
 	}
 
 	/* Requested page is not present in compressed area */
-	if (unlikely(!zram->table[index].page)) {
+	if (unlikely(!handle)) {
+		zram_unlock_table(zram, index);
 		pr_debug("Read before write: sector=%lu, size=%u",
 			 (ulong)(bio->bi_sector), bio->bi_size);
 		handle_zero_page(bvec);
-		return 0;
+		goto out;
+	}
+
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		zram_unlock_table(zram, index);
+		ret = zram_bvec_read_from_bdev(zram, bvec, handle, offset);
+		goto out;
 	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		handle_uncompressed_page(zram, bvec, index, offset);
-		return 0;
+		zram_unlock_table(zram, index);
+		goto out;
 	}
 
-	if (is_partial_io(bvec)) {
-		/* Use  a temporary buffer to decompress the page */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
-		if (!uncmem) {
-			pr_info("Error allocating temp memory!\n");
-			return -ENOMEM;
-		}
+	if (!zstrm) {
+		/* Getting a stream may sleep: look again once we have one */
+		zram_unlock_table(zram, index);
+		zstrm = zcomp_strm_find(zram->comp);
+		goto again;
 	}
 
 	user_mem = kmap_atomic(page, KM_USER0);
 	if (!is_partial_io(bvec))
 		uncmem = user_mem;
-	clen = PAGE_SIZE;
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
+	handle = zram_obj_handle(zram, handle);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zcomp_decompress(zram->comp, zstrm, cmem,
+			       zram_get_obj_size(zram, index), uncmem);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_unlock_table(zram, index);
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    uncmem, &clen);
-
-	if (is_partial_io(bvec)) {
+	if (is_partial_io(bvec))
 		memcpy(user_mem + bvec->bv_offset, uncmem + offset,
 		       bvec->bv_len);
-		kfree(uncmem);
-	}
 
-	kunmap_atomic(cmem, KM_USER1);
 	kunmap_atomic(user_mem, KM_USER0);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
-		return ret;
+		goto out;
 	}
 
 	flush_dcache_page(page);
 
-	return 0;
+out:
+	if (zstrm)
+		zcomp_strm_release(zram->comp, zstrm);
+	if (is_partial_io(bvec))
+		kfree(uncmem);
+	return ret;
 }
 
-static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
+static int zram_read_before_write(struct zram *zram, struct zcomp_strm *zstrm,
+				  char *mem, u32 index)
 {
 	int ret;
-	size_t clen = PAGE_SIZE;
-	struct zobj_header *zheader;
 	unsigned char *cmem;
+	unsigned long handle;
 
-	if (zram_test_flag(zram, index, ZRAM_ZERO) ||
-	    !zram->table[index].page) {
+	zram_lock_table(zram, index);
+	handle = zram->table[index].handle;
+
+	if (zram_test_flag(zram, index, ZRAM_ZERO) || !handle) {
+		zram_unlock_table(zram, index);
 		memset(mem, 0, PAGE_SIZE);
 		return 0;
 	}
 
-	cmem = kmap_atomic(zram->table[index].page, KM_USER0) +
-		zram->table[index].offset;
+	if (unlikely(zram_test_flag(zram, index, ZRAM_WB))) {
+		struct page *page;
+
+		zram_unlock_table(zram, index);
+		page = alloc_page(GFP_NOIO);
+		if (!page)
+			return -ENOMEM;
+
+		ret = zram_read_from_bdev(zram, page, handle);
+		if (!ret) {
+			cmem = kmap_atomic(page, KM_USER0);
+			memcpy(mem, cmem, PAGE_SIZE);
+			kunmap_atomic(cmem, KM_USER0);
+		} else {
+			zram_stat64_inc(zram, &zram->stats.failed_reads);
+		}
+		__free_page(page);
+		return ret;
+	}
 
 	/* Page is stored uncompressed since it's incompressible */
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+		cmem = kmap_atomic((struct page *)handle, KM_USER0);
 		memcpy(mem, cmem, PAGE_SIZE);
 		kunmap_atomic(cmem, KM_USER0);
+		zram_unlock_table(zram, index);
 		return 0;
 	}
 
-	ret = lzo1x_decompress_safe(cmem + sizeof(*zheader),
-				    xv_get_object_size(cmem) - sizeof(*zheader),
-				    mem, &clen);
-	kunmap_atomic(cmem, KM_USER0);
+	handle = zram_obj_handle(zram, handle);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+	ret = zcomp_decompress(zram->comp, zstrm, cmem,
+			       zram_get_obj_size(zram, index), mem);
+	zs_unmap_object(zram->mem_pool, handle);
+	zram_unlock_table(zram, index);
 
 	/* Should NEVER happen. Return bio error if it does. */
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
 		pr_err("Decompression failed! err=%d, page=%u\n", ret, index);
 		zram_stat64_inc(zram, &zram->stats.failed_reads);
 		return ret;
@@ -323,42 +568,43 @@ static int zram_read_before_write(struct zram *zram, char *mem, u32 index)
 static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			   int offset)
 {
-	int ret;
-	u32 store_offset;
+	int ret = 0, dup = 0;
+	u32 checksum = 0;
 	size_t clen;
-	struct zobj_header *zheader;
-	struct page *page, *page_store;
+	unsigned long handle;
+	struct zram_entry *entry;
+	struct page *page, *page_store = NULL;
+	struct zcomp_strm *zstrm = NULL;
 	unsigned char *user_mem, *cmem, *src, *uncmem = NULL;
 
 	page = bvec->bv_page;
-	src = zram->compress_buffer;
 
+	/*
+	 * Writers only serialize on the number of compression streams;
+	 * the table entry is locked just long enough to swap in the
+	 * result.
+	 */
 	if (is_partial_io(bvec)) {
 		/*
 		 * This is a partial IO. We need to read the full page
 		 * before to write the changes.
 		 */
-		uncmem = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		uncmem = kmalloc(PAGE_SIZE, GFP_NOIO);
 		if (!uncmem) {
 			pr_info("Error allocating temp memory!\n");
 			ret = -ENOMEM;
 			goto out;
 		}
-		ret = zram_read_before_write(zram, uncmem, index);
+		zstrm = zcomp_strm_find(zram->comp);
+		ret = zram_read_before_write(zram, zstrm, uncmem, index);
 		if (ret) {
-			kfree(uncmem);
+			zcomp_strm_release(zram->comp, zstrm);
 			goto out;
 		}
+	} else {
+		zstrm = zcomp_strm_find(zram->comp);
 	}
 
-	/*
-	 * System overwrites unused sectors. Free memory associated
-	 * with this sector now.
-	 */
-	if (zram->table[index].page ||
-	    zram_test_flag(zram, index, ZRAM_ZERO))
-		zram_free_page(zram, index);
-
 	user_mem = kmap_atomic(page, KM_USER0);
 
 	if (is_partial_io(bvec))
@@ -369,22 +615,26 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 
 	if (page_zero_filled(uncmem)) {
 		kunmap_atomic(user_mem, KM_USER0);
-		if (is_partial_io(bvec))
-			kfree(uncmem);
-		zram_stat_inc(&zram->stats.pages_zero);
+		zcomp_strm_release(zram->comp, zstrm);
+
+		/*
+		 * System overwrites unused sectors. Free memory associated
+		 * with this sector now.
+		 */
+		zram_lock_table(zram, index);
+		zram_free_page(zram, index);
 		zram_set_flag(zram, index, ZRAM_ZERO);
-		ret = 0;
+		zram_unlock_table(zram, index);
+		zram_stat_inc(&zram->stats.pages_zero);
 		goto out;
 	}
 
-	ret = lzo1x_1_compress(uncmem, PAGE_SIZE, src, &clen,
-			       zram->compress_workmem);
+	ret = zcomp_compress(zram->comp, zstrm, uncmem, &clen);
 
 	kunmap_atomic(user_mem, KM_USER0);
-	if (is_partial_io(bvec))
-			kfree(uncmem);
 
-	if (unlikely(ret != LZO_E_OK)) {
+	if (unlikely(ret)) {
+		zcomp_strm_release(zram->comp, zstrm);
 		pr_err("Compression failed! err=%d\n", ret);
 		goto out;
 	}
@@ -395,6 +645,8 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 	 * errors which has side effect of hanging the system.
 	 */
 	if (unlikely(clen > max_zpage_size)) {
+		zcomp_strm_release(zram->comp, zstrm);
+
 		clen = PAGE_SIZE;
 		page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 		if (unlikely(!page_store)) {
@@ -404,53 +656,80 @@ static int zram_bvec_write(struct zram *zram, struct bio_vec *bvec, u32 index,
 			goto out;
 		}
 
-		store_offset = 0;
-		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
-		zram_stat_inc(&zram->stats.pages_expand);
-		zram->table[index].page = page_store;
-		src = kmap_atomic(page, KM_USER0);
+		handle = (unsigned long)page_store;
+		src = is_partial_io(bvec) ? uncmem : kmap_atomic(page, KM_USER0);
+		cmem = kmap_atomic(page_store, KM_USER1);
+		memcpy(cmem, src, clen);
+		kunmap_atomic(cmem, KM_USER1);
+		if (!is_partial_io(bvec))
+			kunmap_atomic(src, KM_USER0);
 		goto memstore;
 	}
 
-	if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-		      &zram->table[index].page, &store_offset,
-		      GFP_NOIO | __GFP_HIGHMEM)) {
+	if (zram->use_dedup) {
+		checksum = zram_dedup_checksum(zstrm->buffer, clen);
+		entry = zram_dedup_find(zram, zstrm->buffer, clen, checksum);
+		if (entry) {
+			zcomp_strm_release(zram->comp, zstrm);
+			handle = (unsigned long)entry;
+			dup = 1;
+			goto memstore;
+		}
+	}
+
+	handle = zs_malloc(zram->mem_pool, clen);
+	if (!handle) {
+		zcomp_strm_release(zram->comp, zstrm);
 		pr_info("Error allocating memory for compressed "
 			"page: %u, size=%zu\n", index, clen);
 		ret = -ENOMEM;
 		goto out;
 	}
 
-memstore:
-	zram->table[index].offset = store_offset;
-
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-		zram->table[index].offset;
-
-#if 0
-	/* Back-reference needed for memory defragmentation */
-	if (!zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
-		zheader = (struct zobj_header *)cmem;
-		zheader->table_idx = index;
-		cmem += sizeof(*zheader);
+	cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
+	memcpy(cmem, zstrm->buffer, clen);
+	zs_unmap_object(zram->mem_pool, handle);
+	zcomp_strm_release(zram->comp, zstrm);
+
+	if (zram->use_dedup) {
+		entry = zram_dedup_new(zram, handle, clen, checksum);
+		if (!entry) {
+			zs_free(zram->mem_pool, handle);
+			pr_info("Error allocating dedup entry for "
+				"page: %u\n", index);
+			ret = -ENOMEM;
+			goto out;
+		}
+		handle = (unsigned long)entry;
 	}
-#endif
-
-	memcpy(cmem, src, clen);
 
-	kunmap_atomic(cmem, KM_USER1);
-	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-		kunmap_atomic(src, KM_USER0);
+memstore:
+	/*
+	 * System overwrites unused sectors. Free memory associated
+	 * with this sector now.
+	 */
+	zram_lock_table(zram, index);
+	zram_free_page(zram, index);
+	zram->table[index].handle = handle;
+	zram_set_obj_size(zram, index, clen);
+	if (page_store)
+		zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
+	zram_unlock_table(zram, index);
 
 	/* Update stats */
-	zram_stat64_add(zram, &zram->stats.compr_size, clen);
+	if (page_store)
+		zram_stat_inc(&zram->stats.pages_expand);
+	if (dup)
+		zram_stat64_add(zram, &zram->stats.dup_data_size, clen);
+	else
+		zram_stat64_add(zram, &zram->stats.compr_size, clen);
 	zram_stat_inc(&zram->stats.pages_stored);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_inc(&zram->stats.good_compress);
 
-	return 0;
-
 out:
+	if (is_partial_io(bvec))
+		kfree(uncmem);
 	if (ret)
 		zram_stat64_inc(zram, &zram->stats.failed_writes);
 	return ret;
@@ -461,15 +740,10 @@ static int zram_bvec_rw(struct zram *zram, struct bio_vec *bvec, u32 index,
 {
 	int ret;
 
-	if (rw == READ) {
-		down_read(&zram->lock);
+	if (rw == READ)
 		ret = zram_bvec_read(zram, bvec, index, offset, bio);
-		up_read(&zram->lock);
-	} else {
-		down_write(&zram->lock);
+	else
 		ret = zram_bvec_write(zram, bvec, index, offset);
-		up_write(&zram->lock);
-	}
 
 	return ret;
 }
@@ -481,11 +755,62 @@ static void update_position(u32 *index, int *offset, struct bio_vec *bvec)
 	*offset = (*offset + bvec->bv_len) % PAGE_SIZE;
 }
 
+static void zram_account_op(struct zram *zram, enum zram_op op,
+			    ktime_t start)
+{
+	u64 ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+	struct zram_op_stat *stat = &zram->stats.op[op];
+
+	spin_lock(&zram->stat64_lock);
+	stat->count++;
+	stat->total_ns += ns;
+	if (ns > stat->max_ns)
+		stat->max_ns = ns;
+	spin_unlock(&zram->stat64_lock);
+}
+
+/*
+ * Free the pages covered by a discard request. A page only partially
+ * covered is left alone, since the rest of it may still be in use.
+ */
+static void zram_bio_discard(struct zram *zram, u32 index, int offset,
+			     struct bio *bio)
+{
+	size_t n = bio->bi_size;
+
+	if (offset) {
+		if (n <= PAGE_SIZE - offset)
+			return;
+		n -= PAGE_SIZE - offset;
+		index++;
+	}
+
+	while (n >= PAGE_SIZE) {
+		zram_lock_table(zram, index);
+		zram_free_page(zram, index);
+		zram_unlock_table(zram, index);
+		zram_stat64_inc(zram, &zram->stats.discard);
+		index++;
+		n -= PAGE_SIZE;
+	}
+}
+
 static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 {
 	int i, offset;
 	u32 index;
 	struct bio_vec *bvec;
+	ktime_t start = ktime_get();
+
+	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
+	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
+
+	if (unlikely(bio->bi_rw & REQ_DISCARD)) {
+		zram_bio_discard(zram, index, offset, bio);
+		zram_account_op(zram, ZRAM_OP_DISCARD, start);
+		bio_endio(bio, 0);
+		return;
+	}
 
 	switch (rw) {
 	case READ:
@@ -496,9 +821,6 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 		break;
 	}
 
-	index = bio->bi_sector >> SECTORS_PER_PAGE_SHIFT;
-	offset = (bio->bi_sector & (SECTORS_PER_PAGE - 1)) << SECTOR_SHIFT;
-
 	bio_for_each_segment(bvec, bio, i) {
 		int max_transfer_size = PAGE_SIZE - offset;
 
@@ -528,6 +850,8 @@ static void __zram_make_request(struct zram *zram, struct bio *bio, int rw)
 		update_position(&index, &offset, bvec);
 	}
 
+	zram_account_op(zram, rw == READ ? ZRAM_OP_READ : ZRAM_OP_WRITE,
+			start);
 	set_bit(BIO_UPTODATE, &bio->bi_flags);
 	bio_endio(bio, 0);
 	return;
@@ -583,34 +907,29 @@ void zram_reset_device(struct zram *zram)
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
+	/* Slots still queued are freed with the rest of the table below */
+	cancel_work_sync(&zram->free_work);
+	kfifo_free(&zram->free_fifo);
 
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free various per-device buffers */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
-	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
-
-		if (!page)
-			continue;
-
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
-		else
-			xv_free(zram->mem_pool, page, offset);
+	if (zram->table) {
+		for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++)
+			zram_free_page(zram, index);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	zram_dedup_fini(zram);
+	zram_reset_bdev(zram);
+
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -620,6 +939,205 @@ void zram_reset_device(struct zram *zram)
 	mutex_unlock(&zram->init_lock);
 }
 
+int zram_set_backing_dev(struct zram *zram, const char *path)
+{
+	int ret;
+	char *name;
+	unsigned long nr_pages, *bitmap;
+	struct block_device *bdev;
+
+	name = kstrdup(path, GFP_KERNEL);
+	if (!name)
+		return -ENOMEM;
+
+	bdev = blkdev_get_by_path(name, FMODE_READ | FMODE_WRITE | FMODE_EXCL,
+				  zram);
+	if (IS_ERR(bdev)) {
+		pr_err("Error opening backing device %s\n", name);
+		kfree(name);
+		return PTR_ERR(bdev);
+	}
+
+	/* Block 0 is reserved, so at least two pages are needed */
+	nr_pages = i_size_read(bdev->bd_inode) >> PAGE_SHIFT;
+	if (nr_pages < 2) {
+		ret = -EINVAL;
+		goto fail;
+	}
+
+	bitmap = vzalloc(BITS_TO_LONGS(nr_pages) * sizeof(long));
+	if (!bitmap) {
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	zram_reset_bdev(zram);
+	zram->bdev = bdev;
+	zram->backing_dev = name;
+	zram->bitmap = bitmap;
+	zram->nr_bd_pages = nr_pages;
+
+	pr_info("Using %s as backing device: %lu pages\n", name, nr_pages);
+	return 0;
+
+fail:
+	blkdev_put(bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	kfree(name);
+	return ret;
+}
+
+void zram_reset_bdev(struct zram *zram)
+{
+	if (!zram->bdev)
+		return;
+
+	blkdev_put(zram->bdev, FMODE_READ | FMODE_WRITE | FMODE_EXCL);
+	zram->bdev = NULL;
+	kfree(zram->backing_dev);
+	zram->backing_dev = NULL;
+	vfree(zram->bitmap);
+	zram->bitmap = NULL;
+	zram->nr_bd_pages = 0;
+}
+
+/*
+ * Mark every page held in memory idle. Reads and writes clear the mark,
+ * so a later "writeback idle" only touches pages left alone since.
+ */
+void zram_mark_idle(struct zram *zram)
+{
+	size_t index;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		zram_lock_table(zram, index);
+		if (zram->table[index].handle &&
+		    !zram_test_flag(zram, index, ZRAM_WB))
+			zram_set_flag(zram, index, ZRAM_IDLE);
+		zram_unlock_table(zram, index);
+	}
+}
+
+static int zram_wb_candidate(struct zram *zram, size_t index, int huge)
+{
+	if (!zram->table[index].handle ||
+	    zram_test_flag(zram, index, ZRAM_WB) ||
+	    zram_test_flag(zram, index, ZRAM_UNDER_WB) ||
+	    zram_test_flag(zram, index, ZRAM_PENDING_FREE))
+		return 0;
+
+	if (huge)
+		return zram_test_flag(zram, index, ZRAM_UNCOMPRESSED);
+	return zram_test_flag(zram, index, ZRAM_IDLE);
+}
+
+/*
+ * Move incompressible (huge) or idle pages out to the backing device.
+ * The entry is unlocked while the block is written, so ZRAM_UNDER_WB
+ * tells us afterwards whether the page was rewritten meanwhile.
+ */
+int zram_writeback(struct zram *zram, int huge)
+{
+	int ret = 0;
+	size_t index;
+	unsigned long handle, blk;
+	struct page *page;
+	struct zcomp_strm *zstrm;
+	unsigned char *src, *dst;
+
+	if (!zram->bdev)
+		return -ENODEV;
+
+	page = alloc_page(GFP_KERNEL);
+	if (!page)
+		return -ENOMEM;
+
+	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
+		cond_resched();
+
+		/* Cheap check first: most slots will not qualify */
+		zram_lock_table(zram, index);
+		if (!zram_wb_candidate(zram, index, huge)) {
+			zram_unlock_table(zram, index);
+			continue;
+		}
+		zram_unlock_table(zram, index);
+
+		zstrm = zcomp_strm_find(zram->comp);
+		zram_lock_table(zram, index);
+		if (!zram_wb_candidate(zram, index, huge)) {
+			zram_unlock_table(zram, index);
+			zcomp_strm_release(zram->comp, zstrm);
+			continue;
+		}
+
+		handle = zram->table[index].handle;
+		dst = kmap_atomic(page, KM_USER0);
+		if (zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)) {
+			src = kmap_atomic((struct page *)handle, KM_USER1);
+			memcpy(dst, src, PAGE_SIZE);
+			kunmap_atomic(src, KM_USER1);
+		} else {
+			handle = zram_obj_handle(zram, handle);
+			src = zs_map_object(zram->mem_pool, handle, ZS_MM_RO);
+			ret = zcomp_decompress(zram->comp, zstrm, src,
+					zram_get_obj_size(zram, index), dst);
+			zs_unmap_object(zram->mem_pool, handle);
+		}
+		kunmap_atomic(dst, KM_USER0);
+		if (!ret)
+			zram_set_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_table(zram, index);
+		zcomp_strm_release(zram->comp, zstrm);
+
+		if (ret) {
+			pr_err("Decompression failed! err=%d, page=%zu\n",
+				ret, index);
+			break;
+		}
+
+		blk = zram_alloc_block(zram);
+		if (!blk) {
+			ret = -ENOSPC;
+			goto clear_wb;
+		}
+
+		/* Writes are not issued from make_request, so no worker */
+		ret = zram_bdev_rw_sync(zram, page, blk, WRITE);
+		if (ret) {
+			pr_err("Backing device write failed! err=%d, "
+				"block=%lu\n", ret, blk);
+			zram_free_block(zram, blk);
+			goto clear_wb;
+		}
+
+		zram_lock_table(zram, index);
+		if (!zram_test_flag(zram, index, ZRAM_UNDER_WB)) {
+			/* Rewritten or freed while we were writing it */
+			zram_unlock_table(zram, index);
+			zram_free_block(zram, blk);
+			continue;
+		}
+		zram_free_page(zram, index);
+		zram->table[index].handle = blk;
+		zram_set_flag(zram, index, ZRAM_WB);
+		zram_unlock_table(zram, index);
+
+		zram_stat_inc(&zram->stats.pages_stored);
+		zram_stat_inc(&zram->stats.bd_count);
+		zram_stat64_inc(zram, &zram->stats.bd_writes);
+		continue;
+
+clear_wb:
+		zram_lock_table(zram, index);
+		zram_clear_flag(zram, index, ZRAM_UNDER_WB);
+		zram_unlock_table(zram, index);
+		break;
+	}
+
+	__free_page(page);
+	return ret;
+}
+
 int zram_init_device(struct zram *zram)
 {
 	int ret;
@@ -634,16 +1152,10 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
+	zram->comp = zcomp_create(zram->compressor, zram->max_comp_streams);
+	if (!zram->comp) {
+		pr_err("Error initializing %s compression backend\n",
+			zram->compressor);
 		ret = -ENOMEM;
 		goto fail;
 	}
@@ -658,12 +1170,25 @@ int zram_init_device(struct zram *zram)
 		goto fail;
 	}
 
+	if (kfifo_alloc(&zram->free_fifo, free_fifo_size, GFP_KERNEL)) {
+		pr_err("Error allocating slot free queue\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
+	if (zram->use_dedup && zram_dedup_init(zram, num_pages)) {
+		pr_err("Error allocating dedup hash table\n");
+		ret = -ENOMEM;
+		goto fail;
+	}
+
 	set_capacity(zram->disk, zram->disksize >> SECTOR_SHIFT);
 
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -684,13 +1209,68 @@ fail:
 	return ret;
 }
 
+/* Slots taken off the free queue per lock hold */
+#define ZRAM_FREE_BATCH		64
+
+static void zram_free_work(struct work_struct *work)
+{
+	struct zram *zram = container_of(work, struct zram, free_work);
+	u32 batch[ZRAM_FREE_BATCH];
+	unsigned int i, n;
+
+	while ((n = kfifo_out_spinlocked(&zram->free_fifo, batch,
+					ZRAM_FREE_BATCH, &zram->free_lock))) {
+		for (i = 0; i < n; i++) {
+			zram_lock_table(zram, batch[i]);
+			/* Skip slots rewritten since they were queued */
+			if (zram_test_flag(zram, batch[i], ZRAM_PENDING_FREE))
+				zram_free_page(zram, batch[i]);
+			zram_unlock_table(zram, batch[i]);
+		}
+		cond_resched();
+	}
+}
+
+/*
+ * Called with swap_lock held, so freeing a compressed page here stalls
+ * every task freeing swap. Slots holding data are only marked and
+ * queued; zram_free_work() releases them later in batches.
+ */
 void zram_slot_free_notify(struct block_device *bdev, unsigned long index)
 {
 	struct zram *zram;
+	u32 idx = index;
+	ktime_t start = ktime_get();
 
 	zram = bdev->bd_disk->private_data;
-	zram_free_page(zram, index);
+	zram_lock_table(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_PENDING_FREE)) {
+		zram_unlock_table(zram, index);
+		goto out;
+	}
+	if (!zram->table[index].handle) {
+		/* Nothing allocated: just drop the zero page flag */
+		zram_free_page(zram, index);
+		zram_unlock_table(zram, index);
+		goto out;
+	}
+	zram_set_flag(zram, index, ZRAM_PENDING_FREE);
+	zram_unlock_table(zram, index);
+
+	if (kfifo_in_spinlocked(&zram->free_fifo, &idx, 1, &zram->free_lock)) {
+		schedule_work(&zram->free_work);
+		goto out;
+	}
+
+	/* Queue full: free it here */
+	zram_lock_table(zram, index);
+	if (zram_test_flag(zram, index, ZRAM_PENDING_FREE))
+		zram_free_page(zram, index);
+	zram_unlock_table(zram, index);
+
+out:
 	zram_stat64_inc(zram, &zram->stats.notify_free);
+	zram_account_op(zram, ZRAM_OP_FREE, start);
 }
 
 static const struct block_device_operations zram_devops = {
@@ -702,9 +1282,13 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	init_rwsem(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	spin_lock_init(&zram->free_lock);
+	INIT_WORK(&zram->free_work, zram_free_work);
+	zram->max_comp_streams = num_online_cpus();
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -747,6 +1331,12 @@ static int create_device(struct zram *zram, int device_id)
 	blk_queue_io_min(zram->disk->queue, PAGE_SIZE);
 	blk_queue_io_opt(zram->disk->queue, PAGE_SIZE);
 
+	/* Discarded pages are freed, not zeroed */
+	zram->disk->queue->limits.discard_granularity = PAGE_SIZE;
+	zram->disk->queue->limits.max_discard_sectors = UINT_MAX;
+	zram->disk->queue->limits.discard_zeroes_data = 0;
+	queue_flag_set_unlocked(QUEUE_FLAG_DISCARD, zram->disk->queue);
+
 	add_disk(zram->disk);
 
 	ret = sysfs_create_group(&disk_to_dev(zram->disk)->kobj,
@@ -836,6 +1426,7 @@ static void __exit zram_exit(void)
 		destroy_device(zram);
 		if (zram->init_done)
 			zram_reset_device(zram);
+		zram_reset_bdev(zram);
 	}
 
 	unregister_blkdev(zram_major, "zram");
@@ -16,9 +16,13 @@
 #define _ZRAM_DRV_H_
 
 #include <linux/spinlock.h>
+#include <linux/kfifo.h>
 #include <linux/mutex.h>
+#include <linux/workqueue.h>
 
-#include "xvmalloc.h"
+#include "zcomp.h"
+#include "zram_dedup.h"
+#include "zsmalloc.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -26,18 +30,6 @@
  */
 static const unsigned max_num_devices = 32;
 
-/*
- * Stored at beginning of each compressed object.
- *
- * It stores back-reference to table entry which points to this
- * object. This is required to support memory defragmentation.
- */
-struct zobj_header {
-#if 0
-	u32 table_idx;
-#endif
-};
-
 /*-- Configurable parameters */
 
 /* Default zram disk size: 25% of total RAM */
@@ -49,10 +41,16 @@ static const unsigned default_disksize_perc_ram = 25;
  */
 static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
+/*
+ * Swap slot free notifications that can be queued for the free worker.
+ * Once the queue is full, slots are freed inline.
+ */
+static const unsigned free_fifo_size = 1024;
+
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -66,26 +64,65 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 #define ZRAM_SECTOR_PER_LOGICAL_BLOCK	\
 	(1 << (ZRAM_LOGICAL_BLOCK_SHIFT - SECTOR_SHIFT))
 
-/* Flags for zram pages (table[page_no].flags) */
+/*
+ * table[page_no].value holds the compressed object size in its low
+ * ZRAM_FLAG_SHIFT bits and the page flags above them.
+ */
+#define ZRAM_FLAG_SHIFT		24
+
+/* Flags for zram pages (table[page_no].value) */
 enum zram_pageflags {
 	/* Page is stored uncompressed */
-	ZRAM_UNCOMPRESSED,
+	ZRAM_UNCOMPRESSED = ZRAM_FLAG_SHIFT,
 
 	/* Page consists entirely of zeros */
 	ZRAM_ZERO,
 
+	/* Bit spinlock protecting the table entry */
+	ZRAM_ACCESS,
+
+	/* Page lives on the backing device, handle is the block number */
+	ZRAM_WB,
+
+	/* Page is being written back; cleared if it changes meanwhile */
+	ZRAM_UNDER_WB,
+
+	/* Page has not been accessed since it was last marked idle */
+	ZRAM_IDLE,
+
+	/* Swap slot freed; the page is released by the free worker */
+	ZRAM_PENDING_FREE,
+
 	__NR_ZRAM_PAGEFLAGS,
 };
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. For compressed pages, handle is the
+ * zsmalloc handle, or the struct zram_entry when deduplication is on;
+ * for ZRAM_UNCOMPRESSED pages it is the struct page holding the data;
+ * for ZRAM_WB pages it is the block on the backing device.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
-	u8 count;	/* object ref count (not yet used) */
-	u8 flags;
-} __attribute__((aligned(4)));
+	unsigned long handle;
+	unsigned long value;	/* object size and flags */
+};
+
+/* Operations whose latency is tracked */
+enum zram_op {
+	ZRAM_OP_READ,
+	ZRAM_OP_WRITE,
+	ZRAM_OP_DISCARD,
+	ZRAM_OP_FREE,		/* swap slot free notification */
+	NR_ZRAM_OPS,
+};
+
+struct zram_op_stat {
+	u64 count;
+	u64 total_ns;
+	u64 max_ns;
+};
 
 struct zram_stats {
 	u64 compr_size;		/* compressed size of pages stored */
@@ -95,20 +132,39 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	u64 discard;		/* no. of pages freed by discard */
+	u64 pages_compacted;	/* pages freed by compaction */
+	u64 dup_data_size;	/* compressed bytes saved by dedup */
+	u64 bd_reads;		/* pages read from the backing device */
+	u64 bd_writes;		/* pages written back */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
+	atomic_t bd_count;	/* pages currently on the backing device */
+	struct zram_op_stat op[NR_ZRAM_OPS];	/* protected by stat64_lock */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;
+	int max_comp_streams;
+	char compressor[CRYPTO_MAX_ALG_NAME];
+	/* Same page deduplication, chosen before init */
+	int use_dedup;
+	struct zram_hash *hash;
+	size_t hash_size;
+	/* Backing device pages are written back to, set before init */
+	struct block_device *bdev;
+	char *backing_dev;
+	unsigned long *bitmap;	/* blocks in use on bdev */
+	unsigned long nr_bd_pages;
 	struct table *table;
+	/* Swap slots waiting to be freed by free_work */
+	DECLARE_KFIFO_PTR(free_fifo, u32);
+	spinlock_t free_lock;
+	struct work_struct free_work;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct rw_semaphore lock; /* protect compression buffers and table
-				   * against concurrent read and writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -131,5 +187,11 @@ extern struct attribute_group zram_disk_attr_group;
 
 extern int zram_init_device(struct zram *zram);
 extern void zram_reset_device(struct zram *zram);
+extern void zram_stat64_add(struct zram *zram, u64 *v, u64 inc);
+
+extern int zram_set_backing_dev(struct zram *zram, const char *path);
+extern void zram_reset_bdev(struct zram *zram);
+extern void zram_mark_idle(struct zram *zram);
+extern int zram_writeback(struct zram *zram, int huge);
 
 #endif
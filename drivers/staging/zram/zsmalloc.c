@@ -0,0 +1,814 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc is a size-class (slab style) allocator for compressed pages.
+ *
+ * Requests are rounded up to the nearest of ZS_SIZE_CLASSES classes and
+ * served from zspages: small groups of physical pages, possibly highmem,
+ * carved into equally sized objects. The number of pages per zspage is
+ * chosen per class so that the tail waste is minimal, which lets objects
+ * straddle page boundaries. Such objects are bounced through a per-cpu
+ * buffer by zs_map_object()/zs_unmap_object().
+ *
+ * Users get an opaque handle rather than a pointer. The handle refers to
+ * a small slot holding the current location of the object, so that
+ * zs_compact() can move objects out of sparsely used zspages and give
+ * the pages back to the system.
+ */
+
+#ifdef CONFIG_ZRAM_DEBUG
+#define DEBUG
+#endif
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/debugfs.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/sched.h>
+#include <linux/seq_file.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* Per-cpu state of the object currently mapped on this cpu */
+struct mapping_area {
+	char *buf;		/* bounce buffer for objects spanning pages */
+	void *vaddr;		/* kmap address, NULL if bounced */
+	enum zs_mapmode mm;
+};
+
+/* State shared by all pools, set up with the first pool */
+static DEFINE_MUTEX(zs_global_lock);
+static int zs_nr_pools;
+static struct kmem_cache *zs_handle_cache;
+static struct dentry *zs_stats_root;
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+
+static int get_size_class_index(size_t size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+/*
+ * Pick the zspage size, in pages, which wastes the least space for the
+ * given object size. For example, 3 pages hold 5 objects of 2448 bytes
+ * with only 0.4% waste, while a single page would waste 40%.
+ */
+static u32 get_pages_per_zspage(u32 size)
+{
+	u32 i, max_usedpc = 0, max_usedpc_pages = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		u32 zspage_size = i * PAGE_SIZE;
+		u32 waste = zspage_size % size;
+		u32 usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_pages = i;
+		}
+	}
+
+	return max_usedpc_pages;
+}
+
+static unsigned long obj_location(struct zspage *zspage, u32 idx)
+{
+	return (page_to_pfn(zspage->pages[0]) << OBJ_INDEX_BITS) | idx;
+}
+
+static struct zspage *obj_to_zspage(unsigned long obj, u32 *idx)
+{
+	struct page *page = pfn_to_page(obj >> OBJ_INDEX_BITS);
+
+	*idx = obj & OBJ_INDEX_MASK;
+	return (struct zspage *)page_private(page);
+}
+
+static struct zspage *handle_to_zspage(unsigned long handle, u32 *idx)
+{
+	return obj_to_zspage(*(unsigned long *)handle, idx);
+}
+
+static struct page *obj_page(struct zspage *zspage, u32 idx, u32 *offset)
+{
+	u32 off = idx * zspage->class->size;
+
+	*offset = off & ~PAGE_MASK;
+	return zspage->pages[off >> PAGE_SHIFT];
+}
+
+/* Handle back-reference stored at the start of an object */
+static unsigned long obj_handle(struct zspage *zspage, u32 idx)
+{
+	u32 off;
+	unsigned long handle;
+	struct page *page = obj_page(zspage, idx, &off);
+	void *addr = kmap_atomic(page, KM_USER0);
+
+	handle = *(unsigned long *)(addr + off);
+	kunmap_atomic(addr, KM_USER0);
+
+	return handle;
+}
+
+static void obj_set_handle(struct zspage *zspage, u32 idx,
+				unsigned long handle)
+{
+	u32 off;
+	struct page *page = obj_page(zspage, idx, &off);
+	void *addr = kmap_atomic(page, KM_USER0);
+
+	*(unsigned long *)(addr + off) = handle;
+	kunmap_atomic(addr, KM_USER0);
+}
+
+/* Copy a whole object to or from a linear buffer, page by page */
+static void obj_copy_linear(struct zspage *zspage, u32 idx, char *buf,
+				int to_obj)
+{
+	u32 len = zspage->class->size;
+	u32 off = idx * len;
+
+	while (len) {
+		struct page *page = zspage->pages[off >> PAGE_SHIFT];
+		u32 poff = off & ~PAGE_MASK;
+		u32 n = min_t(u32, len, PAGE_SIZE - poff);
+		char *addr = kmap_atomic(page, KM_USER0);
+
+		if (to_obj)
+			memcpy(addr + poff, buf, n);
+		else
+			memcpy(buf, addr + poff, n);
+		kunmap_atomic(addr, KM_USER0);
+
+		buf += n;
+		off += n;
+		len -= n;
+	}
+}
+
+/* Copy object @sidx of @src into slot @didx of @dst (same class) */
+static void obj_copy(struct zspage *dst, u32 didx,
+			struct zspage *src, u32 sidx)
+{
+	u32 len = src->class->size;
+	u32 soff = sidx * len;
+	u32 doff = didx * len;
+
+	while (len) {
+		u32 s_poff = soff & ~PAGE_MASK;
+		u32 d_poff = doff & ~PAGE_MASK;
+		u32 n = min3(len, (u32)PAGE_SIZE - s_poff,
+				(u32)PAGE_SIZE - d_poff);
+		char *s_addr, *d_addr;
+
+		s_addr = kmap_atomic(src->pages[soff >> PAGE_SHIFT], KM_USER0);
+		d_addr = kmap_atomic(dst->pages[doff >> PAGE_SHIFT], KM_USER1);
+		memcpy(d_addr + d_poff, s_addr + s_poff, n);
+		kunmap_atomic(d_addr, KM_USER1);
+		kunmap_atomic(s_addr, KM_USER0);
+
+		soff += n;
+		doff += n;
+		len -= n;
+	}
+}
+
+static enum fullness_group get_fullness_group(struct size_class *class,
+						struct zspage *zspage)
+{
+	if (zspage->inuse == class->objs_per_zspage)
+		return ZS_FULL;
+
+	if (zspage->inuse * 4 <= class->objs_per_zspage * ZS_FULLNESS_THRESHOLD)
+		return ZS_ALMOST_EMPTY;
+
+	return ZS_ALMOST_FULL;
+}
+
+static void insert_zspage(struct size_class *class, struct zspage *zspage)
+{
+	enum fullness_group fg = get_fullness_group(class, zspage);
+
+	zspage->fullness = fg;
+	class->zspages[fg]++;
+	list_add(&zspage->list, &class->fullness_list[fg]);
+}
+
+static void remove_zspage(struct size_class *class, struct zspage *zspage)
+{
+	list_del_init(&zspage->list);
+	class->zspages[zspage->fullness]--;
+}
+
+static void fix_fullness_group(struct size_class *class,
+				struct zspage *zspage)
+{
+	if (get_fullness_group(class, zspage) == zspage->fullness)
+		return;
+
+	remove_zspage(class, zspage);
+	insert_zspage(class, zspage);
+}
+
+/* zspage with free slots to allocate from, fullest first */
+static struct zspage *find_get_zspage(struct size_class *class)
+{
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_FULL]))
+		return list_first_entry(&class->fullness_list[ZS_ALMOST_FULL],
+					struct zspage, list);
+
+	if (!list_empty(&class->fullness_list[ZS_ALMOST_EMPTY]))
+		return list_first_entry(&class->fullness_list[ZS_ALMOST_EMPTY],
+					struct zspage, list);
+
+	return NULL;
+}
+
+static struct zspage *alloc_zspage(struct zs_pool *pool,
+					struct size_class *class)
+{
+	u32 i;
+	struct zspage *zspage;
+
+	zspage = kzalloc(sizeof(*zspage) +
+			BITS_TO_LONGS(class->objs_per_zspage) * sizeof(long),
+			pool->flags & ~__GFP_HIGHMEM);
+	if (!zspage)
+		return NULL;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		zspage->pages[i] = alloc_page(pool->flags);
+		if (!zspage->pages[i])
+			goto fail;
+	}
+
+	INIT_LIST_HEAD(&zspage->list);
+	zspage->class = class;
+
+	/* Lets a handle's pfn lead back to the zspage */
+	set_page_private(zspage->pages[0], (unsigned long)zspage);
+	SetPagePrivate(zspage->pages[0]);
+
+	atomic_long_add(class->pages_per_zspage, &pool->pages_allocated);
+
+	return zspage;
+
+fail:
+	while (i--)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+	return NULL;
+}
+
+static void free_zspage(struct zs_pool *pool, struct zspage *zspage)
+{
+	u32 i, nr_pages = zspage->class->pages_per_zspage;
+
+	ClearPagePrivate(zspage->pages[0]);
+	set_page_private(zspage->pages[0], 0);
+
+	for (i = 0; i < nr_pages; i++)
+		__free_page(zspage->pages[i]);
+	kfree(zspage);
+
+	atomic_long_sub(nr_pages, &pool->pages_allocated);
+}
+
+/**
+ * zs_malloc - Allocate an object from the pool
+ * @pool: pool to allocate from
+ * @size: size of the object
+ *
+ * Returns an opaque handle for the object, or 0 on failure. The memory
+ * must be accessed through zs_map_object()/zs_unmap_object().
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	u32 idx;
+	unsigned long handle;
+	struct size_class *class;
+	struct zspage *zspage;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE - ZS_HANDLE_SIZE))
+		return 0;
+
+	handle = (unsigned long)kmem_cache_alloc(zs_handle_cache,
+					pool->flags & ~__GFP_HIGHMEM);
+	if (!handle)
+		return 0;
+
+	class = pool->size_class[get_size_class_index(size + ZS_HANDLE_SIZE)];
+
+	spin_lock(&class->lock);
+	zspage = find_get_zspage(class);
+	if (!zspage) {
+		spin_unlock(&class->lock);
+		zspage = alloc_zspage(pool, class);
+		if (unlikely(!zspage)) {
+			kmem_cache_free(zs_handle_cache, (void *)handle);
+			return 0;
+		}
+
+		spin_lock(&class->lock);
+		class->obj_allocated += class->objs_per_zspage;
+		insert_zspage(class, zspage);
+	}
+
+	idx = find_first_zero_bit(zspage->used, class->objs_per_zspage);
+	__set_bit(idx, zspage->used);
+	zspage->inuse++;
+	class->obj_used++;
+	fix_fullness_group(class, zspage);
+
+	obj_set_handle(zspage, idx, handle);
+	*(unsigned long *)handle = obj_location(zspage, idx);
+	spin_unlock(&class->lock);
+
+	return handle;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	u32 idx;
+	int empty;
+	struct zspage *zspage;
+	struct size_class *class;
+
+	if (unlikely(!handle))
+		return;
+
+	read_lock(&pool->migrate_lock);
+	zspage = handle_to_zspage(handle, &idx);
+	class = zspage->class;
+
+	spin_lock(&class->lock);
+	__clear_bit(idx, zspage->used);
+	zspage->inuse--;
+	class->obj_used--;
+
+	empty = !zspage->inuse;
+	if (empty) {
+		remove_zspage(class, zspage);
+		class->obj_allocated -= class->objs_per_zspage;
+	} else {
+		fix_fullness_group(class, zspage);
+	}
+	spin_unlock(&class->lock);
+	read_unlock(&pool->migrate_lock);
+
+	if (empty)
+		free_zspage(pool, zspage);
+	kmem_cache_free(zs_handle_cache, (void *)handle);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/**
+ * zs_map_object - Get a pointer to an object's memory
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: how the object will be accessed
+ *
+ * The object cannot move until the matching zs_unmap_object(). Only one
+ * object may be mapped per cpu at a time and the caller must not sleep
+ * in between.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	u32 idx, off;
+	struct page *page;
+	struct zspage *zspage;
+	struct mapping_area *area;
+
+	read_lock(&pool->migrate_lock);
+	zspage = handle_to_zspage(handle, &idx);
+	page = obj_page(zspage, idx, &off);
+
+	area = &__get_cpu_var(zs_map_area);
+	area->mm = mm;
+
+	if (off + zspage->class->size <= PAGE_SIZE) {
+		area->vaddr = kmap_atomic(page, KM_USER1);
+		return area->vaddr + off + ZS_HANDLE_SIZE;
+	}
+
+	/* Object spans two pages */
+	area->vaddr = NULL;
+	if (mm == ZS_MM_WO)
+		*(unsigned long *)area->buf = handle;
+	else
+		obj_copy_linear(zspage, idx, area->buf, 0);
+
+	return area->buf + ZS_HANDLE_SIZE;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	u32 idx;
+	struct zspage *zspage;
+	struct mapping_area *area = &__get_cpu_var(zs_map_area);
+
+	if (area->vaddr) {
+		kunmap_atomic(area->vaddr, KM_USER1);
+	} else if (area->mm != ZS_MM_RO) {
+		zspage = handle_to_zspage(handle, &idx);
+		obj_copy_linear(zspage, idx, area->buf, 1);
+	}
+
+	read_unlock(&pool->migrate_lock);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/* Enough unused slots in the class to free at least one zspage? */
+static int zs_can_compact(struct size_class *class)
+{
+	return class->obj_allocated - class->obj_used >= class->objs_per_zspage;
+}
+
+/*
+ * zspage to drain: an almost empty one if there is any, else an almost full
+ * one. We take the tail of the list, the zspage that has been in its group
+ * longest, rather than search the list for the sparsest.
+ */
+static struct zspage *isolate_source_zspage(struct size_class *class)
+{
+	struct list_head *head;
+
+	head = &class->fullness_list[ZS_ALMOST_EMPTY];
+	if (list_empty(head))
+		head = &class->fullness_list[ZS_ALMOST_FULL];
+	if (list_empty(head))
+		return NULL;
+
+	return list_entry(head->prev, struct zspage, list);
+}
+
+/*
+ * Move objects from @src into @dst until @src is empty, @dst is full or
+ * @budget objects have been moved. Returns the number of objects moved.
+ */
+static u32 migrate_zspage(struct zspage *src, struct zspage *dst, u32 budget)
+{
+	struct size_class *class = src->class;
+	u32 sidx, didx, moved = 0;
+	unsigned long handle;
+
+	for_each_set_bit(sidx, src->used, class->objs_per_zspage) {
+		if (dst->inuse == class->objs_per_zspage || moved == budget)
+			break;
+
+		didx = find_first_zero_bit(dst->used, class->objs_per_zspage);
+		handle = obj_handle(src, sidx);
+		obj_copy(dst, didx, src, sidx);
+
+		__set_bit(didx, dst->used);
+		dst->inuse++;
+		__clear_bit(sidx, src->used);
+		src->inuse--;
+
+		*(unsigned long *)handle = obj_location(dst, didx);
+		moved++;
+	}
+
+	return moved;
+}
+
+static unsigned long __zs_compact(struct zs_pool *pool,
+				struct size_class *class)
+{
+	u32 moved;
+	unsigned long freed = 0;
+	struct zspage *src, *dst;
+
+	for (;;) {
+		write_lock(&pool->migrate_lock);
+		spin_lock(&class->lock);
+
+		if (!zs_can_compact(class)) {
+			spin_unlock(&class->lock);
+			write_unlock(&pool->migrate_lock);
+			break;
+		}
+
+		src = isolate_source_zspage(class);
+		remove_zspage(class, src);
+
+		moved = 0;
+		while (src->inuse && moved < ZS_COMPACT_BATCH) {
+			dst = find_get_zspage(class);
+			if (!dst)
+				break;
+
+			remove_zspage(class, dst);
+			moved += migrate_zspage(src, dst,
+						ZS_COMPACT_BATCH - moved);
+			insert_zspage(class, dst);
+		}
+
+		if (!src->inuse) {
+			class->obj_allocated -= class->objs_per_zspage;
+		} else {
+			/* Keep draining the same zspage next round */
+			insert_zspage(class, src);
+			list_move_tail(&src->list,
+				&class->fullness_list[src->fullness]);
+		}
+
+		spin_unlock(&class->lock);
+		write_unlock(&pool->migrate_lock);
+
+		if (!src->inuse) {
+			freed += class->pages_per_zspage;
+			free_zspage(pool, src);
+		}
+
+		cond_resched();
+	}
+
+	return freed;
+}
+
+/**
+ * zs_compact - Move objects out of sparsely used zspages
+ * @pool: pool to compact
+ *
+ * Returns the number of pages given back to the system.
+ */
+unsigned long zs_compact(struct zs_pool *pool)
+{
+	int i;
+	unsigned long freed = 0;
+	struct size_class *class;
+
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		class = pool->size_class[i];
+		if (class->index != i)
+			continue;
+		freed += __zs_compact(pool, class);
+	}
+
+	atomic_long_add(freed, &pool->pages_compacted);
+	return freed;
+}
+EXPORT_SYMBOL_GPL(zs_compact);
+
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	return (u64)atomic_long_read(&pool->pages_allocated) << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+static int zs_stats_show(struct seq_file *m, void *unused)
+{
+	int i;
+	struct zs_pool *pool = m->private;
+	struct size_class *class;
+	u64 almost_full, almost_empty, full, obj_allocated, obj_used;
+	u64 total_objs = 0, total_used = 0, total_pages = 0;
+
+	seq_printf(m, "%5s %5s %11s %12s %8s %13s %10s %10s %16s\n",
+			"class", "size", "almost_full", "almost_empty",
+			"full", "obj_allocated", "obj_used", "pages_used",
+			"pages_per_zspage");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = pool->size_class[i];
+		if (class->index != i)
+			continue;
+
+		spin_lock(&class->lock);
+		almost_full = class->zspages[ZS_ALMOST_FULL];
+		almost_empty = class->zspages[ZS_ALMOST_EMPTY];
+		full = class->zspages[ZS_FULL];
+		obj_allocated = class->obj_allocated;
+		obj_used = class->obj_used;
+		spin_unlock(&class->lock);
+
+		if (!obj_allocated)
+			continue;
+
+		seq_printf(m, "%5d %5u %11llu %12llu %8llu %13llu %10llu "
+				"%10llu %16u\n", i, class->size,
+				almost_full, almost_empty, full,
+				obj_allocated, obj_used,
+				(almost_full + almost_empty + full) *
+					class->pages_per_zspage,
+				class->pages_per_zspage);
+
+		total_objs += obj_allocated;
+		total_used += obj_used;
+		total_pages += (almost_full + almost_empty + full) *
+				class->pages_per_zspage;
+	}
+
+	seq_printf(m, "\nTotal %54llu %10llu %10llu\n",
+			total_objs, total_used, total_pages);
+	seq_printf(m, "pages_compacted: %ld\n",
+			atomic_long_read(&pool->pages_compacted));
+
+	return 0;
+}
+
+static int zs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = zs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Called with zs_global_lock held */
+static void zs_free_global(void)
+{
+	int cpu;
+
+	debugfs_remove(zs_stats_root);
+	zs_stats_root = NULL;
+
+	for_each_possible_cpu(cpu) {
+		kfree(per_cpu(zs_map_area, cpu).buf);
+		per_cpu(zs_map_area, cpu).buf = NULL;
+	}
+
+	if (zs_handle_cache)
+		kmem_cache_destroy(zs_handle_cache);
+	zs_handle_cache = NULL;
+}
+
+static void zs_put_global(void)
+{
+	mutex_lock(&zs_global_lock);
+	if (!--zs_nr_pools)
+		zs_free_global();
+	mutex_unlock(&zs_global_lock);
+}
+
+static int zs_get_global(void)
+{
+	int cpu;
+
+	mutex_lock(&zs_global_lock);
+	if (zs_nr_pools)
+		goto out;
+
+	zs_handle_cache = kmem_cache_create("zs_handle", ZS_HANDLE_SIZE,
+						0, 0, NULL);
+	if (!zs_handle_cache)
+		goto fail;
+
+	for_each_possible_cpu(cpu) {
+		char *buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+
+		if (!buf)
+			goto fail;
+		per_cpu(zs_map_area, cpu).buf = buf;
+	}
+
+	zs_stats_root = debugfs_create_dir("zsmalloc", NULL);
+out:
+	zs_nr_pools++;
+	mutex_unlock(&zs_global_lock);
+	return 0;
+
+fail:
+	zs_free_global();
+	mutex_unlock(&zs_global_lock);
+	return -ENOMEM;
+}
+
+/**
+ * zs_create_pool - Create an allocation pool
+ * @name: name of the pool, used for its debugfs statistics
+ * @flags: allocation flags for backing pages (may include __GFP_HIGHMEM)
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	int i;
+	struct zs_pool *pool;
+	struct size_class *class, *prev_class = NULL;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	if (zs_get_global()) {
+		kfree(pool);
+		return NULL;
+	}
+
+	/*
+	 * Walk the classes from the largest down. A smaller class which
+	 * would end up with the same zspage geometry as the next larger one
+	 * is merged into it: both waste the same amount of memory, and
+	 * sharing zspages keeps fewer of them partially used.
+	 */
+	for (i = ZS_SIZE_CLASSES - 1; i >= 0; i--) {
+		int fg;
+		u32 size, pages_per_zspage, objs_per_zspage;
+
+		size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		if (size > ZS_MAX_ALLOC_SIZE)
+			size = ZS_MAX_ALLOC_SIZE;
+		pages_per_zspage = get_pages_per_zspage(size);
+		objs_per_zspage = pages_per_zspage * PAGE_SIZE / size;
+
+		if (prev_class &&
+		    prev_class->pages_per_zspage == pages_per_zspage &&
+		    prev_class->objs_per_zspage == objs_per_zspage) {
+			pool->size_class[i] = prev_class;
+			continue;
+		}
+
+		class = kzalloc(sizeof(*class), GFP_KERNEL);
+		if (!class)
+			goto fail;
+
+		spin_lock_init(&class->lock);
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+		class->size = size;
+		class->index = i;
+		class->pages_per_zspage = pages_per_zspage;
+		class->objs_per_zspage = objs_per_zspage;
+
+		pool->size_class[i] = prev_class = class;
+	}
+
+	pool->flags = flags;
+	rwlock_init(&pool->migrate_lock);
+
+	if (zs_stats_root && !IS_ERR(zs_stats_root))
+		pool->stats_dentry = debugfs_create_file(name, S_IRUGO,
+					zs_stats_root, pool, &zs_stats_fops);
+
+	return pool;
+
+fail:
+	zs_destroy_pool(pool);
+	return NULL;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i, fg;
+	u32 idx;
+	struct size_class *class;
+	struct zspage *zspage, *tmp;
+
+	debugfs_remove(pool->stats_dentry);
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		class = pool->size_class[i];
+		if (!class || class->index != i)
+			continue;
+
+		/* Release whatever the user did not free */
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++) {
+			list_for_each_entry_safe(zspage, tmp,
+					&class->fullness_list[fg], list) {
+				for_each_set_bit(idx, zspage->used,
+						class->objs_per_zspage)
+					kmem_cache_free(zs_handle_cache,
+					    (void *)obj_handle(zspage, idx));
+				free_zspage(pool, zspage);
+			}
+		}
+		kfree(class);
+	}
+
+	kfree(pool);
+	zs_put_global();
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
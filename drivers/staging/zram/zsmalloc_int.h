@@ -0,0 +1,121 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+
+/* User configurable params */
+
+/*
+ * A zspage is a group of up to ZS_MAX_PAGES_PER_ZSPAGE physical pages
+ * which are carved into equally sized objects. Objects are allowed to
+ * straddle the boundary between two pages of the same zspage, so large
+ * size classes do not have to waste the tail of every page.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	4
+
+/*
+ * Every object starts with a back-reference to its handle so that
+ * compaction can find and update the handle when it moves the object.
+ */
+#define ZS_HANDLE_SIZE		(sizeof(unsigned long))
+
+/* Must be a multiple of ZS_SIZE_CLASS_DELTA */
+#define ZS_MIN_ALLOC_SIZE	32
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are separated by ZS_SIZE_CLASS_DELTA bytes: 16 for 4k
+ * pages. Keeping this a multiple of ZS_HANDLE_SIZE guarantees that the
+ * handle back-reference never crosses a page boundary.
+ */
+#define ZS_SIZE_CLASS_DELTA	(PAGE_SIZE >> 8)
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) \
+					/ ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage is "almost empty" while at most this fraction (in quarters)
+ * of its objects is in use. Compaction drains almost empty zspages into
+ * almost full ones.
+ */
+#define ZS_FULLNESS_THRESHOLD	3
+
+/* Objects moved per lock hold during compaction */
+#define ZS_COMPACT_BATCH	32
+
+/* End of user params */
+
+/*
+ * Location of an object, as stored in its handle: pfn of the first page
+ * of the zspage and the object index within it. The largest zspage holds
+ * (ZS_MAX_PAGES_PER_ZSPAGE * PAGE_SIZE / ZS_MIN_ALLOC_SIZE) objects.
+ */
+#define OBJ_INDEX_BITS		(PAGE_SHIFT + 2 - 5)
+#define OBJ_INDEX_MASK		((1UL << OBJ_INDEX_BITS) - 1)
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	ZS_FULL,
+	_ZS_NR_FULLNESS_GROUPS,
+};
+
+struct size_class {
+	spinlock_t lock;
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+
+	/* Object size, including the handle back-reference */
+	u32 size;
+	/* Index of the largest request size served by this class */
+	u32 index;
+	u32 pages_per_zspage;
+	u32 objs_per_zspage;
+
+	/* Stats */
+	u64 zspages[_ZS_NR_FULLNESS_GROUPS];
+	u64 obj_allocated;
+	u64 obj_used;
+};
+
+struct zspage {
+	struct list_head list;		/* entry in class fullness list */
+	struct size_class *class;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	u32 inuse;
+	enum fullness_group fullness;
+	unsigned long used[0];		/* bitmap of allocated objects */
+};
+
+struct zs_pool {
+	/*
+	 * Size classes sharing the same zspage geometry are merged, so
+	 * several entries here may point to the same size_class.
+	 */
+	struct size_class *size_class[ZS_SIZE_CLASSES];
+	gfp_t flags;
+
+	/*
+	 * Taken for reading while a handle is being resolved or an object
+	 * is mapped, and for writing while compaction moves objects.
+	 */
+	rwlock_t migrate_lock;
+
+	atomic_long_t pages_allocated;
+	atomic_long_t pages_compacted;
+
+	struct dentry *stats_dentry;
+};
+
+#endif
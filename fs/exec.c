@@ -969,6 +969,9 @@ static int de_thread(struct task_struct *tsk)
 		write_unlock_irq(&tasklist_lock);
 
 		release_task(leader);
+
+		/* the old leader has been reported as exiting, announce us */
+		oom_adj_notify(OOM_ADJ_FORK, tsk);
 	}
 
 	sig->group_exit_task = NULL;
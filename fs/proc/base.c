@@ -1148,6 +1148,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(OOM_ADJ_CHANGE, task->group_leader);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
@@ -1283,6 +1285,8 @@ err_sighand:
 	unlock_task_sighand(task, &flags);
 err_task_lock:
 	task_unlock(task);
+	if (!err)
+		oom_adj_notify(OOM_ADJ_CHANGE, task->group_leader);
 	put_task_struct(task);
 out:
 	return err < 0 ? err : count;
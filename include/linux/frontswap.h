@@ -0,0 +1,92 @@
+#ifndef _LINUX_FRONTSWAP_H
+#define _LINUX_FRONTSWAP_H
+
+#include <linux/swap.h>
+#include <linux/mm.h>
+#include <linux/bitops.h>
+
+/*
+ * A frontswap backend stores swap pages, keyed by swap type and offset,
+ * in memory the kernel cannot address directly (e.g. compressed by
+ * zcache). put_page and get_page return 0 on success, -1 on failure; a
+ * page successfully put must be returned by every later get until it is
+ * flushed.
+ */
+struct frontswap_ops {
+	void (*init)(unsigned);
+	int (*put_page)(unsigned, pgoff_t, struct page *);
+	int (*get_page)(unsigned, pgoff_t, struct page *);
+	void (*flush_page)(unsigned, pgoff_t);
+	void (*flush_area)(unsigned);
+};
+
+extern struct frontswap_ops
+	frontswap_register_ops(struct frontswap_ops *ops);
+extern void __frontswap_init(struct swap_info_struct *);
+extern int __frontswap_put_page(struct page *);
+extern int __frontswap_get_page(struct page *);
+extern void __frontswap_flush_page(struct swap_info_struct *, pgoff_t);
+extern void __frontswap_flush_area(struct swap_info_struct *);
+extern int frontswap_enabled;
+
+#ifdef CONFIG_FRONTSWAP
+static inline unsigned long *frontswap_map_get(struct swap_info_struct *sis)
+{
+	return sis->frontswap_map;
+}
+
+static inline void frontswap_map_set(struct swap_info_struct *sis,
+				     unsigned long *map)
+{
+	sis->frontswap_map = map;
+}
+#else
+#define frontswap_enabled (0)
+#define frontswap_map_get(_sis) (NULL)
+#define frontswap_map_set(_sis, _map) do { } while (0)
+#endif
+
+/*
+ * As with cleancache, these shims reduce every hook to nothing when
+ * CONFIG_FRONTSWAP is off, and to a single global variable check when
+ * no backend has registered.
+ */
+
+static inline void frontswap_init(struct swap_info_struct *sis)
+{
+	if (frontswap_enabled)
+		__frontswap_init(sis);
+}
+
+static inline int frontswap_put_page(struct page *page)
+{
+	int ret = -1;
+
+	if (frontswap_enabled)
+		ret = __frontswap_put_page(page);
+	return ret;
+}
+
+static inline int frontswap_get_page(struct page *page)
+{
+	int ret = -1;
+
+	if (frontswap_enabled)
+		ret = __frontswap_get_page(page);
+	return ret;
+}
+
+static inline void frontswap_flush_page(struct swap_info_struct *sis,
+					pgoff_t offset)
+{
+	if (frontswap_enabled)
+		__frontswap_flush_page(sis, offset);
+}
+
+static inline void frontswap_flush_area(struct swap_info_struct *sis)
+{
+	if (frontswap_enabled)
+		__frontswap_flush_area(sis);
+}
+
+#endif /* _LINUX_FRONTSWAP_H */
@@ -52,6 +52,20 @@ extern void out_of_memory(struct zonelist *zonelist, gfp_t gfp_mask,
 extern int register_oom_notifier(struct notifier_block *nb);
 extern int unregister_oom_notifier(struct notifier_block *nb);
 
+/*
+ * Events passed to the oom_adj notifier, with the thread group leader they
+ * concern. The notifier runs in process context with no locks held.
+ */
+enum oom_adj_event {
+	OOM_ADJ_FORK,		/* a new process was created */
+	OOM_ADJ_CHANGE,		/* oom_adj or oom_score_adj was written */
+	OOM_ADJ_EXIT,		/* the process is exiting */
+};
+
+extern int register_oom_adj_notifier(struct notifier_block *nb);
+extern int unregister_oom_adj_notifier(struct notifier_block *nb);
+extern void oom_adj_notify(enum oom_adj_event event, struct task_struct *p);
+
 extern bool oom_killer_disabled;
 
 static inline void oom_killer_disable(void)
@@ -194,6 +194,9 @@ struct swap_info_struct {
 	struct block_device *bdev;	/* swap device or bdev of swap file */
 	struct file *swap_file;		/* seldom referenced */
 	unsigned int old_block_size;	/* seldom referenced */
+#ifdef CONFIG_FRONTSWAP
+	unsigned long *frontswap_map;	/* offsets held by frontswap */
+#endif
 };
 
 struct swap_list_t {
@@ -265,6 +268,20 @@ extern int vm_swappiness;
 extern int remove_mapping(struct address_space *mapping, struct page *page);
 extern long vm_total_pages;
 
+/*
+ * Passed to the reclaim pressure notifier after every round of global LRU
+ * reclaim in a zone. The notifier is atomic and runs in reclaim context.
+ */
+struct reclaim_pressure {
+	struct zone *zone;
+	unsigned long scanned;		/* pages scanned */
+	unsigned long reclaimed;	/* pages reclaimed */
+};
+
+struct notifier_block;
+extern int register_reclaim_pressure_notifier(struct notifier_block *nb);
+extern int unregister_reclaim_pressure_notifier(struct notifier_block *nb);
+
 #ifdef CONFIG_NUMA
 extern int zone_reclaim_mode;
 extern int sysctl_min_unmapped_ratio;
@@ -339,6 +356,7 @@ extern int free_swap_and_cache(swp_entry_t);
 extern int swap_type_of(dev_t, sector_t, struct block_device **);
 extern unsigned int count_swap_pages(int, int);
 extern sector_t map_swap_page(struct page *, struct block_device **);
+extern struct swap_info_struct *page_swap_info(struct page *);
 extern sector_t swapdev_block(int, pgoff_t);
 extern int reuse_swap_page(struct page *);
 extern int try_to_free_swap(struct page *);
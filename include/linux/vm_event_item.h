@@ -57,6 +57,11 @@ enum vm_event_item { PGPGIN, PGPGOUT, PSWPIN, PSWPOUT,
 		THP_COLLAPSE_ALLOC,
 		THP_COLLAPSE_ALLOC_FAILED,
 		THP_SPLIT,
+#endif
+#ifdef CONFIG_ASHMEM
+		ASHMEM_PGPURGED,	/* unpinned ashmem pages purged */
+		ASHMEM_PURGE_BATCHES,	/* areas purged at a time */
+		ASHMEM_PURGE_USECS,	/* time spent purging */
 #endif
 		NR_VM_EVENT_ITEMS
 };
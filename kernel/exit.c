@@ -958,6 +958,9 @@ NORET_TYPE void do_exit(long code)
 	smp_mb();
 	raw_spin_unlock_wait(&tsk->pi_lock);
 
+	if (thread_group_leader(tsk))
+		oom_adj_notify(OOM_ADJ_EXIT, tsk);
+
 	if (unlikely(in_atomic()))
 		printk(KERN_INFO "note: %s[%d] exited with preempt_count %d\n",
 				current->comm, task_pid_nr(current),
@@ -27,7 +27,17 @@
 #include <linux/personality.h>
 #include <linux/bitops.h>
 #include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/rbtree.h>
 #include <linux/shmem_fs.h>
+#include <linux/swap.h>
+#include <linux/vmstat.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <linux/wait.h>
+#include <linux/ktime.h>
+#include <linux/delay.h>
+#include <linux/moduleparam.h>
 #include <linux/ashmem.h>
 
 #define ASHMEM_NAME_PREFIX "dev/ashmem/"
@@ -37,12 +47,16 @@
 /*
  * ashmem_area - anonymous shared memory area
  * Lifecycle: From our parent file's open() until its release()
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its `mutex'
  * Big Note: Mappings do NOT pin this structure; it dies on close()
+ *
+ * Lock Ordering: asma->mutex -> ashmem_lru_lock
+ *                asma->mutex -> i_mutex -> i_alloc_sem
  */
 struct ashmem_area {
 	char name[ASHMEM_FULL_NAME_LEN];/* optional name for /proc/pid/maps */
-	struct list_head unpinned_list;	/* list of all ashmem areas */
+	struct rb_root unpinned_tree;	/* unpinned ranges, by page */
+	struct mutex mutex;		/* protects this area */
 	struct file *file;		/* the shmem-based backing file */
 	size_t size;			/* size of the mapping, in bytes */
 	unsigned long prot_mask;	/* allowed prot bits, as vm_flags */
@@ -51,29 +65,50 @@ struct ashmem_area {
 /*
  * ashmem_range - represents an interval of unpinned (evictable) pages
  * Lifecycle: From unpin to pin
- * Locking: Protected by `ashmem_mutex'
+ * Locking: Protected by its area's `mutex'; `lru' by `ashmem_lru_lock'
+ *
+ * The ranges of an area never overlap, so sorting them by their first page
+ * also sorts them by their last page. That lets the plain rbtree of an area
+ * answer interval queries: the first range ending at or after a page is
+ * found in one descent.
  */
 struct ashmem_range {
 	struct list_head lru;		/* entry in LRU list */
-	struct list_head unpinned;	/* entry in its area's unpinned list */
+	struct rb_node unpinned;	/* node in its area's unpinned tree */
 	struct ashmem_area *asma;	/* associated area */
 	size_t pgstart;			/* starting page, inclusive */
 	size_t pgend;			/* ending page, inclusive */
 	unsigned int purged;		/* ASHMEM_NOT or ASHMEM_WAS_PURGED */
 };
 
-/* LRU list of unpinned pages, protected by ashmem_mutex */
+/* LRU list of unpinned pages, protected by ashmem_lru_lock */
 static LIST_HEAD(ashmem_lru_list);
 
-/* Count of pages on our LRU list, protected by ashmem_mutex */
+/* Count of pages on our LRU list, protected by ashmem_lru_lock */
 static unsigned long lru_count;
 
 /*
- * ashmem_mutex - protects the list of and each individual ashmem_area
+ * ashmem_lru_lock - protects the LRU list and its count
  *
- * Lock Ordering: ashmex_mutex -> i_mutex -> i_alloc_sem
+ * Only the shrinker crosses from the LRU back to an area, and it only ever
+ * trylocks the area's mutex, so the lock ordering above holds.
+ */
+static DEFINE_SPINLOCK(ashmem_lru_lock);
+
+/*
+ * The purger thread purges unpinned ranges in the background, so that
+ * reclaim does not have to. It runs while free memory is below
+ * 'purge_watermark' pages and whenever the shrinker passes work on to it
+ * through 'ashmem_purge_request'.
  */
-static DEFINE_MUTEX(ashmem_mutex);
+static struct task_struct *ashmem_purger_task;
+static DECLARE_WAIT_QUEUE_HEAD(ashmem_purger_wait);
+static atomic_long_t ashmem_purge_request = ATOMIC_LONG_INIT(0);
+
+static unsigned long purge_watermark;
+module_param(purge_watermark, ulong, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(purge_watermark,
+		 "Purge unpinned ashmem while fewer pages than this are free");
 
 static struct kmem_cache *ashmem_area_cachep __read_mostly;
 static struct kmem_cache *ashmem_range_cachep __read_mostly;
@@ -97,36 +132,96 @@ static struct kmem_cache *ashmem_range_cachep __read_mostly;
   (page_in_range(range, start) || page_in_range(range, end) || \
    page_range_subsumes_range(range, start, end))
 
-#define range_before_page(range, page) \
-  ((range)->pgend < (page))
-
 #define PROT_MASK		(PROT_EXEC | PROT_READ | PROT_WRITE)
 
+/*
+ * lru_add - add 'range' to the tail of the LRU list
+ *
+ * Caller must hold ashmem_lru_lock.
+ */
 static inline void lru_add(struct ashmem_range *range)
 {
 	list_add_tail(&range->lru, &ashmem_lru_list);
 	lru_count += range_size(range);
 }
 
+/*
+ * lru_del - remove 'range' from the LRU list
+ *
+ * Caller must hold ashmem_lru_lock.
+ */
 static inline void lru_del(struct ashmem_range *range)
 {
 	list_del(&range->lru);
 	lru_count -= range_size(range);
 }
 
+/*
+ * range_lookup - returns the first unpinned range of 'asma' that ends at or
+ * after page 'page', or NULL if there is none
+ *
+ * Caller must hold asma->mutex.
+ */
+static struct ashmem_range *range_lookup(struct ashmem_area *asma,
+					 size_t page)
+{
+	struct rb_node *n = asma->unpinned_tree.rb_node;
+	struct ashmem_range *range, *ret = NULL;
+
+	while (n) {
+		range = rb_entry(n, struct ashmem_range, unpinned);
+		if (range->pgend >= page) {
+			ret = range;
+			n = n->rb_left;
+		} else
+			n = n->rb_right;
+	}
+
+	return ret;
+}
+
+static inline struct ashmem_range *range_next(struct ashmem_range *range)
+{
+	struct rb_node *n = rb_next(&range->unpinned);
+
+	return n ? rb_entry(n, struct ashmem_range, unpinned) : NULL;
+}
+
+/*
+ * range_insert - add 'range' to the unpinned tree of its area
+ *
+ * Caller must hold asma->mutex.
+ */
+static void range_insert(struct ashmem_range *range)
+{
+	struct rb_node **p = &range->asma->unpinned_tree.rb_node;
+	struct rb_node *parent = NULL;
+	struct ashmem_range *entry;
+
+	while (*p) {
+		parent = *p;
+		entry = rb_entry(parent, struct ashmem_range, unpinned);
+		if (range->pgstart < entry->pgstart)
+			p = &parent->rb_left;
+		else
+			p = &parent->rb_right;
+	}
+
+	rb_link_node(&range->unpinned, parent, p);
+	rb_insert_color(&range->unpinned, &range->asma->unpinned_tree);
+}
+
 /*
  * range_alloc - allocate and initialize a new ashmem_range structure
  *
  * 'asma' - associated ashmem_area
- * 'prev_range' - the previous ashmem_range in the sorted asma->unpinned list
  * 'purged' - initial purge value (ASMEM_NOT_PURGED or ASHMEM_WAS_PURGED)
  * 'start' - starting page, inclusive
  * 'end' - ending page, inclusive
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
-static int range_alloc(struct ashmem_area *asma,
-		       struct ashmem_range *prev_range, unsigned int purged,
+static int range_alloc(struct ashmem_area *asma, unsigned int purged,
 		       size_t start, size_t end)
 {
 	struct ashmem_range *range;
@@ -140,37 +235,56 @@ static int range_alloc(struct ashmem_area *asma,
 	range->pgend = end;
 	range->purged = purged;
 
-	list_add_tail(&range->unpinned, &prev_range->unpinned);
+	range_insert(range);
 
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_add(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 
 	return 0;
 }
 
+/*
+ * range_del - remove 'range' from its area and free it
+ *
+ * Caller must hold asma->mutex.
+ */
 static void range_del(struct ashmem_range *range)
 {
-	list_del(&range->unpinned);
-	if (range_on_lru(range))
+	rb_erase(&range->unpinned, &range->asma->unpinned_tree);
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
 		lru_del(range);
+		spin_unlock(&ashmem_lru_lock);
+	}
 	kmem_cache_free(ashmem_range_cachep, range);
 }
 
 /*
  * range_shrink - shrinks a range
  *
- * Caller must hold ashmem_mutex.
+ * The range keeps its place in the tree, as it does not move past any of
+ * its neighbours.
+ *
+ * Caller must hold asma->mutex.
  */
 static inline void range_shrink(struct ashmem_range *range,
 				size_t start, size_t end)
 {
 	size_t pre = range_size(range);
 
-	range->pgstart = start;
-	range->pgend = end;
-
-	if (range_on_lru(range))
+	if (range_on_lru(range)) {
+		spin_lock(&ashmem_lru_lock);
+		range->pgstart = start;
+		range->pgend = end;
 		lru_count -= pre - range_size(range);
+		spin_unlock(&ashmem_lru_lock);
+	} else {
+		range->pgstart = start;
+		range->pgend = end;
+	}
 }
 
 static int ashmem_open(struct inode *inode, struct file *file)
@@ -186,7 +300,8 @@ static int ashmem_open(struct inode *inode, struct file *file)
 	if (unlikely(!asma))
 		return -ENOMEM;
 
-	INIT_LIST_HEAD(&asma->unpinned_list);
+	asma->unpinned_tree = RB_ROOT;
+	mutex_init(&asma->mutex);
 	memcpy(asma->name, ASHMEM_NAME_PREFIX, ASHMEM_NAME_PREFIX_LEN);
 	asma->prot_mask = PROT_MASK;
 	file->private_data = asma;
@@ -197,12 +312,12 @@ static int ashmem_open(struct inode *inode, struct file *file)
 static int ashmem_release(struct inode *ignored, struct file *file)
 {
 	struct ashmem_area *asma = file->private_data;
-	struct ashmem_range *range, *next;
+	struct rb_node *n;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned)
-		range_del(range);
-	mutex_unlock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
+	while ((n = rb_first(&asma->unpinned_tree)))
+		range_del(rb_entry(n, struct ashmem_range, unpinned));
+	mutex_unlock(&asma->mutex);
 
 	if (asma->file)
 		fput(asma->file);
@@ -217,7 +332,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* If size is not set, or set to 0, always return EOF. */
 	if (asma->size == 0) {
@@ -238,7 +353,7 @@ static ssize_t ashmem_read(struct file *file, char __user *buf,
 	asma->file->f_pos = *pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -247,7 +362,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	struct ashmem_area *asma = file->private_data;
 	int ret;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	if (asma->size == 0) {
 		ret = -EINVAL;
@@ -268,7 +383,7 @@ static loff_t ashmem_llseek(struct file *file, loff_t offset, int origin)
 	file->f_pos = asma->file->f_pos;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -285,7 +400,7 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	struct ashmem_area *asma = file->private_data;
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* user needs to SET_SIZE before mapping */
 	if (unlikely(!asma->size)) {
@@ -328,10 +443,139 @@ static int ashmem_mmap(struct file *file, struct vm_area_struct *vma)
 	vma->vm_flags |= VM_CAN_NONLINEAR;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
+/*
+ * ashmem_purge_area - purge every unpinned range of 'asma' still holding
+ * pages, in one batch. Returns the number of pages purged.
+ *
+ * Caller must hold asma->mutex.
+ */
+static unsigned long ashmem_purge_area(struct ashmem_area *asma)
+{
+	struct inode *inode = asma->file->f_dentry->d_inode;
+	struct ashmem_range *range;
+	struct rb_node *n;
+	unsigned long nr = 0;
+
+	for (n = rb_first(&asma->unpinned_tree); n; n = rb_next(n)) {
+		range = rb_entry(n, struct ashmem_range, unpinned);
+		if (!range_on_lru(range))
+			continue;
+
+		vmtruncate_range(inode, range->pgstart * PAGE_SIZE,
+				 (range->pgend + 1) * PAGE_SIZE - 1);
+		nr += range_size(range);
+
+		spin_lock(&ashmem_lru_lock);
+		lru_del(range);
+		range->purged = ASHMEM_WAS_PURGED;
+		spin_unlock(&ashmem_lru_lock);
+	}
+
+	return nr;
+}
+
+/*
+ * ashmem_purge - purge at least 'nr_to_scan' pages, least-recently-unpinned
+ * area first, or as many as we can get at. Returns the number of pages
+ * purged.
+ *
+ * Areas that are busy are skipped rather than waited for, so purging never
+ * stalls behind a pin or unpin in progress.
+ */
+static unsigned long ashmem_purge(long nr_to_scan)
+{
+	unsigned long purged = 0;
+
+	while (nr_to_scan > 0) {
+		struct ashmem_range *range;
+		struct ashmem_area *asma = NULL;
+		unsigned long nr;
+		ktime_t start;
+
+		/*
+		 * A range on the LRU keeps its area alive, and once we hold
+		 * the area's mutex nobody else can touch its ranges.
+		 */
+		spin_lock(&ashmem_lru_lock);
+		list_for_each_entry(range, &ashmem_lru_list, lru) {
+			if (mutex_trylock(&range->asma->mutex)) {
+				asma = range->asma;
+				break;
+			}
+		}
+		spin_unlock(&ashmem_lru_lock);
+		if (!asma)
+			break;
+
+		start = ktime_get();
+		nr = ashmem_purge_area(asma);
+		mutex_unlock(&asma->mutex);
+
+		count_vm_events(ASHMEM_PGPURGED, nr);
+		count_vm_event(ASHMEM_PURGE_BATCHES);
+		count_vm_events(ASHMEM_PURGE_USECS,
+				ktime_us_delta(ktime_get(), start));
+
+		purged += nr;
+		nr_to_scan -= nr;
+	}
+
+	return purged;
+}
+
+/*
+ * ashmem_request_purge - add 'nr' pages to the purger thread's work, which
+ * never grows beyond the pages there are to purge
+ */
+static void ashmem_request_purge(long nr)
+{
+	long max = lru_count;
+
+	nr = atomic_long_add_return(nr, &ashmem_purge_request);
+	if (nr < 0)
+		atomic_long_set(&ashmem_purge_request, 0);
+	else if (nr > max)
+		atomic_long_set(&ashmem_purge_request, max);
+}
+
+static int ashmem_purge_needed(void)
+{
+	if (!lru_count)
+		return 0;
+
+	return atomic_long_read(&ashmem_purge_request) > 0 ||
+		global_page_state(NR_FREE_PAGES) < purge_watermark;
+}
+
+/*
+ * ashmem_purger - the purger thread
+ */
+static int ashmem_purger(void *unused)
+{
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		unsigned long nr;
+
+		wait_event_freezable(ashmem_purger_wait,
+				     ashmem_purge_needed() ||
+				     kthread_should_stop());
+
+		nr = ashmem_purge(SWAP_CLUSTER_MAX);
+		ashmem_request_purge(-(long)nr);
+
+		/* every area on the LRU is busy, give their owners a moment */
+		if (!nr)
+			msleep_interruptible(20);
+	}
+
+	return 0;
+}
+
 /*
  * ashmem_shrink - our cache shrinker, called from mm/vmscan.c :: shrink_slab
  *
@@ -344,34 +588,32 @@ out:
  * proceed without risk of deadlock (due to gfp_mask).
  *
  * We approximate LRU via least-recently-unpinned, jettisoning unpinned partial
- * chunks of ashmem regions LRU-wise one-at-a-time until we hit 'nr_to_scan'
- * pages freed.
+ * chunks of ashmem regions LRU-wise one area at a time until we hit
+ * 'nr_to_scan' pages freed.
+ *
+ * Only kswapd purges all of it here. Direct reclaim purges one batch of
+ * SWAP_CLUSTER_MAX pages, so that it gets something back right away, and
+ * hands the rest to the purger thread instead of truncating files for long
+ * in the context of whichever task ran out of memory.
  */
 static int ashmem_shrink(struct shrinker *s, struct shrink_control *sc)
 {
-	struct ashmem_range *range, *next;
-
 	/* We might recurse into filesystem code, so bail out if necessary */
 	if (sc->nr_to_scan && !(sc->gfp_mask & __GFP_FS))
 		return -1;
 	if (!sc->nr_to_scan)
 		return lru_count;
 
-	mutex_lock(&ashmem_mutex);
-	list_for_each_entry_safe(range, next, &ashmem_lru_list, lru) {
-		struct inode *inode = range->asma->file->f_dentry->d_inode;
-		loff_t start = range->pgstart * PAGE_SIZE;
-		loff_t end = (range->pgend + 1) * PAGE_SIZE - 1;
-
-		vmtruncate_range(inode, start, end);
-		range->purged = ASHMEM_WAS_PURGED;
-		lru_del(range);
+	if (ashmem_purger_task && !current_is_kswapd()) {
+		long nr = sc->nr_to_scan;
 
-		sc->nr_to_scan -= range_size(range);
-		if (sc->nr_to_scan <= 0)
-			break;
-	}
-	mutex_unlock(&ashmem_mutex);
+		nr -= ashmem_purge(min_t(long, nr, SWAP_CLUSTER_MAX));
+		if (nr > 0) {
+			ashmem_request_purge(nr);
+			wake_up(&ashmem_purger_wait);
+		}
+	} else
+		ashmem_purge(sc->nr_to_scan);
 
 	return lru_count;
 }
@@ -385,7 +627,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* the user can only remove, not add, protection bits */
 	if (unlikely((asma->prot_mask & prot) != prot)) {
@@ -400,7 +642,7 @@ static int set_prot_mask(struct ashmem_area *asma, unsigned long prot)
 	asma->prot_mask = prot;
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 	return ret;
 }
 
@@ -408,7 +650,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	/* cannot change an existing mapping's name */
 	if (unlikely(asma->file)) {
@@ -422,7 +664,7 @@ static int set_name(struct ashmem_area *asma, void __user *name)
 	asma->name[ASHMEM_FULL_NAME_LEN-1] = '\0';
 
 out:
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -431,7 +673,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 {
 	int ret = 0;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 	if (asma->name[ASHMEM_NAME_PREFIX_LEN] != '\0') {
 		size_t len;
 
@@ -448,7 +690,7 @@ static int get_name(struct ashmem_area *asma, void __user *name)
 					  sizeof(ASHMEM_NAME_DEF))))
 			ret = -EFAULT;
 	}
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -457,17 +699,16 @@ static int get_name(struct ashmem_area *asma, void __user *name)
  * ashmem_pin - pin the given ashmem region, returning whether it was
  * previously purged (ASHMEM_WAS_PURGED) or not (ASHMEM_NOT_PURGED).
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	int ret = ASHMEM_NOT_PURGED;
 
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* moved past last applicable page; we can short circuit */
-		if (range_before_page(range, pgstart))
-			break;
+	for (range = range_lookup(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to pin pages that span multiple ranges,
@@ -510,8 +751,7 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 			 * more complicated, we allocate a new range for the
 			 * second half and adjust the first chunk's endpoint.
 			 */
-			range_alloc(asma, range, range->purged,
-				    pgend + 1, range->pgend);
+			range_alloc(asma, range->purged, pgend + 1, range->pgend);
 			range_shrink(range, range->pgstart, pgstart - 1);
 			break;
 		}
@@ -523,59 +763,48 @@ static int ashmem_pin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 /*
  * ashmem_unpin - unpin the given range of pages. Returns zero on success.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_unpin(struct ashmem_area *asma, size_t pgstart, size_t pgend)
 {
 	struct ashmem_range *range, *next;
 	unsigned int purged = ASHMEM_NOT_PURGED;
 
-restart:
-	list_for_each_entry_safe(range, next, &asma->unpinned_list, unpinned) {
-		/* short circuit: this is our insertion point */
-		if (range_before_page(range, pgstart))
-			break;
+	for (range = range_lookup(asma, pgstart);
+	     range && range->pgstart <= pgend; range = next) {
+		next = range_next(range);
 
 		/*
 		 * The user can ask us to unpin pages that are already entirely
-		 * or partially pinned. We handle those two cases here.
+		 * or partially unpinned. We handle those two cases here.
 		 */
 		if (page_range_subsumed_by_range(range, pgstart, pgend))
 			return 0;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			pgstart = min_t(size_t, range->pgstart, pgstart),
-			pgend = max_t(size_t, range->pgend, pgend);
-			purged |= range->purged;
-			range_del(range);
-			goto restart;
-		}
+		pgstart = min_t(size_t, range->pgstart, pgstart),
+		pgend = max_t(size_t, range->pgend, pgend);
+		purged |= range->purged;
+		range_del(range);
 	}
 
-	return range_alloc(asma, range, purged, pgstart, pgend);
+	return range_alloc(asma, purged, pgstart, pgend);
 }
 
 /*
  * ashmem_get_pin_status - Returns ASHMEM_IS_UNPINNED if _any_ pages in the
  * given interval are unpinned and ASHMEM_IS_PINNED otherwise.
  *
- * Caller must hold ashmem_mutex.
+ * Caller must hold asma->mutex.
  */
 static int ashmem_get_pin_status(struct ashmem_area *asma, size_t pgstart,
 				 size_t pgend)
 {
 	struct ashmem_range *range;
-	int ret = ASHMEM_IS_PINNED;
 
-	list_for_each_entry(range, &asma->unpinned_list, unpinned) {
-		if (range_before_page(range, pgstart))
-			break;
-		if (page_range_in_range(range, pgstart, pgend)) {
-			ret = ASHMEM_IS_UNPINNED;
-			break;
-		}
-	}
+	range = range_lookup(asma, pgstart);
+	if (range && range->pgstart <= pgend)
+		return ASHMEM_IS_UNPINNED;
 
-	return ret;
+	return ASHMEM_IS_PINNED;
 }
 
 static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
@@ -607,7 +836,7 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 	pgstart = pin.offset / PAGE_SIZE;
 	pgend = pgstart + (pin.len / PAGE_SIZE) - 1;
 
-	mutex_lock(&ashmem_mutex);
+	mutex_lock(&asma->mutex);
 
 	switch (cmd) {
 	case ASHMEM_PIN:
@@ -615,13 +844,15 @@ static int ashmem_pin_unpin(struct ashmem_area *asma, unsigned long cmd,
 		break;
 	case ASHMEM_UNPIN:
 		ret = ashmem_unpin(asma, pgstart, pgend);
+		if (global_page_state(NR_FREE_PAGES) < purge_watermark)
+			wake_up(&ashmem_purger_wait);
 		break;
 	case ASHMEM_GET_PIN_STATUS:
 		ret = ashmem_get_pin_status(asma, pgstart, pgend);
 		break;
 	}
 
-	mutex_unlock(&ashmem_mutex);
+	mutex_unlock(&asma->mutex);
 
 	return ret;
 }
@@ -640,10 +871,12 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 		break;
 	case ASHMEM_SET_SIZE:
 		ret = -EINVAL;
+		mutex_lock(&asma->mutex);
 		if (!asma->file) {
 			ret = 0;
 			asma->size = (size_t) arg;
 		}
+		mutex_unlock(&asma->mutex);
 		break;
 	case ASHMEM_GET_SIZE:
 		ret = asma->size;
@@ -662,13 +895,8 @@ static long ashmem_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case ASHMEM_PURGE_ALL_CACHES:
 		ret = -EPERM;
 		if (capable(CAP_SYS_ADMIN)) {
-			struct shrink_control sc = {
-				.gfp_mask = GFP_KERNEL,
-				.nr_to_scan = 0,
-			};
-			ret = ashmem_shrink(&ashmem_shrinker, &sc);
-			sc.nr_to_scan = ret;
-			ashmem_shrink(&ashmem_shrinker, &sc);
+			ret = lru_count;
+			ashmem_purge(ret);
 		}
 		break;
 	}
@@ -719,6 +947,16 @@ static int __init ashmem_init(void)
 		return ret;
 	}
 
+	if (!purge_watermark)
+		purge_watermark = totalram_pages / 64;
+
+	ashmem_purger_task = kthread_run(ashmem_purger, NULL, "ashmemd");
+	if (IS_ERR(ashmem_purger_task)) {
+		printk(KERN_ERR "ashmem: failed to start purger, "
+		       "purging from reclaim\n");
+		ashmem_purger_task = NULL;
+	}
+
 	register_shrinker(&ashmem_shrinker);
 
 	printk(KERN_INFO "ashmem: initialized\n");
@@ -732,6 +970,9 @@ static void __exit ashmem_exit(void)
 
 	unregister_shrinker(&ashmem_shrinker);
 
+	if (ashmem_purger_task)
+		kthread_stop(ashmem_purger_task);
+
 	ret = misc_deregister(&ashmem_misc);
 	if (unlikely(ret))
 		printk(KERN_ERR "ashmem: failed to unregister misc device!\n");
@@ -0,0 +1,185 @@
+/*
+ * Frontswap frontend
+ *
+ * This code provides the generic "frontend" layer to call a matching
+ * "backend" driver implementation of frontswap.  See
+ * Documentation/vm/frontswap.txt for more information.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.
+ */
+
+#include <linux/module.h>
+#include <linux/bitmap.h>
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/frontswap.h>
+
+/*
+ * This global enablement flag is read on every swap in and swap out,
+ * so is preferred to the slower alternative: a function call that
+ * checks a non-global.
+ */
+int frontswap_enabled;
+EXPORT_SYMBOL(frontswap_enabled);
+
+/*
+ * frontswap_ops is set by frontswap_register_ops to contain the pointers
+ * to the frontswap "backend" implementation functions.
+ */
+static struct frontswap_ops frontswap_ops;
+
+/* useful stats available in /sys/kernel/mm/frontswap */
+static unsigned long frontswap_gets;
+static unsigned long frontswap_succ_puts;
+static unsigned long frontswap_failed_puts;
+static unsigned long frontswap_flushes;
+
+/*
+ * register operations for frontswap, returning previous thus allowing
+ * detection of multiple backends and possible nesting
+ */
+struct frontswap_ops frontswap_register_ops(struct frontswap_ops *ops)
+{
+	struct frontswap_ops old = frontswap_ops;
+
+	frontswap_ops = *ops;
+	frontswap_enabled = 1;
+	return old;
+}
+EXPORT_SYMBOL(frontswap_register_ops);
+
+/* Called when a swap device is swapon'd */
+void __frontswap_init(struct swap_info_struct *sis)
+{
+	if (sis->frontswap_map == NULL)
+		return;
+	(*frontswap_ops.init)(sis->type);
+}
+EXPORT_SYMBOL(__frontswap_init);
+
+/*
+ * "Put" data from a page to frontswap and associate it with the page's
+ * swaptype and offset.  Page must be locked and in the swap cache.
+ * If frontswap already contains a page with matching swaptype and
+ * offset, the frontswap implementation may either overwrite the data
+ * and return success or flush the page from frontswap and return
+ * failure; either way the bitmap stays in sync with the backend.
+ */
+int __frontswap_put_page(struct page *page)
+{
+	int ret, dup = 0;
+	swp_entry_t entry = { .val = page_private(page), };
+	struct swap_info_struct *sis = page_swap_info(page);
+	pgoff_t offset = swp_offset(entry);
+
+	VM_BUG_ON(!PageLocked(page));
+	if (sis->frontswap_map == NULL)
+		return -1;
+
+	if (test_bit(offset, sis->frontswap_map))
+		dup = 1;
+	ret = (*frontswap_ops.put_page)(sis->type, offset, page);
+	if (ret == 0) {
+		set_bit(offset, sis->frontswap_map);
+		frontswap_succ_puts++;
+	} else {
+		/* a failed dup put has flushed the older copy */
+		if (dup)
+			clear_bit(offset, sis->frontswap_map);
+		frontswap_failed_puts++;
+	}
+	return ret;
+}
+EXPORT_SYMBOL(__frontswap_put_page);
+
+/*
+ * "Get" data from frontswap associated with swaptype and offset that were
+ * specified when the data was put to frontswap and use it to fill the
+ * specified page with data. Page must be locked and in the swap cache.
+ */
+int __frontswap_get_page(struct page *page)
+{
+	int ret = -1;
+	swp_entry_t entry = { .val = page_private(page), };
+	struct swap_info_struct *sis = page_swap_info(page);
+	pgoff_t offset = swp_offset(entry);
+
+	VM_BUG_ON(!PageLocked(page));
+	if (sis->frontswap_map && test_bit(offset, sis->frontswap_map))
+		ret = (*frontswap_ops.get_page)(sis->type, offset, page);
+	if (ret == 0)
+		frontswap_gets++;
+	return ret;
+}
+EXPORT_SYMBOL(__frontswap_get_page);
+
+/*
+ * Flush any data from frontswap associated with the specified swaptype
+ * and offset so that a subsequent "get" will fail.
+ */
+void __frontswap_flush_page(struct swap_info_struct *sis, pgoff_t offset)
+{
+	if (sis->frontswap_map && test_bit(offset, sis->frontswap_map)) {
+		(*frontswap_ops.flush_page)(sis->type, offset);
+		clear_bit(offset, sis->frontswap_map);
+		frontswap_flushes++;
+	}
+}
+EXPORT_SYMBOL(__frontswap_flush_page);
+
+/*
+ * Flush all data from frontswap associated with all offsets for the
+ * specified swaptype.
+ */
+void __frontswap_flush_area(struct swap_info_struct *sis)
+{
+	if (sis->frontswap_map == NULL)
+		return;
+	(*frontswap_ops.flush_area)(sis->type);
+	bitmap_zero(sis->frontswap_map, sis->max);
+}
+EXPORT_SYMBOL(__frontswap_flush_area);
+
+#ifdef CONFIG_SYSFS
+
+#define FRONTSWAP_SYSFS_RO(_name) \
+	static ssize_t frontswap_##_name##_show(struct kobject *kobj, \
+				struct kobj_attribute *attr, char *buf) \
+	{ \
+		return sprintf(buf, "%lu\n", frontswap_##_name); \
+	} \
+	static struct kobj_attribute frontswap_##_name##_attr = { \
+		.attr = { .name = __stringify(_name), .mode = 0444 }, \
+		.show = frontswap_##_name##_show, \
+	}
+
+FRONTSWAP_SYSFS_RO(gets);
+FRONTSWAP_SYSFS_RO(succ_puts);
+FRONTSWAP_SYSFS_RO(failed_puts);
+FRONTSWAP_SYSFS_RO(flushes);
+
+static struct attribute *frontswap_attrs[] = {
+	&frontswap_gets_attr.attr,
+	&frontswap_succ_puts_attr.attr,
+	&frontswap_failed_puts_attr.attr,
+	&frontswap_flushes_attr.attr,
+	NULL,
+};
+
+static struct attribute_group frontswap_attr_group = {
+	.attrs = frontswap_attrs,
+	.name = "frontswap",
+};
+
+#endif /* CONFIG_SYSFS */
+
+static int __init init_frontswap(void)
+{
+#ifdef CONFIG_SYSFS
+	if (sysfs_create_group(mm_kobj, &frontswap_attr_group))
+		printk(KERN_WARNING "frontswap: failed to create sysfs stats\n");
+#endif /* CONFIG_SYSFS */
+	return 0;
+}
+module_init(init_frontswap)
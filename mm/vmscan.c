@@ -1928,6 +1928,37 @@ static inline bool should_continue_reclaim(struct zone *zone,
 	}
 }
 
+static ATOMIC_NOTIFIER_HEAD(reclaim_pressure_notifier);
+
+int register_reclaim_pressure_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_register(&reclaim_pressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(register_reclaim_pressure_notifier);
+
+int unregister_reclaim_pressure_notifier(struct notifier_block *nb)
+{
+	return atomic_notifier_chain_unregister(&reclaim_pressure_notifier, nb);
+}
+EXPORT_SYMBOL_GPL(unregister_reclaim_pressure_notifier);
+
+/*
+ * Tell whoever is interested how well reclaim is going in 'zone'; a high
+ * ratio of scanned to reclaimed pages means the LRU is running dry.
+ */
+static void reclaim_pressure_notify(struct zone *zone, unsigned long scanned,
+				    unsigned long reclaimed)
+{
+	struct reclaim_pressure rp = {
+		.zone = zone,
+		.scanned = scanned,
+		.reclaimed = reclaimed,
+	};
+
+	if (scanned)
+		atomic_notifier_call_chain(&reclaim_pressure_notifier, 0, &rp);
+}
+
 /*
  * This is a basic per-zone page freer.  Used by both kswapd and direct reclaim.
  */
@@ -1970,6 +2001,10 @@ restart:
 	}
 	sc->nr_reclaimed += nr_reclaimed;
 
+	if (scanning_global_lru(sc))
+		reclaim_pressure_notify(zone, sc->nr_scanned - nr_scanned,
+					nr_reclaimed);
+
 	/*
 	 * Even if we did not try to evict anon pages at all, we want to
 	 * rebalance the anon lru active/inactive ratio.
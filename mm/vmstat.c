@@ -785,6 +785,11 @@ const char * const vmstat_text[] = {
 	"thp_collapse_alloc_failed",
 	"thp_split",
 #endif
+#ifdef CONFIG_ASHMEM
+	"ashmem_pgpurged",
+	"ashmem_purge_batches",
+	"ashmem_purge_usecs",
+#endif
 
 #endif /* CONFIG_VM_EVENTS_COUNTERS */
 };
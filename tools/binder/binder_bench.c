@@ -0,0 +1,559 @@
+/*
+ * binder_bench - microbenchmark for the binder driver
+ *
+ * This software is licensed under the terms of the GNU General Public
+ * License version 2, as published by the Free Software Foundation, and
+ * may be copied, distributed, and modified under those terms.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/*
+ * The benchmark forks a server process that becomes the binder context
+ * manager and runs one looper thread per client thread.  The client
+ * process then runs the selected scenario on N threads against handle 0
+ * and reports transactions per second and latency percentiles:
+ *
+ *   pingpong  two-way transactions with a small payload
+ *   oneway    bursts of one-way transactions, each burst followed by a
+ *             two-way transaction so the burst is fully delivered
+ *   large     two-way transactions with a large payload
+ *   refs      two-way transactions carrying many binder objects
+ *
+ * It needs a kernel with CONFIG_ANDROID_BINDER_IPC and no other context
+ * manager (no servicemanager) running, e.g. a minimal QEMU image:
+ *
+ *   binder_bench -s pingpong -t 4 -i 100000
+ *
+ * It includes the driver's binder.h, so build it with the Makefile next to
+ * it, which adds drivers/staging/android to the include path:
+ *
+ *   make -C tools/binder CROSS_COMPILE=arm-linux-gnueabi-
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "binder.h"
+
+#define BENCH_MAP_SIZE		(1024 * 1024)
+#define BENCH_CODE		1
+#define BENCH_MAX_REFS		256
+#define BENCH_BUF_WORDS		256
+
+enum bench_scenario {
+	BENCH_PINGPONG,
+	BENCH_ONEWAY,
+	BENCH_LARGE,
+	BENCH_REFS,
+};
+
+static const char *scenario_names[] = {
+	[BENCH_PINGPONG]	= "pingpong",
+	[BENCH_ONEWAY]		= "oneway",
+	[BENCH_LARGE]		= "large",
+	[BENCH_REFS]		= "refs",
+};
+
+static struct {
+	enum bench_scenario	scenario;
+	int			threads;
+	long			iterations;
+	size_t			payload;
+	int			burst;
+	int			refs;
+} opts = {
+	.scenario	= BENCH_PINGPONG,
+	.threads	= 1,
+	.iterations	= 10000,
+	.payload	= 0,
+	.burst		= 16,
+	.refs		= 32,
+};
+
+static int binder_fd;
+
+/* Pending commands, sent with the next BINDER_WRITE_READ */
+struct bench_wbuf {
+	uint8_t	data[BENCH_BUF_WORDS * sizeof(uint32_t)];
+	size_t	len;
+};
+
+struct bench_thread {
+	pthread_t	thread;
+	int		id;
+	uint64_t	*lat;	/* per iteration latency in ns */
+	long		count;
+	int		error;
+};
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void wbuf_put(struct bench_wbuf *w, uint32_t cmd,
+		     const void *arg, size_t size)
+{
+	if (w->len + sizeof(cmd) + size > sizeof(w->data)) {
+		fprintf(stderr, "binder_bench: write buffer overflow\n");
+		exit(1);
+	}
+	memcpy(w->data + w->len, &cmd, sizeof(cmd));
+	w->len += sizeof(cmd);
+	if (size)
+		memcpy(w->data + w->len, arg, size);
+	w->len += size;
+}
+
+static void wbuf_put_ptr(struct bench_wbuf *w, uint32_t cmd, void *ptr)
+{
+	wbuf_put(w, cmd, &ptr, sizeof(ptr));
+}
+
+/*
+ * Send the pending commands and, if rbuf is set, read back whatever the
+ * driver has for this thread.  Returns the number of bytes read.
+ */
+static long bench_write_read(struct bench_wbuf *w, void *rbuf,
+			     size_t rsize)
+{
+	struct binder_write_read bwr;
+
+	memset(&bwr, 0, sizeof(bwr));
+	bwr.write_buffer = (unsigned long)w->data;
+	bwr.write_size = w->len;
+	bwr.read_buffer = (unsigned long)rbuf;
+	bwr.read_size = rbuf ? rsize : 0;
+
+	while (ioctl(binder_fd, BINDER_WRITE_READ, &bwr) < 0) {
+		if (errno != EINTR)
+			die("BINDER_WRITE_READ");
+		/* the write part may have been consumed already */
+		bwr.write_size -= bwr.write_consumed;
+		bwr.write_buffer += bwr.write_consumed;
+		bwr.write_consumed = 0;
+	}
+	w->len = 0;
+	return bwr.read_consumed;
+}
+
+static void bench_transaction(struct bench_wbuf *w, uint32_t cmd,
+			      unsigned int flags, const void *data,
+			      size_t data_size, const size_t *offsets,
+			      size_t offsets_size)
+{
+	struct binder_transaction_data tr;
+
+	memset(&tr, 0, sizeof(tr));
+	tr.target.handle = 0;
+	tr.code = BENCH_CODE;
+	tr.flags = flags;
+	tr.data_size = data_size;
+	tr.offsets_size = offsets_size;
+	tr.data.ptr.buffer = data;
+	tr.data.ptr.offsets = offsets;
+	wbuf_put(w, cmd, &tr, sizeof(tr));
+}
+
+enum bench_result {
+	BENCH_NONE,
+	BENCH_COMPLETE,	/* BR_TRANSACTION_COMPLETE */
+	BENCH_REPLY,	/* BR_REPLY */
+	BENCH_FAILED,	/* BR_DEAD_REPLY, BR_FAILED_REPLY or BR_ERROR */
+};
+
+/*
+ * Handle the returns in rbuf.  Incoming transactions are answered with an
+ * empty reply (server side), reference count requests are acknowledged
+ * and buffers are freed; the commands for that are queued in w.
+ */
+static enum bench_result bench_parse(struct bench_wbuf *w, uint8_t *rbuf,
+				     long len, int *completes)
+{
+	enum bench_result result = BENCH_NONE;
+	uint8_t *ptr = rbuf;
+
+	while (ptr < rbuf + len) {
+		uint32_t cmd;
+		struct binder_transaction_data tr;
+		struct binder_ptr_cookie pc;
+
+		memcpy(&cmd, ptr, sizeof(cmd));
+		ptr += sizeof(cmd);
+		switch (cmd) {
+		case BR_NOOP:
+		case BR_OK:
+		case BR_SPAWN_LOOPER:
+			break;
+		case BR_TRANSACTION_COMPLETE:
+			(*completes)++;
+			if (result == BENCH_NONE)
+				result = BENCH_COMPLETE;
+			break;
+		case BR_INCREFS:
+		case BR_ACQUIRE:
+			memcpy(&pc, ptr, sizeof(pc));
+			ptr += sizeof(pc);
+			wbuf_put(w, cmd == BR_INCREFS ? BC_INCREFS_DONE :
+				 BC_ACQUIRE_DONE, &pc, sizeof(pc));
+			break;
+		case BR_RELEASE:
+		case BR_DECREFS:
+			ptr += sizeof(pc);
+			break;
+		case BR_TRANSACTION:
+			memcpy(&tr, ptr, sizeof(tr));
+			ptr += sizeof(tr);
+			wbuf_put_ptr(w, BC_FREE_BUFFER,
+				     (void *)tr.data.ptr.buffer);
+			if (!(tr.flags & TF_ONE_WAY))
+				bench_transaction(w, BC_REPLY, 0, NULL, 0,
+						  NULL, 0);
+			break;
+		case BR_REPLY:
+			memcpy(&tr, ptr, sizeof(tr));
+			ptr += sizeof(tr);
+			wbuf_put_ptr(w, BC_FREE_BUFFER,
+				     (void *)tr.data.ptr.buffer);
+			result = BENCH_REPLY;
+			break;
+		case BR_ERROR:
+			ptr += sizeof(int);
+			/* fall through */
+		case BR_DEAD_REPLY:
+		case BR_FAILED_REPLY:
+			return BENCH_FAILED;
+		default:
+			fprintf(stderr, "binder_bench: unexpected return "
+				"0x%x\n", cmd);
+			return BENCH_FAILED;
+		}
+	}
+	return result;
+}
+
+static void *bench_looper(void *arg)
+{
+	struct bench_wbuf w = { .len = 0 };
+	uint32_t rbuf[BENCH_BUF_WORDS];
+	int completes = 0;
+	long len;
+
+	(void)arg;
+	wbuf_put(&w, BC_ENTER_LOOPER, NULL, 0);
+	for (;;) {
+		len = bench_write_read(&w, rbuf, sizeof(rbuf));
+		if (bench_parse(&w, (uint8_t *)rbuf, len, &completes) ==
+		    BENCH_FAILED)
+			fprintf(stderr, "binder_bench: looper got error\n");
+	}
+	return NULL;
+}
+
+static void bench_open(void)
+{
+	struct binder_version version;
+	size_t max_threads = 0;
+	void *map;
+
+	binder_fd = open("/dev/binder", O_RDWR);
+	if (binder_fd < 0)
+		die("open /dev/binder");
+	if (ioctl(binder_fd, BINDER_VERSION, &version) < 0)
+		die("BINDER_VERSION");
+	if (version.protocol_version != BINDER_CURRENT_PROTOCOL_VERSION) {
+		fprintf(stderr, "binder_bench: protocol version %ld, "
+			"expected %d\n", version.protocol_version,
+			BINDER_CURRENT_PROTOCOL_VERSION);
+		exit(1);
+	}
+	map = mmap(NULL, BENCH_MAP_SIZE, PROT_READ, MAP_PRIVATE,
+		   binder_fd, 0);
+	if (map == MAP_FAILED)
+		die("mmap /dev/binder");
+	if (ioctl(binder_fd, BINDER_SET_MAX_THREADS, &max_threads) < 0)
+		die("BINDER_SET_MAX_THREADS");
+}
+
+static void run_server(int ready_fd)
+{
+	pthread_t thread;
+	int i;
+
+	bench_open();
+	if (ioctl(binder_fd, BINDER_SET_CONTEXT_MGR, 0) < 0)
+		die("BINDER_SET_CONTEXT_MGR");
+	for (i = 1; i < opts.threads; i++)
+		if (pthread_create(&thread, NULL, bench_looper, NULL))
+			die("pthread_create");
+	if (write(ready_fd, "r", 1) != 1)
+		die("write");
+	close(ready_fd);
+	bench_looper(NULL);
+}
+
+/*
+ * Run one transaction and wait until the driver is done with it: the
+ * reply for a two-way transaction, BR_TRANSACTION_COMPLETE for one-way.
+ */
+static int bench_call(struct bench_wbuf *w, unsigned int flags,
+		      const void *data, size_t data_size,
+		      const size_t *offsets, size_t offsets_size)
+{
+	uint32_t rbuf[BENCH_BUF_WORDS];
+	enum bench_result result;
+	int completes = 0;
+	long len;
+
+	bench_transaction(w, BC_TRANSACTION, flags, data, data_size,
+			  offsets, offsets_size);
+	do {
+		len = bench_write_read(w, rbuf, sizeof(rbuf));
+		result = bench_parse(w, (uint8_t *)rbuf, len, &completes);
+		if (result == BENCH_FAILED)
+			return -1;
+	} while (flags & TF_ONE_WAY ? !completes : result != BENCH_REPLY);
+	return 0;
+}
+
+static void *bench_client(void *arg)
+{
+	struct bench_thread *bt = arg;
+	struct bench_wbuf w = { .len = 0 };
+	struct flat_binder_object *objs = NULL;
+	size_t offsets[BENCH_MAX_REFS];
+	size_t data_size = opts.payload;
+	size_t offsets_size = 0;
+	void *data;
+	long i;
+	int j;
+
+	if (opts.scenario == BENCH_REFS) {
+		data_size = opts.refs * sizeof(*objs);
+		offsets_size = opts.refs * sizeof(offsets[0]);
+	}
+	data = calloc(1, data_size ? data_size : 1);
+	if (data == NULL)
+		die("calloc");
+	if (opts.scenario == BENCH_REFS) {
+		objs = data;
+		for (j = 0; j < opts.refs; j++) {
+			/* each thread uses its own set of local objects */
+			objs[j].type = BINDER_TYPE_BINDER;
+			objs[j].binder = (void *)(uintptr_t)
+				((bt->id * BENCH_MAX_REFS + j + 1) * 16);
+			objs[j].cookie = objs[j].binder;
+			offsets[j] = j * sizeof(*objs);
+		}
+	}
+
+	for (i = 0; i < opts.iterations; i++) {
+		uint64_t start = now_ns();
+
+		if (opts.scenario == BENCH_ONEWAY) {
+			for (j = 0; j < opts.burst; j++)
+				if (bench_call(&w, TF_ONE_WAY, data,
+					       data_size, NULL, 0))
+					goto err;
+		}
+		if (bench_call(&w, 0, data, data_size,
+			       offsets_size ? offsets : NULL, offsets_size))
+			goto err;
+		bt->lat[i] = now_ns() - start;
+		bt->count++;
+	}
+	/* flush the last BC_FREE_BUFFER */
+	bench_write_read(&w, NULL, 0);
+	free(data);
+	return NULL;
+
+err:
+	fprintf(stderr, "binder_bench: thread %d: transaction failed after "
+		"%ld iterations\n", bt->id, i);
+	bt->error = 1;
+	free(data);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(struct bench_thread *bts, uint64_t elapsed)
+{
+	uint64_t *all;
+	long total = 0, n = 0, per_iter = 1;
+	int i;
+	static const int pct[] = { 50, 90, 99 };
+
+	for (i = 0; i < opts.threads; i++)
+		total += bts[i].count;
+	if (total == 0) {
+		printf("no transactions completed\n");
+		return;
+	}
+	all = malloc(total * sizeof(*all));
+	if (all == NULL)
+		die("malloc");
+	for (i = 0; i < opts.threads; i++) {
+		memcpy(all + n, bts[i].lat, bts[i].count * sizeof(*all));
+		n += bts[i].count;
+	}
+	qsort(all, total, sizeof(*all), cmp_u64);
+
+	if (opts.scenario == BENCH_ONEWAY)
+		per_iter = opts.burst + 1;
+	printf("scenario %s threads %d iterations %ld\n",
+	       scenario_names[opts.scenario], opts.threads, total);
+	printf("transactions/sec %.0f\n",
+	       (double)total * per_iter * 1e9 / elapsed);
+	printf("latency (us) min %.1f", all[0] / 1e3);
+	for (i = 0; i < (int)(sizeof(pct) / sizeof(pct[0])); i++)
+		printf(" p%d %.1f", pct[i],
+		       all[(total - 1) * pct[i] / 100] / 1e3);
+	printf(" max %.1f\n", all[total - 1] / 1e3);
+	free(all);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-s pingpong|oneway|large|refs] [-t threads]\n"
+		"       [-i iterations] [-p payload bytes] [-b burst]\n"
+		"       [-r refs]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_thread *bts;
+	uint64_t start, elapsed;
+	int pipefd[2];
+	pid_t server;
+	char c;
+	int opt, i, status, failed = 0;
+
+	while ((opt = getopt(argc, argv, "s:t:i:p:b:r:")) != -1) {
+		switch (opt) {
+		case 's':
+			for (i = 0; i < (int)(sizeof(scenario_names) /
+					      sizeof(scenario_names[0])); i++)
+				if (!strcmp(optarg, scenario_names[i]))
+					break;
+			if (i == sizeof(scenario_names) /
+				 sizeof(scenario_names[0]))
+				usage(argv[0]);
+			opts.scenario = i;
+			if (opts.scenario == BENCH_LARGE && !opts.payload)
+				opts.payload = 64 * 1024;
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'i':
+			opts.iterations = atol(optarg);
+			break;
+		case 'p':
+			opts.payload = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			opts.burst = atoi(optarg);
+			break;
+		case 'r':
+			opts.refs = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.threads < 1 || opts.iterations < 1 || opts.burst < 1 ||
+	    opts.refs < 1 || opts.refs > BENCH_MAX_REFS)
+		usage(argv[0]);
+	if (opts.payload * opts.threads > BENCH_MAP_SIZE / 2) {
+		fprintf(stderr, "binder_bench: payload too large for %d "
+			"threads\n", opts.threads);
+		exit(1);
+	}
+
+	if (pipe(pipefd))
+		die("pipe");
+	server = fork();
+	if (server < 0)
+		die("fork");
+	if (server == 0) {
+		close(pipefd[0]);
+		run_server(pipefd[1]);
+		exit(0);
+	}
+	close(pipefd[1]);
+	if (read(pipefd[0], &c, 1) != 1) {
+		fprintf(stderr, "binder_bench: server failed to start\n");
+		waitpid(server, &status, 0);
+		exit(1);
+	}
+	close(pipefd[0]);
+
+	bench_open();
+	if (opts.scenario == BENCH_REFS) {
+		/* services BR_INCREFS and BR_ACQUIRE for our objects */
+		pthread_t looper;
+
+		if (pthread_create(&looper, NULL, bench_looper, NULL))
+			die("pthread_create");
+	}
+
+	bts = calloc(opts.threads, sizeof(*bts));
+	if (bts == NULL)
+		die("calloc");
+	for (i = 0; i < opts.threads; i++) {
+		bts[i].id = i;
+		bts[i].lat = malloc(opts.iterations * sizeof(uint64_t));
+		if (bts[i].lat == NULL)
+			die("malloc");
+	}
+	start = now_ns();
+	for (i = 0; i < opts.threads; i++)
+		if (pthread_create(&bts[i].thread, NULL, bench_client, &bts[i]))
+			die("pthread_create");
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(bts[i].thread, NULL);
+		failed |= bts[i].error;
+	}
+	elapsed = now_ns() - start;
+
+	report(bts, elapsed);
+
+	kill(server, SIGTERM);
+	waitpid(server, &status, 0);
+	return failed;
+}
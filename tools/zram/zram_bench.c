@@ -0,0 +1,289 @@
+/*
+ * zram_bench - write/read throughput benchmark for zram devices
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * The benchmark splits the device into one region per thread and has
+ * every thread write its region page by page with O_DIRECT, the way swap
+ * writes anonymous pages out, then read it back and check the contents.
+ * Pages are filled so that they compress to roughly the requested ratio.
+ * It reports MB/s and per-page latency percentiles for both phases.
+ *
+ * Comparing runs with -t 1 and -t <ncpus> shows how well compression
+ * scales across cores; /sys/block/zram<id>/max_comp_streams caps the
+ * number of concurrent compressions:
+ *
+ *   echo $((256 << 20)) > /sys/block/zram0/disksize
+ *   zram_bench -d /dev/zram0 -t 4 -s 256
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+
+#define BENCH_PAGE_SIZE		4096
+
+static struct {
+	const char	*device;
+	int		threads;
+	long		size_mb;
+	int		ratio;		/* percent of each page that is random */
+} opts = {
+	.device		= "/dev/zram0",
+	.threads	= 1,
+	.size_mb	= 64,
+	.ratio		= 40,
+};
+
+static int dev_fd;
+
+struct bench_thread {
+	pthread_t	thread;
+	int		id;
+	off_t		start;		/* first byte of this thread's region */
+	long		pages;
+	uint64_t	*wlat;		/* per page write latency in ns */
+	uint64_t	*rlat;		/* per page read latency in ns */
+	uint64_t	wtime;
+	uint64_t	rtime;
+	int		error;
+};
+
+static pthread_barrier_t phase_barrier;
+
+static void die(const char *msg)
+{
+	perror(msg);
+	exit(1);
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Deterministic page contents: a random head of ratio percent and a
+ * repeating tail, tagged with the page number for verification.
+ */
+static void fill_page(uint8_t *buf, uint64_t pgno)
+{
+	uint32_t x = (uint32_t)(pgno * 2654435761u) | 1;
+	size_t i, random = BENCH_PAGE_SIZE * opts.ratio / 100;
+
+	for (i = 0; i < random; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		buf[i] = x;
+	}
+	for (; i < BENCH_PAGE_SIZE; i++)
+		buf[i] = i & 0x3f;
+	memcpy(buf, &pgno, sizeof(pgno));
+}
+
+static void *bench_thread(void *arg)
+{
+	struct bench_thread *bt = arg;
+	uint8_t *buf, *expect;
+	uint64_t t, start;
+	long i;
+
+	if (posix_memalign((void **)&buf, BENCH_PAGE_SIZE, BENCH_PAGE_SIZE) ||
+	    posix_memalign((void **)&expect, BENCH_PAGE_SIZE,
+			   BENCH_PAGE_SIZE))
+		die("posix_memalign");
+
+	pthread_barrier_wait(&phase_barrier);
+	start = now_ns();
+	for (i = 0; i < bt->pages; i++) {
+		off_t off = bt->start + (off_t)i * BENCH_PAGE_SIZE;
+
+		fill_page(buf, off / BENCH_PAGE_SIZE);
+		t = now_ns();
+		if (pwrite(dev_fd, buf, BENCH_PAGE_SIZE, off) !=
+		    BENCH_PAGE_SIZE) {
+			perror("pwrite");
+			bt->error = 1;
+			break;
+		}
+		bt->wlat[i] = now_ns() - t;
+	}
+	bt->wtime = now_ns() - start;
+
+	/* Every thread must reach the barrier, even after an error */
+	pthread_barrier_wait(&phase_barrier);
+	if (bt->error)
+		goto out;
+	start = now_ns();
+	for (i = 0; i < bt->pages; i++) {
+		off_t off = bt->start + (off_t)i * BENCH_PAGE_SIZE;
+
+		t = now_ns();
+		if (pread(dev_fd, buf, BENCH_PAGE_SIZE, off) !=
+		    BENCH_PAGE_SIZE) {
+			perror("pread");
+			bt->error = 1;
+			goto out;
+		}
+		bt->rlat[i] = now_ns() - t;
+
+		fill_page(expect, off / BENCH_PAGE_SIZE);
+		if (memcmp(buf, expect, BENCH_PAGE_SIZE)) {
+			fprintf(stderr, "zram_bench: data mismatch at "
+				"page %lld\n",
+				(long long)(off / BENCH_PAGE_SIZE));
+			bt->error = 1;
+			goto out;
+		}
+	}
+	bt->rtime = now_ns() - start;
+out:
+	free(buf);
+	free(expect);
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void report(const char *phase, struct bench_thread *bts, int write)
+{
+	static const int pct[] = { 50, 90, 99 };
+	uint64_t *all, elapsed = 0;
+	long total = 0, n = 0;
+	int i;
+
+	for (i = 0; i < opts.threads; i++) {
+		uint64_t t = write ? bts[i].wtime : bts[i].rtime;
+
+		total += bts[i].pages;
+		if (t > elapsed)
+			elapsed = t;
+	}
+	if (!total || !elapsed)
+		return;
+
+	all = malloc(total * sizeof(*all));
+	if (all == NULL)
+		die("malloc");
+	for (i = 0; i < opts.threads; i++) {
+		memcpy(all + n, write ? bts[i].wlat : bts[i].rlat,
+		       bts[i].pages * sizeof(*all));
+		n += bts[i].pages;
+	}
+	qsort(all, total, sizeof(*all), cmp_u64);
+
+	printf("%-5s MB/s %.1f", phase,
+	       (double)total * BENCH_PAGE_SIZE * 1e9 / elapsed / (1 << 20));
+	printf("  latency (us) min %.1f", all[0] / 1e3);
+	for (i = 0; i < (int)(sizeof(pct) / sizeof(pct[0])); i++)
+		printf(" p%d %.1f", pct[i],
+		       all[(total - 1) * pct[i] / 100] / 1e3);
+	printf(" max %.1f\n", all[total - 1] / 1e3);
+	free(all);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-d device] [-t threads] [-s size MB]\n"
+		"       [-r percent of each page left incompressible]\n",
+		name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_thread *bts;
+	long pages, per_thread;
+	int opt, i, failed = 0;
+
+	while ((opt = getopt(argc, argv, "d:t:s:r:")) != -1) {
+		switch (opt) {
+		case 'd':
+			opts.device = optarg;
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 's':
+			opts.size_mb = atol(optarg);
+			break;
+		case 'r':
+			opts.ratio = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (opts.threads < 1 || opts.size_mb < 1 || opts.ratio < 0 ||
+	    opts.ratio > 100)
+		usage(argv[0]);
+
+	dev_fd = open(opts.device, O_RDWR | O_DIRECT);
+	if (dev_fd < 0)
+		die(opts.device);
+
+	pages = opts.size_mb * (1024 * 1024 / BENCH_PAGE_SIZE);
+	per_thread = pages / opts.threads;
+	if (!per_thread)
+		usage(argv[0]);
+
+	if (pthread_barrier_init(&phase_barrier, NULL, opts.threads))
+		die("pthread_barrier_init");
+
+	bts = calloc(opts.threads, sizeof(*bts));
+	if (bts == NULL)
+		die("calloc");
+	for (i = 0; i < opts.threads; i++) {
+		bts[i].id = i;
+		bts[i].start = (off_t)i * per_thread * BENCH_PAGE_SIZE;
+		bts[i].pages = per_thread;
+		bts[i].wlat = malloc(per_thread * sizeof(uint64_t));
+		bts[i].rlat = malloc(per_thread * sizeof(uint64_t));
+		if (bts[i].wlat == NULL || bts[i].rlat == NULL)
+			die("malloc");
+	}
+	for (i = 0; i < opts.threads; i++)
+		if (pthread_create(&bts[i].thread, NULL, bench_thread, &bts[i]))
+			die("pthread_create");
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(bts[i].thread, NULL);
+		failed |= bts[i].error;
+	}
+
+	printf("device %s threads %d size %ld MB incompressible %d%%\n",
+	       opts.device, opts.threads, opts.size_mb, opts.ratio);
+	if (!failed) {
+		report("write", bts, 1);
+		report("read", bts, 0);
+	}
+
+	close(dev_fd);
+	return failed;
+}